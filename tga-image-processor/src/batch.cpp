@@ -0,0 +1,502 @@
+#include "batch.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <fstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "buffers.h"
+#include "incremental.h"
+#include "job.h"
+#include "mosaic.h"
+
+using namespace std;
+
+// Modification time in nanoseconds and size of a file, false if there is none
+static bool fileStamp(string const & filename, long long & modified, long long & size)
+{
+    struct stat info;
+
+    if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+
+    modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    size = info.st_size;
+
+    return true;
+}
+
+ImageCache::ImageCache(size_t capacity)
+    : capacity(capacity), used(0), hitCount(0), missCount(0)
+{
+}
+
+TGA ImageCache::load(string const & filename, string const & errorMessage)
+{
+    long long modified = 0;
+    long long size = 0;
+
+    if (filename == "-" || !fileStamp(filename, modified, size)) {
+        lock_guard<std::mutex> lock(mutex);
+        missCount++;
+        return readTGA(filename, errorMessage);
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+
+        auto found = entries.find(filename);
+
+        if (found != entries.end()) {
+            Entry & entry = found->second;
+
+            if (entry.modified == modified && entry.size == size) {
+                order.splice(order.begin(), order, entry.position);
+                hitCount++;
+
+                return entry.image;
+            }
+
+            // Changed since, read it again
+            used -= entry.bytes;
+            order.erase(entry.position);
+            entries.erase(found);
+        }
+
+        missCount++;
+    }
+
+    TGA image = readTGA(filename, errorMessage);
+    shareTGA(image);
+
+    lock_guard<std::mutex> lock(mutex);
+    insert(filename, image, modified, size);
+
+    return image;
+}
+
+void ImageCache::store(string const & filename, TGA image)
+{
+    long long modified = 0;
+    long long size = 0;
+
+    if (filename == "-" || !fileStamp(filename, modified, size)) {
+        return;
+    }
+
+    shareTGA(image);
+
+    lock_guard<std::mutex> lock(mutex);
+
+    auto found = entries.find(filename);
+
+    if (found != entries.end()) {
+        used -= found->second.bytes;
+        order.erase(found->second.position);
+        entries.erase(found);
+    }
+
+    insert(filename, image, modified, size);
+}
+
+void ImageCache::insert(string const & filename, TGA const & image, long long modified, long long size)
+{
+    order.push_front(filename);
+
+    Entry & entry = entries[filename];
+    entry.image = image;
+    entry.modified = modified;
+    entry.size = size;
+    entry.bytes = image.mapping ? image.mapping->size() : image.dataSize();
+    entry.position = order.begin();
+
+    used += entry.bytes;
+
+    evict();
+}
+
+void ImageCache::evict()
+{
+    // The newest image stays even if it is larger than the whole cache
+    while (used > capacity && order.size() > 1) {
+        auto found = entries.find(order.back());
+
+        used -= found->second.bytes;
+        entries.erase(found);
+        order.pop_back();
+    }
+}
+
+// Jobs loaded ahead of and written behind the one running
+const size_t BATCH_QUEUE_DEPTH = 2;
+
+struct LoadedJob
+{
+    size_t index;
+    TGA image;
+
+    // The mip chain to write as numbered files, if there is one
+    vector<TGA> levels;
+
+    // Incremental jobs keep a sidecar file of tile hashes. A patched job writes
+    // the given tiles from the slots of its image, a grid of the recomputed
+    // tiles (see gatherTiles), over its old output of width x height pixels
+    bool tracked = false;
+    bool patch = false;
+    TileRecord record;
+    vector<int> tiles;
+    vector<int> slots;
+    int width = 0;
+    int height = 0;
+};
+
+// The tile hashes of every image a job reads: the first image, then the inputs
+// of its stages in order
+static vector<vector<unsigned long long>> hashInputs(TGA const & image, Job const & job, ThreadPool & pool)
+{
+    vector<vector<unsigned long long>> hashes(1, hashTiles(image, pool));
+
+    for (Stage const & stage : job.stages) {
+        if (!stage.inputName.empty()) {
+            hashes.push_back(hashTiles(stage.input, pool));
+        }
+        if (!stage.input2Name.empty()) {
+            hashes.push_back(hashTiles(stage.input2, pool));
+        }
+    }
+
+    return hashes;
+}
+
+// Replaces an image of a job by the grid of the given tiles
+static void gatherInto(TGA & image, vector<int> const & tiles, ThreadPool & pool)
+{
+    TGA strip = gatherTiles(image, tiles, pool);
+
+    imageBuffers().release(image.imageData);
+    image = move(strip);
+}
+
+// Runs an incremental job on the tiles whose inputs changed since its sidecar
+// file was written, for a patch of its old output. Returns false if the output
+// has to be computed whole: there is no usable sidecar, the job or its first
+// image header changed, or the output file is not the one last written.
+static bool patchJob(LoadedJob & job, Job & current, bool planar, ThreadPool & pool)
+{
+    TileRecord & record = job.record;
+    TileRecord previous;
+
+    size_t count = record.inputs[0].size();
+    long long modified = 0;
+    long long size = 0;
+
+    if (!readTileRecord(tileRecordName(current.output), previous) || previous.job != record.job ||
+        previous.header != record.header || previous.inputs.size() != record.inputs.size() ||
+        previous.output.size() != count || !fileStamp(current.output, modified, size) ||
+        modified != previous.modified || size != previous.size) {
+        return false;
+    }
+
+    vector<int> changed;
+
+    for (size_t i = 0; i < record.inputs.size(); ++i) {
+        if (previous.inputs[i].size() != count) {
+            return false;
+        }
+    }
+
+    for (size_t tile = 0; tile < count; ++tile) {
+        for (size_t i = 0; i < record.inputs.size(); ++i) {
+            if (record.inputs[i][tile] != previous.inputs[i][tile]) {
+                changed.push_back((int)tile);
+                break;
+            }
+        }
+    }
+
+    if (!stripFits((int)changed.size())) {
+        return false;
+    }
+
+    job.patch = true;
+    job.width = job.image.width;
+    job.height = job.image.height;
+    record.output = previous.output;
+
+    cout << "... Recomputing " << changed.size() << " of " << count << " tiles of " << current.output << endl;
+
+    if (changed.empty()) {
+        job.image = TGA();
+        return true;
+    }
+
+    // The tiles go through the chain as one image of their own, with the same
+    // tiles of every input
+    gatherInto(job.image, changed, pool);
+
+    for (Stage & stage : current.stages) {
+        if (!stage.inputName.empty()) {
+            gatherInto(stage.input, changed, pool);
+        }
+        if (!stage.input2Name.empty()) {
+            gatherInto(stage.input2, changed, pool);
+        }
+    }
+
+    job.image = runJob(move(job.image), current, planar, pool);
+
+    // Only the tiles that come out different are written
+    for (size_t slot = 0; slot < changed.size(); ++slot) {
+        int tile = changed[slot];
+        unsigned long long hash = hashSlot(job.image, (int)slot, tile, job.width, job.height);
+
+        if (hash != record.output[tile]) {
+            record.output[tile] = hash;
+            job.tiles.push_back(tile);
+            job.slots.push_back((int)slot);
+        }
+    }
+
+    return true;
+}
+
+// Splits a manifest line into its arguments at spaces, except inside double
+// quotes, which group an argument such as a formula that has spaces
+static vector<string> splitArguments(string const & line)
+{
+    vector<string> args;
+    string word;
+    bool inWord = false;
+    bool quoted = false;
+
+    for (char ch : line) {
+        if (ch == '"') {
+            quoted = !quoted;
+            inWord = true;
+        }
+        else if (!quoted && isspace((unsigned char)ch)) {
+            if (inWord) {
+                args.push_back(word);
+                word.clear();
+                inWord = false;
+            }
+        }
+        else {
+            word += ch;
+            inWord = true;
+        }
+    }
+
+    if (inWord) {
+        args.push_back(word);
+    }
+
+    return args;
+}
+
+void runBatch(string const & manifest, bool planar, bool rle, MipmapLayout mipmaps,
+              size_t cacheSize, bool incremental, ThreadPool & pool)
+{
+    ifstream file(manifest);
+
+    if (!file) {
+        cout << "Error: Cannot open manifest: " << manifest << endl;
+        exit(1);
+    }
+
+    // Parse every job first, so that bad lines are found before anything is written
+    vector<Job> jobs;
+    string line;
+    int lineNumber = 0;
+
+    while (getline(file, line)) {
+        lineNumber++;
+
+        // The job is parsed as if its line had been given on the command line
+        vector<string> args(1, "project2.out");
+        vector<string> words = splitArguments(line);
+
+        args.insert(args.end(), words.begin(), words.end());
+
+        if (args.size() == 1 || args[1].empty() || args[1][0] == '#') {
+            continue;
+        }
+
+        vector<char*> argv;
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv.push_back(&args[i][0]);
+        }
+
+        cout << "... Job " << lineNumber << ": " << args[1] << endl;
+
+        jobs.push_back(parseJob(1, (int)argv.size(), argv.data()));
+
+        if (usesMosaics(jobs.back())) {
+            cout << "Invalid argument, mosaics cannot be run in a batch." << endl;
+            exit(1);
+        }
+    }
+
+    // The last earlier job writing a file each job reads, -1 if there is none;
+    // and whether an earlier job writes the same output, whose sidecar file is
+    // then not the one of this job
+    vector<long> dependency(jobs.size(), -1);
+    vector<bool> rewritten(jobs.size(), false);
+    unordered_map<string, size_t> lastWriter;
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        vector<string> reads(1, jobs[i].firstImage);
+
+        for (Stage const & stage : jobs[i].stages) {
+            reads.push_back(stage.inputName);
+            reads.push_back(stage.input2Name);
+        }
+
+        for (string const & name : reads) {
+            auto writer = lastWriter.find(name);
+
+            if (writer != lastWriter.end()) {
+                dependency[i] = max(dependency[i], (long)writer->second);
+            }
+        }
+
+        rewritten[i] = lastWriter.count(jobs[i].output) > 0;
+        lastWriter[jobs[i].output] = i;
+    }
+
+    ImageCache cache(cacheSize);
+
+    ImageLoader load = [&](string const & filename, string const & errorMessage) {
+        return cache.load(filename, errorMessage);
+    };
+
+    BoundedQueue<LoadedJob> loaded(BATCH_QUEUE_DEPTH);
+    BoundedQueue<LoadedJob> finished(BATCH_QUEUE_DEPTH);
+
+    // Outputs are written in job order; this counts the ones written so far
+    std::mutex writtenMutex;
+    condition_variable writtenChanged;
+    size_t written = 0;
+
+    thread loader([&] {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            {
+                unique_lock<std::mutex> lock(writtenMutex);
+                writtenChanged.wait(lock, [&] { return (long)written > dependency[i]; });
+            }
+
+            LoadedJob job;
+            job.index = i;
+            job.image = loadJob(jobs[i], load);
+
+            loaded.push(move(job));
+        }
+
+        loaded.close();
+    });
+
+    thread writer([&] {
+        LoadedJob job;
+
+        while (finished.pop(job)) {
+            string const & output = jobs[job.index].output;
+
+            if (job.patch) {
+                if (!job.tiles.empty() && !patchTiles(output, job.image, job.tiles, job.slots, job.width, job.height)) {
+                    cerr << "Error: Writing TGA File" << endl;
+                    cerr << "Error: Cannot write TGA File: " << output << endl;
+                    cerr << "Exiting the program" << endl;
+                    exit(1);
+                }
+            }
+            else if (job.levels.empty()) {
+                writeTGA(job.image, output, rle);
+            }
+            else {
+                writeMipmaps(job.levels, output, rle);
+                job.levels.clear();
+            }
+
+            if (job.tracked) {
+                string sidecar = tileRecordName(output);
+
+                if (!fileStamp(output, job.record.modified, job.record.size) ||
+                    !writeTileRecord(sidecar, job.record)) {
+                    cerr << "Error: Cannot write tile file: " << sidecar << endl;
+                    exit(1);
+                }
+            }
+
+            // Kept for later jobs that read the output; a patched output is
+            // read again from its file
+            if (!job.patch) {
+                cache.store(output, job.image);
+            }
+
+            lock_guard<std::mutex> lock(writtenMutex);
+            written = job.index + 1;
+            writtenChanged.notify_all();
+        }
+    });
+
+    LoadedJob job;
+
+    while (loaded.pop(job)) {
+        Job & current = jobs[job.index];
+
+        // Incremental jobs that work pixel by pixel are tracked by tiles, with
+        // the stdout output and the outputs of several jobs left alone
+        job.tracked = incremental && canPatchTiles(current.stages) && current.output != "-" && !rewritten[job.index];
+
+        if (job.tracked) {
+            job.record.job = hashArguments(current.arguments);
+            job.record.header.resize(TGA_HEADER_SIZE);
+            encodeTGAHeader(job.image, job.record.header.data());
+            job.record.inputs = hashInputs(job.image, current, pool);
+        }
+
+        if (!job.tracked || !patchJob(job, current, planar, pool)) {
+            job.image = runJob(move(job.image), current, planar, pool);
+
+            if (job.tracked) {
+                job.record.output = hashTiles(job.image, pool);
+            }
+        }
+
+        if (mipmaps == MIPMAPS_NUMBERED) {
+            job.levels = buildMipmaps(move(job.image), pool);
+            job.image = job.levels[0];
+        }
+        else if (mipmaps == MIPMAPS_ATLAS) {
+            job.image = packMipmaps(buildMipmaps(move(job.image), pool));
+        }
+
+        shareTGA(job.image);
+
+        // Let go of the inputs, so the cache alone decides what stays in memory;
+        // inputs converted to another pixel format hand their buffer back
+        for (Stage & stage : current.stages) {
+            imageBuffers().release(stage.input.imageData);
+            imageBuffers().release(stage.input2.imageData);
+            stage.input = TGA();
+            stage.input2 = TGA();
+        }
+
+        finished.push(move(job));
+    }
+
+    finished.close();
+
+    loader.join();
+    writer.join();
+
+    cout << "... Ran " << jobs.size() << " jobs, " << cache.misses() << " images read from files and "
+         << cache.hits() << " from memory" << endl;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file batch.h
+ * Running many jobs in one process, with the images they read cached in memory
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "tga.h"
+#include "mipmap.h"
+#include "threadpool.h"
+
+/**
+ * Decoded images by path, kept while their file is unchanged and dropped least
+ * recently used first once they take more than the memory cap. Images written
+ * by a job are kept too, so a later job reading the file gets them from memory.
+ *
+ * The cached images are shared: every copy handed out refers to the same
+ * pixels, and a copy that gets modified copies them first. The cache can be
+ * used from several threads.
+ */
+class ImageCache
+{
+  public:
+    /**
+     * @param capacity The number of bytes of pixels to keep at most
+     */
+    explicit ImageCache(size_t capacity);
+
+    /**
+     * Reads the image from the file, or from memory if the file has the same
+     * modification time and size as when it was cached. stdin ("-") is always read.
+     *
+     * Prints errorMessage and exits if the file cannot be read.
+     */
+    TGA load(std::string const & filename, std::string const & errorMessage);
+
+    /**
+     * Caches an image that was just written to the file.
+     */
+    void store(std::string const & filename, TGA image);
+
+    size_t hits() const { return hitCount; }
+    size_t misses() const { return missCount; }
+
+  private:
+    struct Entry
+    {
+        TGA image;
+        long long modified;
+        long long size;
+        size_t bytes;
+        std::list<std::string>::iterator position;
+    };
+
+    void insert(std::string const & filename, TGA const & image, long long modified, long long size);
+    void evict();
+
+    size_t capacity;
+    size_t used;
+    size_t hitCount;
+    size_t missCount;
+
+    // Guards everything above and below; files are read without holding it
+    std::mutex mutex;
+
+    // Most recently used first
+    std::list<std::string> order;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+/**
+ * Runs every job of a manifest file. Each line holds the arguments of one job,
+ * "[output] [firstImage] [method] [...]" as on the command line, separated by
+ * spaces, with double quotes around an argument that has spaces (such as the
+ * formula of expr); empty lines and lines starting with # are skipped.
+ *
+ * Reading, running and writing overlap: while a job runs on the pool, a loader
+ * thread reads the images of the next jobs and a writer thread writes the
+ * results of the previous ones, each at most a few jobs away. A job that reads
+ * the output of an earlier one is only loaded once that output is written.
+ *
+ * Prints an error and exits at the first job that fails.
+ *
+ * @param manifest The file name of the manifest
+ * @param planar Process the channels as separate planes
+ * @param rle Compress the outputs with run-length encoding
+ * @param mipmaps Whether and how to write the mip chain of every output
+ * @param cacheSize The number of bytes of images to keep in memory between jobs
+ * @param incremental Keep the tile hashes of every job whose stages work pixel by
+ *                    pixel next to its output, and on later runs only compute
+ *                    and write over the old output the tiles whose inputs
+ *                    changed (see incremental.h)
+ * @param pool The threads to run on
+ */
+void runBatch(std::string const & manifest, bool planar, bool rle, MipmapLayout mipmaps,
+              size_t cacheSize, bool incremental, ThreadPool & pool);
@@ -0,0 +1,477 @@
+#include "blend.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BLEND_X86 1
+#endif
+
+// round(x / 255) for 0 <= x <= 65407, exact for every product of two channels
+static inline int divide255(int x)
+{
+    return ((x + 128) * 257) >> 16;
+}
+
+// Overlay takes the multiply branch for b <= 127 and the screen branch above,
+// in both cases the doubled product stays below 65536
+template <BlendMode mode>
+static inline unsigned char blendScalar(int a, int b)
+{
+    if (mode == BLEND_MULTIPLY) {
+        return divide255(a * b);
+    }
+
+    if (mode == BLEND_SCREEN) {
+        return 255 - divide255((255 - a) * (255 - b));
+    }
+
+    if (b <= 127) {
+        return divide255(2 * a * b);
+    }
+
+    return 255 - divide255(2 * (255 - a) * (255 - b));
+}
+
+template <BlendMode mode, bool keepAlpha>
+static void blendBytesScalar(unsigned char * output, const unsigned char * lhs,
+                             const unsigned char * rhs, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        output[i] = (keepAlpha && i % 4 == 3) ? lhs[i] : blendScalar<mode>(lhs[i], rhs[i]);
+    }
+}
+
+#ifdef BLEND_X86
+
+// Screen is multiply on inverted channels, and overlay above 127 is screen, so
+// every mode is a multiply of 8-bit channels widened to 16-bit lanes, with the
+// inputs and the result inverted (xor 0xFF) where needed
+
+static inline __m128i divide255SSE2(__m128i x)
+{
+    return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+}
+
+template <BlendMode mode>
+static inline __m128i blendSSE2(__m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i invert = _mm_set1_epi8(-1);
+
+    if (mode == BLEND_OVERLAY) {
+        // 0xFF in every byte where b >= 128
+        invert = _mm_cmplt_epi8(b, zero);
+    }
+
+    if (mode != BLEND_MULTIPLY) {
+        a = _mm_xor_si128(a, invert);
+        b = _mm_xor_si128(b, invert);
+    }
+
+    __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+    if (mode == BLEND_OVERLAY) {
+        low = _mm_add_epi16(low, low);
+        high = _mm_add_epi16(high, high);
+    }
+
+    __m128i result = _mm_packus_epi16(divide255SSE2(low), divide255SSE2(high));
+
+    if (mode != BLEND_MULTIPLY) {
+        result = _mm_xor_si128(result, invert);
+    }
+
+    return result;
+}
+
+// The alpha byte of every BGRA pixel
+static inline __m128i alphaBytesSSE2()
+{
+    return _mm_set1_epi32((int)0xFF000000);
+}
+
+template <BlendMode mode, bool keepAlpha>
+static void blendBytesSSE2(unsigned char * output, const unsigned char * lhs,
+                           const unsigned char * rhs, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(lhs + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(rhs + i));
+        __m128i result = blendSSE2<mode>(a, b);
+
+        if (keepAlpha) {
+            result = _mm_or_si128(_mm_andnot_si128(alphaBytesSSE2(), result), _mm_and_si128(alphaBytesSSE2(), a));
+        }
+
+        _mm_storeu_si128((__m128i*)(output + i), result);
+    }
+
+    blendBytesScalar<mode, keepAlpha>(output + i, lhs + i, rhs + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divide255AVX2(__m256i x)
+{
+    return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+}
+
+// Same as the SSE2 kernel; unpack and pack both work within 128-bit lanes,
+// so the bytes come back out in their original order
+template <BlendMode mode>
+__attribute__((target("avx2")))
+static inline __m256i blendAVX2(__m256i a, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i invert = _mm256_set1_epi8(-1);
+
+    if (mode == BLEND_OVERLAY) {
+        invert = _mm256_cmpgt_epi8(zero, b);
+    }
+
+    if (mode != BLEND_MULTIPLY) {
+        a = _mm256_xor_si256(a, invert);
+        b = _mm256_xor_si256(b, invert);
+    }
+
+    __m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    __m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+
+    if (mode == BLEND_OVERLAY) {
+        low = _mm256_add_epi16(low, low);
+        high = _mm256_add_epi16(high, high);
+    }
+
+    __m256i result = _mm256_packus_epi16(divide255AVX2(low), divide255AVX2(high));
+
+    if (mode != BLEND_MULTIPLY) {
+        result = _mm256_xor_si256(result, invert);
+    }
+
+    return result;
+}
+
+template <BlendMode mode, bool keepAlpha>
+__attribute__((target("avx2")))
+static void blendBytesAVX2(unsigned char * output, const unsigned char * lhs,
+                           const unsigned char * rhs, size_t count)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+        __m256i result = blendAVX2<mode>(a, b);
+
+        if (keepAlpha) {
+            result = _mm256_or_si256(_mm256_andnot_si256(alpha, result), _mm256_and_si256(alpha, a));
+        }
+
+        _mm256_storeu_si256((__m256i*)(output + i), result);
+    }
+
+    blendBytesSSE2<mode, keepAlpha>(output + i, lhs + i, rhs + i, count - i);
+}
+
+// Compositing works on BGRA pixels widened to 16-bit lanes, two pixels per
+// 128-bit vector. The alpha of each pixel is spread over its four lanes with
+// shuffles, so every step treats the colors and the alpha alike; the alpha
+// lanes only differ where a constant says so.
+
+// All four lanes of each pixel set to its alpha
+static inline __m128i spreadAlphaSSE2(__m128i x)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xFF), 0xFF);
+}
+
+// 0xFFFF in the color lanes, 0 in the alpha lanes
+static inline __m128i colorLanesSSE2()
+{
+    return _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+}
+
+// Colors times alpha, the alpha is multiplied by 255 and so stays the same
+static inline __m128i premultiplySSE2(__m128i x)
+{
+    const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    __m128i factor = _mm_or_si128(_mm_and_si128(spreadAlphaSSE2(x), colorLanesSSE2()), opaque);
+
+    return divide255SSE2(_mm_mullo_epi16(x, factor));
+}
+
+// s + d * (255 - alpha of s) / 255 on premultiplied pixels, which also gives
+// the alpha of the result; it can pass 255 only on invalid input and is
+// saturated when packed
+static inline __m128i overSSE2(__m128i s, __m128i d)
+{
+    __m128i transparency = _mm_sub_epi16(_mm_set1_epi16(255), spreadAlphaSSE2(s));
+
+    return _mm_add_epi16(s, divide255SSE2(_mm_mullo_epi16(d, transparency)));
+}
+
+// round(c * 255 / alpha) for one pixel in 32-bit lanes, 0 where the alpha is 0.
+// c * 255 is exact in a float and the division is correctly rounded, which is
+// close enough for adding 0.5 and truncating to round exactly like integers
+static inline __m128 unpremultiplyPixelSSE2(__m128i x)
+{
+    __m128 value = _mm_cvtepi32_ps(x);
+    __m128 alpha = _mm_shuffle_ps(value, value, 0xFF);
+    __m128 quotient = _mm_div_ps(_mm_mul_ps(value, _mm_set1_ps(255.0f)), alpha);
+
+    quotient = _mm_add_ps(quotient, _mm_set1_ps(0.5f));
+
+    return _mm_and_ps(quotient, _mm_cmpneq_ps(alpha, _mm_setzero_ps()));
+}
+
+// The alpha lanes keep their alpha; the colors saturate when packed
+static inline __m128i unpremultiplySSE2(__m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_cvttps_epi32(unpremultiplyPixelSSE2(_mm_unpacklo_epi16(x, zero)));
+    __m128i high = _mm_cvttps_epi32(unpremultiplyPixelSSE2(_mm_unpackhi_epi16(x, zero)));
+    __m128i colors = _mm_packs_epi32(low, high);
+
+    return _mm_or_si128(_mm_and_si128(colors, colorLanesSSE2()), _mm_andnot_si128(colorLanesSSE2(), x));
+}
+
+template <CompositeMode mode>
+static inline __m128i compositeLanesSSE2(__m128i s, __m128i d)
+{
+    if (mode == COMPOSITE_PREMULTIPLY) {
+        return premultiplySSE2(s);
+    }
+
+    if (mode == COMPOSITE_UNPREMULTIPLY) {
+        return unpremultiplySSE2(s);
+    }
+
+    if (mode == COMPOSITE_OVER_PREMULTIPLIED) {
+        return overSSE2(s, d);
+    }
+
+    return unpremultiplySSE2(overSSE2(premultiplySSE2(s), premultiplySSE2(d)));
+}
+
+template <CompositeMode mode>
+static size_t compositePixelsSSE2(unsigned char * output, const unsigned char * lhs,
+                                  const unsigned char * rhs, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(lhs + 4 * i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(rhs + 4 * i));
+
+        __m128i low = compositeLanesSSE2<mode>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i high = compositeLanesSSE2<mode>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+
+        _mm_storeu_si128((__m128i*)(output + 4 * i), _mm_packus_epi16(low, high));
+    }
+
+    return i;
+}
+
+// The same as the SSE2 versions, on four pixels per vector; the shuffles,
+// unpacks and packs all stay within 128-bit lanes
+
+__attribute__((target("avx2")))
+static inline __m256i spreadAlphaAVX2(__m256i x)
+{
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xFF), 0xFF);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i colorLanesAVX2()
+{
+    return _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiplyAVX2(__m256i x)
+{
+    const __m256i opaque = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+    __m256i factor = _mm256_or_si256(_mm256_and_si256(spreadAlphaAVX2(x), colorLanesAVX2()), opaque);
+
+    return divide255AVX2(_mm256_mullo_epi16(x, factor));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i overAVX2(__m256i s, __m256i d)
+{
+    __m256i transparency = _mm256_sub_epi16(_mm256_set1_epi16(255), spreadAlphaAVX2(s));
+
+    return _mm256_add_epi16(s, divide255AVX2(_mm256_mullo_epi16(d, transparency)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 unpremultiplyPixelsAVX2(__m256i x)
+{
+    __m256 value = _mm256_cvtepi32_ps(x);
+    __m256 alpha = _mm256_shuffle_ps(value, value, 0xFF);
+    __m256 quotient = _mm256_div_ps(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)), alpha);
+
+    quotient = _mm256_add_ps(quotient, _mm256_set1_ps(0.5f));
+
+    return _mm256_and_ps(quotient, _mm256_cmp_ps(alpha, _mm256_setzero_ps(), _CMP_NEQ_UQ));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i unpremultiplyAVX2(__m256i x)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i low = _mm256_cvttps_epi32(unpremultiplyPixelsAVX2(_mm256_unpacklo_epi16(x, zero)));
+    __m256i high = _mm256_cvttps_epi32(unpremultiplyPixelsAVX2(_mm256_unpackhi_epi16(x, zero)));
+    __m256i colors = _mm256_packs_epi32(low, high);
+
+    return _mm256_or_si256(_mm256_and_si256(colors, colorLanesAVX2()), _mm256_andnot_si256(colorLanesAVX2(), x));
+}
+
+template <CompositeMode mode>
+__attribute__((target("avx2")))
+static inline __m256i compositeLanesAVX2(__m256i s, __m256i d)
+{
+    if (mode == COMPOSITE_PREMULTIPLY) {
+        return premultiplyAVX2(s);
+    }
+
+    if (mode == COMPOSITE_UNPREMULTIPLY) {
+        return unpremultiplyAVX2(s);
+    }
+
+    if (mode == COMPOSITE_OVER_PREMULTIPLIED) {
+        return overAVX2(s, d);
+    }
+
+    return unpremultiplyAVX2(overAVX2(premultiplyAVX2(s), premultiplyAVX2(d)));
+}
+
+template <CompositeMode mode>
+__attribute__((target("avx2")))
+static size_t compositePixelsAVX2(unsigned char * output, const unsigned char * lhs,
+                                  const unsigned char * rhs, size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(lhs + 4 * i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(rhs + 4 * i));
+
+        __m256i low = compositeLanesAVX2<mode>(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i high = compositeLanesAVX2<mode>(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+
+        _mm256_storeu_si256((__m256i*)(output + 4 * i), _mm256_packus_epi16(low, high));
+    }
+
+    return i + compositePixelsSSE2<mode>(output + 4 * i, lhs + 4 * i, rhs + 4 * i, count - i);
+}
+
+#endif
+
+static SimdLevel detectSimdLevel()
+{
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+
+    // SSE2 is part of x86-64
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+SimdLevel simdLevel()
+{
+    static const SimdLevel level = detectSimdLevel();
+
+    return level;
+}
+
+typedef void (*BlendKernel)(unsigned char *, const unsigned char *, const unsigned char *, size_t);
+
+template <BlendMode mode, bool keepAlpha>
+static BlendKernel selectKernel(SimdLevel level)
+{
+#ifdef BLEND_X86
+    if (level == SIMD_AVX2) {
+        return blendBytesAVX2<mode, keepAlpha>;
+    }
+
+    if (level == SIMD_SSE2) {
+        return blendBytesSSE2<mode, keepAlpha>;
+    }
+#endif
+
+    (void)level;
+    return nullptr;
+}
+
+bool blendBytes(BlendMode mode, unsigned char * output,
+                const unsigned char * lhs, const unsigned char * rhs, size_t count,
+                bool keepAlpha)
+{
+    // Picked once per mode, not once per call
+    static const BlendKernel kernels[2][3] = {
+        {
+            selectKernel<BLEND_MULTIPLY, false>(simdLevel()),
+            selectKernel<BLEND_SCREEN, false>(simdLevel()),
+            selectKernel<BLEND_OVERLAY, false>(simdLevel())
+        },
+        {
+            selectKernel<BLEND_MULTIPLY, true>(simdLevel()),
+            selectKernel<BLEND_SCREEN, true>(simdLevel()),
+            selectKernel<BLEND_OVERLAY, true>(simdLevel())
+        }
+    };
+
+    BlendKernel kernel = kernels[keepAlpha][mode];
+
+    if (!kernel) {
+        return false;
+    }
+
+    kernel(output, lhs, rhs, count);
+
+    return true;
+}
+
+typedef size_t (*CompositeKernel)(unsigned char *, const unsigned char *, const unsigned char *, size_t);
+
+template <CompositeMode mode>
+static CompositeKernel selectCompositeKernel(SimdLevel level)
+{
+#ifdef BLEND_X86
+    if (level == SIMD_AVX2) {
+        return compositePixelsAVX2<mode>;
+    }
+
+    if (level == SIMD_SSE2) {
+        return compositePixelsSSE2<mode>;
+    }
+#endif
+
+    (void)level;
+    return nullptr;
+}
+
+size_t compositePixels(CompositeMode mode, unsigned char * output,
+                       const unsigned char * lhs, const unsigned char * rhs, size_t count)
+{
+    static const CompositeKernel kernels[4] = {
+        selectCompositeKernel<COMPOSITE_OVER>(simdLevel()),
+        selectCompositeKernel<COMPOSITE_OVER_PREMULTIPLIED>(simdLevel()),
+        selectCompositeKernel<COMPOSITE_PREMULTIPLY>(simdLevel()),
+        selectCompositeKernel<COMPOSITE_UNPREMULTIPLY>(simdLevel())
+    };
+
+    CompositeKernel kernel = kernels[mode];
+
+    return kernel ? kernel(output, lhs, rhs, count) : 0;
+}
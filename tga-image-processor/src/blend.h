@@ -0,0 +1,71 @@
+/**
+ * @file blend.h
+ * Vectorized fixed-point kernels for the multiply, screen and overlay blends,
+ * and for alpha compositing of BGRA pixels
+ */
+
+#pragma once
+
+#include <cstddef>
+
+enum BlendMode
+{
+    BLEND_MULTIPLY,
+    BLEND_SCREEN,
+    BLEND_OVERLAY
+};
+
+enum CompositeMode
+{
+    COMPOSITE_OVER,
+    COMPOSITE_OVER_PREMULTIPLIED,
+    COMPOSITE_PREMULTIPLY,
+    COMPOSITE_UNPREMULTIPLY
+};
+
+enum SimdLevel
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+/**
+ * @return The widest instruction set supported by the CPU, detected once
+ */
+SimdLevel simdLevel();
+
+/**
+ * Blends count bytes of lhs with count bytes of rhs. Every channel of a pixel
+ * blends independently, so whole pixel ranges can be passed as one run of bytes.
+ *
+ * The kernels use exact integer math, round(x / 255) = (x + 128) * 257 >> 16,
+ * which gives the same results as the floating point reference operations.
+ * The output may be the same range as either input.
+ *
+ * @param keepAlpha The bytes are BGRA pixels, and every fourth byte (alpha) is
+ *                  copied from lhs instead of blended
+ * @return false if the CPU has no vector kernel, in which case nothing is written
+ */
+bool blendBytes(BlendMode mode, unsigned char * output,
+                const unsigned char * lhs, const unsigned char * rhs, size_t count,
+                bool keepAlpha = false);
+
+/**
+ * Composites count BGRA pixels, four (SSE2) or eight (AVX2) at a time:
+ *
+ * - over: lhs over rhs (Porter-Duff), both with straight alpha
+ * - over premultiplied: the same with premultiplied alpha, rhs is ignored by
+ *   the other two modes
+ * - premultiply: multiplies the colors of lhs by its alpha
+ * - unpremultiply: divides them back, the colors of transparent pixels become 0
+ *
+ * Products are rounded as in blendBytes and quotients are rounded to nearest,
+ * so the results match the integer reference operations exactly.
+ * The output may be the same range as either input.
+ *
+ * @return The number of pixels done from the start of the ranges, which leaves
+ *         the last few to the caller (or all of them, without vector kernels)
+ */
+size_t compositePixels(CompositeMode mode, unsigned char * output,
+                       const unsigned char * lhs, const unsigned char * rhs, size_t count);
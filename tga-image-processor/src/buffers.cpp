@@ -0,0 +1,102 @@
+#include "buffers.h"
+
+#include <utility>
+
+using namespace std;
+
+// Buffers below this many bytes are not kept
+const size_t SMALL_BUFFER = 65536;
+
+// Free buffers kept for the pixels of images, at most
+const size_t IMAGE_BUFFERS_CAPACITY = 256 << 20;
+
+BufferPool::BufferPool(size_t capacity)
+    : capacity(capacity), kept(0), allocated(0)
+{
+}
+
+size_t BufferPool::sizeClass(size_t size)
+{
+    // Four classes per power of two, so at most a quarter of a buffer is unused
+    size_t step = 1;
+    while (step * 8 <= size) {
+        step *= 2;
+    }
+
+    return (size + step - 1) / step * step;
+}
+
+vector<unsigned char> BufferPool::acquire(size_t size)
+{
+    if (size < SMALL_BUFFER) {
+        return vector<unsigned char>(size);
+    }
+
+    size_t rounded = sizeClass(size);
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+
+        auto found = buffers.lower_bound(size);
+
+        if (found != buffers.end() && found->first <= rounded) {
+            vector<unsigned char> buffer;
+            buffer.swap(found->second);
+            kept -= found->first;
+            buffers.erase(found);
+
+            // Only shrinks, the bytes are left as they are
+            buffer.resize(size);
+            return buffer;
+        }
+
+        allocated++;
+    }
+
+    vector<unsigned char> buffer;
+    buffer.reserve(rounded);
+    buffer.resize(size);
+
+    return buffer;
+}
+
+void BufferPool::release(vector<unsigned char> & buffer)
+{
+    size_t size = buffer.capacity();
+
+    if (size < SMALL_BUFFER) {
+        vector<unsigned char>().swap(buffer);
+        return;
+    }
+
+    // Filled up to its capacity once, so handing it out again never writes to it
+    buffer.resize(size);
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+
+        if (kept + size <= capacity) {
+            kept += size;
+            buffers.insert(make_pair(size, vector<unsigned char>()))->second.swap(buffer);
+            return;
+        }
+    }
+
+    // The pool is full, free it
+    vector<unsigned char>().swap(buffer);
+}
+
+size_t BufferPool::allocations() const
+{
+    lock_guard<std::mutex> lock(mutex);
+
+    return allocated;
+}
+
+BufferPool & imageBuffers()
+{
+    // Never destroyed, images may still hand buffers back during exit
+    static BufferPool * pool = new BufferPool(IMAGE_BUFFERS_CAPACITY);
+
+    return *pool;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file buffers.h
+ * Reuse of the large buffers that hold the pixels of images between runs
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * Buffers handed back once an image is done with them, kept to be handed out
+ * again instead of allocating. Sizes are rounded up to a few classes per power
+ * of two, so images of about the same size share buffers, and a reused buffer
+ * has already been touched, without any page faults or zeroing on the way.
+ *
+ * Small buffers are not worth keeping and are simply allocated and freed.
+ * The pool can be used from several threads.
+ */
+class BufferPool
+{
+  public:
+    /**
+     * @param capacity The number of bytes of free buffers to keep at most
+     */
+    explicit BufferPool(size_t capacity);
+
+    BufferPool(BufferPool const &) = delete;
+    BufferPool & operator=(BufferPool const &) = delete;
+
+    /**
+     * @return A buffer of size bytes, with unspecified contents
+     */
+    std::vector<unsigned char> acquire(size_t size);
+
+    /**
+     * Takes the buffer back for later, leaving it empty.
+     */
+    void release(std::vector<unsigned char> & buffer);
+
+    /**
+     * @return The number of buffers acquire had to allocate so far
+     */
+    size_t allocations() const;
+
+  private:
+    static size_t sizeClass(size_t size);
+
+    size_t capacity;
+    size_t kept;
+    size_t allocated;
+
+    // Free buffers by capacity
+    std::multimap<size_t, std::vector<unsigned char>> buffers;
+
+    mutable std::mutex mutex;
+};
+
+/**
+ * @return The pool the pixels of every image are taken from
+ */
+BufferPool & imageBuffers();
@@ -0,0 +1,209 @@
+#include <iostream>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+using namespace std;
+
+// Sends a job to a server started with project2.out --serve and passes on what
+// it prints, so that a job costs a connection instead of a process start and
+// cold caches. Exits with 1 if the job fails.
+
+void printUsage()
+{
+    cout << "Usage:" << endl;
+    cout << "\t./project2-client [--socket SOCKET] [options] [output] [firstImage] [method] [...]" << endl;
+    cout << endl;
+    cout << "The arguments are those of project2.out, run by the server listening on SOCKET," << endl;
+    cout << "or $PROJECT2_SOCKET, or " << defaultSocketPath() << ". The options can be --planar and --rle." << endl;
+}
+
+static bool writeAll(int fd, const char * data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+// Copies the image the server left in shared memory to stdout, and removes it
+static bool copyShared(string const & status)
+{
+    char name[NAME_MAX + 1];
+    unsigned long long size = 0;
+
+    if (sscanf(status.c_str(), "shm %255s %llu", name, &size) != 2) {
+        return false;
+    }
+
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    void * memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    shm_unlink(name);
+
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    bool ok = writeAll(STDOUT_FILENO, (const char*)memory, size);
+    munmap(memory, size);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int argIndex = 1;
+    const char * environment = getenv("PROJECT2_SOCKET");
+    string socketPath = environment && *environment ? environment : defaultSocketPath();
+
+    if (argIndex + 1 < argc && !strcmp(argv[argIndex], "--socket")) {
+        socketPath = argv[argIndex + 1];
+        argIndex += 2;
+    }
+
+    if (argIndex == argc || !strcmp(argv[argIndex], "--help")) {
+        printUsage();
+        return 0;
+    }
+
+    // Messages go to stderr when the image goes to stdout
+    bool toStdout = false;
+
+    for (int i = argIndex; i < argc; ++i) {
+        if (strncmp(argv[i], "--", 2)) {
+            toStdout = !strcmp(argv[i], "-");
+            break;
+        }
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    // The job's images go to whoever runs the server, so it must be this user:
+    // the socket must be theirs, and so must the process listening on it
+    struct stat socketInfo;
+
+    if (lstat(socketPath.c_str(), &socketInfo) == 0) {
+        if (!S_ISSOCK(socketInfo.st_mode)) {
+            cerr << "Error: Not a socket: " << socketPath << endl;
+            return 1;
+        }
+
+        if (socketInfo.st_uid != getuid()) {
+            cerr << "Error: The socket at " << socketPath << " belongs to another user" << endl;
+            return 1;
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        cerr << "Error: Cannot connect to the server at " << socketPath << endl;
+        return 1;
+    }
+
+    ucred peer;
+    socklen_t peerSize = sizeof(peer);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize) != 0 || peer.uid != getuid()) {
+        cerr << "Error: The server at " << socketPath << " runs as another user" << endl;
+        return 1;
+    }
+
+    char directory[PATH_MAX];
+
+    if (!getcwd(directory, sizeof(directory))) {
+        cerr << "Error: Cannot read the current directory" << endl;
+        return 1;
+    }
+
+    string request = to_string(argc - argIndex + 1) + "\n";
+    request.append(directory, strlen(directory) + 1);
+
+    for (int i = argIndex; i < argc; ++i) {
+        request.append(argv[i], strlen(argv[i]) + 1);
+    }
+
+    if (!writeAll(fd, request.data(), request.size())) {
+        cerr << "Error: Cannot send the job to the server" << endl;
+        return 1;
+    }
+
+    // The messages of the job, then a zero byte and the status line
+    int messages = toStdout ? STDERR_FILENO : STDOUT_FILENO;
+    bool finished = false;
+    string status;
+    char chunk[4096];
+
+    for (;;) {
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            break;
+        }
+
+        if (finished) {
+            status.append(chunk, count);
+            continue;
+        }
+
+        char * end = (char*)memchr(chunk, '\0', count);
+        size_t text = end ? end - chunk : count;
+
+        writeAll(messages, chunk, text);
+
+        if (end) {
+            finished = true;
+            status.append(end + 1, count - text - 1);
+        }
+    }
+
+    close(fd);
+
+    // A job that failed closes the connection without a status
+    if (!finished) {
+        return 1;
+    }
+
+    if (status.compare(0, 3, "shm") == 0) {
+        return copyShared(status) ? 0 : 1;
+    }
+
+    return status.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+#include "codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// Widens an n-bit channel to 8 bits
+static unsigned char expandChannel(int value, int bits)
+{
+    return (unsigned char)((value << (8 - bits)) | (value >> (2 * bits - 8)));
+}
+
+// Fills count pixels with the same pixel, doubling the filled part with every copy
+static void fillPixels(unsigned char * output, const unsigned char * pixel, int pixelBytes, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    memcpy(output, pixel, pixelBytes);
+
+    size_t total = count * pixelBytes;
+
+    for (size_t filled = pixelBytes; filled < total; ) {
+        size_t copy = min(filled, total - filled);
+        memcpy(output + filled, output, copy);
+        filled += copy;
+    }
+}
+
+int decodedChannels(TGA const & header)
+{
+    int type = header.dataTypeCode;
+    bool colorMapped = (type == TGA_COLOR_MAPPED || type == TGA_RLE_COLOR_MAPPED);
+    int depth = (unsigned char)(colorMapped ? header.colorMapDepth : header.bitsPerPixel);
+
+    return (depth == 32 && header.alphaBits() > 0) ? 4 : 3;
+}
+
+PixelDecoder::PixelDecoder()
+    : data(nullptr), size(0), position(0), compressed(false), indexBytes(0),
+      sourceBytes(3), pixelBytes(3), colorMapOrigin(0), left(0), repeat(false)
+{
+}
+
+bool PixelDecoder::open(TGA const & header, const unsigned char * data, size_t size)
+{
+    this->data = data;
+    this->size = size;
+
+    int type = header.dataTypeCode;
+    compressed = (type == TGA_RLE_COLOR_MAPPED || type == TGA_RLE_TRUE_COLOR);
+    indexBytes = (type == TGA_COLOR_MAPPED || type == TGA_RLE_COLOR_MAPPED) ? ((unsigned char)header.bitsPerPixel + 7) / 8 : 0;
+    sourceBytes = indexBytes ? indexBytes : (unsigned char)header.bitsPerPixel / 8;
+    pixelBytes = decodedChannels(header);
+
+    // The color map follows the image ID
+    position = (unsigned char)header.idLength;
+
+    if (position > size) {
+        return false;
+    }
+
+    if (header.colorMapType == 0) {
+        return indexBytes == 0;
+    }
+
+    int depth = (unsigned char)header.colorMapDepth;
+    int entryBytes = (depth + 7) / 8;
+    size_t entries = (unsigned short)header.colorMapLength;
+
+    if (entries * entryBytes > size - position) {
+        return false;
+    }
+
+    colorMapOrigin = (unsigned short)header.colorMapOrigin;
+    colorMap.resize(entries * pixelBytes);
+
+    for (size_t i = 0; i < entries; ++i) {
+        const unsigned char * entry = data + position + i * entryBytes;
+        unsigned char * color = colorMap.data() + i * pixelBytes;
+
+        if (depth == 15 || depth == 16) {
+            // ARRRRRGG GGGBBBBB, little-endian
+            int value = entry[0] | (entry[1] << 8);
+            color[0] = expandChannel(value & 0x1F, 5);
+            color[1] = expandChannel((value >> 5) & 0x1F, 5);
+            color[2] = expandChannel((value >> 10) & 0x1F, 5);
+        }
+        else {
+            // BGR, or BGRA with the alpha channel kept if it is one
+            memcpy(color, entry, pixelBytes);
+        }
+    }
+
+    position += entries * entryBytes;
+
+    return true;
+}
+
+bool PixelDecoder::readPixels(unsigned char * output, size_t count)
+{
+    if (indexBytes == 0) {
+        size_t bytes = count * sourceBytes;
+
+        if (position > size || bytes > size - position) {
+            return false;
+        }
+
+        if (sourceBytes == pixelBytes) {
+            memcpy(output, data + position, bytes);
+        }
+        else {
+            // 32-bit pixels without alpha bits, drop the padding byte
+            convertPixels(output, pixelBytes, data + position, sourceBytes, count);
+        }
+
+        position += bytes;
+
+        return true;
+    }
+
+    if (position > size || count * indexBytes > size - position) {
+        return false;
+    }
+
+    size_t entries = colorMap.size() / pixelBytes;
+
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char * index = data + position;
+        int entry = (indexBytes == 1 ? index[0] : (index[0] | (index[1] << 8))) - colorMapOrigin;
+
+        if (entry < 0 || (size_t)entry >= entries) {
+            return false;
+        }
+
+        memcpy(output + i * pixelBytes, colorMap.data() + entry * pixelBytes, pixelBytes);
+        position += indexBytes;
+    }
+
+    return true;
+}
+
+bool PixelDecoder::decode(unsigned char * output, size_t count)
+{
+    if (!compressed) {
+        return readPixels(output, count);
+    }
+
+    while (count > 0) {
+
+        // Start the next packet: the high bit picks a run of one repeated
+        // pixel or raw pixels, the low seven bits give the count minus one
+        if (left == 0) {
+            if (position >= size) {
+                return false;
+            }
+
+            unsigned char packet = data[position++];
+            left = (packet & 0x7F) + 1;
+            repeat = (packet & 0x80) != 0;
+
+            if (repeat && !readPixels(pixel, 1)) {
+                return false;
+            }
+        }
+
+        size_t take = min(left, count);
+
+        if (repeat) {
+            fillPixels(output, pixel, pixelBytes, take);
+        }
+        else if (!readPixels(output, take)) {
+            return false;
+        }
+
+        output += take * pixelBytes;
+        count -= take;
+        left -= take;
+    }
+
+    return true;
+}
+
+static bool samePixel(const unsigned char * a, const unsigned char * b, int channels)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && (channels == 3 || a[3] == b[3]);
+}
+
+void encodeRLE(const unsigned char * pixels, int channels, int width, int rows, vector<unsigned char> & output)
+{
+    // At worst every packet holds 128 raw pixels
+    size_t start = output.size();
+    size_t packetsPerRow = (width + 127) / 128;
+    output.resize(start + (size_t)rows * ((size_t)width * channels + packetsPerRow));
+
+    unsigned char * out = output.data() + start;
+
+    for (int row = 0; row < rows; ++row) {
+        const unsigned char * line = pixels + (size_t)row * width * channels;
+        int i = 0;
+
+        while (i < width) {
+            int run = 1;
+            while (i + run < width && run < 128 && samePixel(line + (i + run) * channels, line + i * channels, channels)) {
+                run++;
+            }
+
+            if (run >= 2) {
+                *out++ = (unsigned char)(0x80 | (run - 1));
+                memcpy(out, line + i * channels, channels);
+                out += channels;
+                i += run;
+                continue;
+            }
+
+            // Raw pixels until the next run starts
+            int first = i;
+            int raw = 0;
+
+            while (i < width && raw < 128 &&
+                   !(i + 1 < width && samePixel(line + i * channels, line + (i + 1) * channels, channels))) {
+                i++;
+                raw++;
+            }
+
+            *out++ = (unsigned char)(raw - 1);
+            memcpy(out, line + first * channels, raw * channels);
+            out += raw * channels;
+        }
+    }
+
+    output.resize(out - output.data());
+}
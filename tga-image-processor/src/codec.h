@@ -0,0 +1,81 @@
+/**
+ * @file codec.h
+ * Decoding of RLE-compressed and color-mapped TGA pixel data, and RLE encoding
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "tga.h"
+
+// TGA image types
+const int TGA_COLOR_MAPPED = 1;
+const int TGA_TRUE_COLOR = 2;
+const int TGA_RLE_COLOR_MAPPED = 9;
+const int TGA_RLE_TRUE_COLOR = 10;
+
+/**
+ * @param header The header of a file, as stored in the file
+ * @return The number of channels its pixels decode to: 4 if they have alpha
+ *         bits (32-bit pixels or color map entries), 3 otherwise
+ */
+int decodedChannels(TGA const & header);
+
+/**
+ * Turns the pixel data of a TGA file of any supported type into BGR or BGRA
+ * pixels, as given by decodedChannels, front to back, over as many calls as
+ * needed. Runs are expanded with bulk fills and raw true-color packets with
+ * the decoded pixel size are copied straight through.
+ */
+class PixelDecoder
+{
+  public:
+    PixelDecoder();
+
+    /**
+     * @param header The header of the file, as stored in the file
+     * @param data The bytes of the file following the 18-byte header
+     * @param size The number of bytes in data
+     * @return false if the color map is missing or invalid
+     */
+    bool open(TGA const & header, const unsigned char * data, size_t size);
+
+    /**
+     * Decodes the next count pixels.
+     *
+     * @return false if the data ends early or refers to colors outside of the color map
+     */
+    bool decode(unsigned char * output, size_t count);
+
+    int channels() const { return pixelBytes; }
+
+  private:
+    bool readPixels(unsigned char * output, size_t count);
+
+    const unsigned char * data;
+    size_t size;
+    size_t position;
+
+    bool compressed;
+    int indexBytes;
+    int sourceBytes;
+    int pixelBytes;
+    int colorMapOrigin;
+    std::vector<unsigned char> colorMap;
+
+    // What is left of the current packet
+    size_t left;
+    bool repeat;
+    unsigned char pixel[4];
+};
+
+/**
+ * Appends the RLE packets for the given rows of pixels to output. Packets never
+ * cross rows, and a run starts as soon as two neighboring pixels are the same.
+ *
+ * @param channels The number of bytes per pixel, 3 or 4
+ */
+void encodeRLE(const unsigned char * pixels, int channels, int width, int rows,
+               std::vector<unsigned char> & output);
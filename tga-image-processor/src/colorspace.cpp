@@ -0,0 +1,219 @@
+#include "colorspace.h"
+
+#include <algorithm>
+
+#include "kernels.h"
+#include "operations.h"
+
+using namespace std;
+
+// Pixels converted at a time by a round trip
+const int ROUND_TRIP_BLOCK = 256;
+
+// BGRA results take the alpha of the first image, BGR pixels have none
+static inline void keepAlpha(Pixel &, Pixel const &)
+{
+}
+
+static inline void keepAlpha(PixelBGRA & output, PixelBGRA const & tracking)
+{
+    output.data[3] = tracking.data[3];
+}
+
+// Rounds a 16.16 fixed point value to a byte; the shift floors negative values
+// before they are clamped to 0
+static inline unsigned char fromFixed(int v)
+{
+    return (unsigned char)min(max((v + 32768) >> 16, 0), 255);
+}
+
+static inline unsigned char roundToByte(float v)
+{
+    return (unsigned char)min(max(v + 0.5f, 0.0f), 255.0f);
+}
+
+template <typename P>
+void operationGrayscale(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        unsigned char y = (unsigned char)luma(tga[i].data[0], tga[i].data[1], tga[i].data[2]);
+
+        output[i].data[0] = y;
+        output[i].data[1] = y;
+        output[i].data[2] = y;
+
+        keepAlpha(output[i], tga[i]);
+    }
+}
+
+template <typename P>
+static void toYCbCr(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int b = tga[i].data[0];
+        int g = tga[i].data[1];
+        int r = tga[i].data[2];
+
+        // The chroma coefficients add up to 0, so grays get 128
+        output[i].data[2] = (unsigned char)luma(b, g, r);
+        output[i].data[1] = fromFixed(-11059 * r - 21709 * g + 32768 * b + (128 << 16));
+        output[i].data[0] = fromFixed(32768 * r - 27439 * g - 5329 * b + (128 << 16));
+
+        keepAlpha(output[i], tga[i]);
+    }
+}
+
+template <typename P>
+static void fromYCbCr(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int y = tga[i].data[2] << 16;
+        int cb = tga[i].data[1] - 128;
+        int cr = tga[i].data[0] - 128;
+
+        output[i].data[0] = fromFixed(y + 116130 * cb);
+        output[i].data[1] = fromFixed(y - 22554 * cb - 46802 * cr);
+        output[i].data[2] = fromFixed(y + 91881 * cr);
+
+        keepAlpha(output[i], tga[i]);
+    }
+}
+
+template <typename P>
+static void toHSV(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int b = tga[i].data[0];
+        int g = tga[i].data[1];
+        int r = tga[i].data[2];
+
+        int largest = max(max(b, g), r);
+        int delta = largest - min(min(b, g), r);
+
+        // The hue in sixths of the wheel, from the largest channel and how far
+        // the other two are apart
+        float hue = 0.0f;
+
+        if (delta > 0) {
+            if (largest == r) {
+                hue = (float)(g - b) / delta;
+            }
+            else if (largest == g) {
+                hue = 2.0f + (float)(b - r) / delta;
+            }
+            else {
+                hue = 4.0f + (float)(r - g) / delta;
+            }
+        }
+
+        if (hue < 0.0f) {
+            hue += 6.0f;
+        }
+
+        output[i].data[2] = (unsigned char)((int)(hue * (256.0f / 6.0f) + 0.5f) & 255);
+        output[i].data[1] = (unsigned char)(largest > 0 ? (255 * delta + largest / 2) / largest : 0);
+        output[i].data[0] = (unsigned char)largest;
+
+        keepAlpha(output[i], tga[i]);
+    }
+}
+
+template <typename P>
+static void fromHSV(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        float hue = tga[i].data[2] * (6.0f / 256.0f);
+        float saturation = tga[i].data[1] / 255.0f;
+        float value = tga[i].data[0];
+
+        int sector = (int)hue;
+        float fraction = hue - sector;
+
+        float p = value * (1.0f - saturation);
+        float q = value * (1.0f - saturation * fraction);
+        float t = value * (1.0f - saturation * (1.0f - fraction));
+
+        float r, g, b;
+
+        switch (sector) {
+        case 0:
+            r = value; g = t; b = p;
+            break;
+        case 1:
+            r = q; g = value; b = p;
+            break;
+        case 2:
+            r = p; g = value; b = t;
+            break;
+        case 3:
+            r = p; g = q; b = value;
+            break;
+        case 4:
+            r = t; g = p; b = value;
+            break;
+        default:
+            r = value; g = p; b = q;
+            break;
+        }
+
+        output[i].data[0] = roundToByte(b);
+        output[i].data[1] = roundToByte(g);
+        output[i].data[2] = roundToByte(r);
+
+        keepAlpha(output[i], tga[i]);
+    }
+}
+
+template <typename P>
+void operationToSpace(ColorSpace space, P * output, const P * tga, int count)
+{
+    if (space == SPACE_YCBCR) {
+        toYCbCr(output, tga, count);
+    }
+    else {
+        toHSV(output, tga, count);
+    }
+}
+
+template <typename P>
+void operationFromSpace(ColorSpace space, P * output, const P * tga, int count)
+{
+    if (space == SPACE_YCBCR) {
+        fromYCbCr(output, tga, count);
+    }
+    else {
+        fromHSV(output, tga, count);
+    }
+}
+
+template <typename P>
+void operationRoundTrip(ColorSpace space, P * output, const P * tga,
+                        const unsigned char * table, const int * source, unsigned mask, int count)
+{
+    static void (* const kernels[8])(P *, const P *, const unsigned char *, const int *, int) =
+        KERNELS_BY_MASK(lookupChannels, P);
+
+    P converted[ROUND_TRIP_BLOCK];
+
+    for (int offset = 0; offset < count; offset += ROUND_TRIP_BLOCK) {
+        int block = min(ROUND_TRIP_BLOCK, count - offset);
+
+        operationToSpace(space, converted, tga + offset, block);
+
+        if (mask) {
+            kernels[mask](converted, converted, table, source, block);
+        }
+
+        operationFromSpace(space, output + offset, converted, block);
+    }
+}
+
+// The conversions are compiled for both pixel formats
+#define INSTANTIATE_CONVERSIONS(P) \
+    template void operationGrayscale(P *, const P *, int); \
+    template void operationToSpace(ColorSpace, P *, const P *, int); \
+    template void operationFromSpace(ColorSpace, P *, const P *, int); \
+    template void operationRoundTrip(ColorSpace, P *, const P *, const unsigned char *, const int *, unsigned, int);
+
+INSTANTIATE_CONVERSIONS(Pixel)
+INSTANTIATE_CONVERSIONS(PixelBGRA)
@@ -0,0 +1,59 @@
+/**
+ * @file colorspace.h
+ * Conversions between BGR and the luma, YCbCr and HSV color spaces
+ *
+ * Converted images keep three bytes per pixel. In YCbCr the red, green and blue
+ * channels hold Y, Cb and Cr, with the full 0 to 255 range of JPEG (BT.601).
+ * In HSV they hold hue, saturation and value, the hue going round the color
+ * wheel in 256 steps from red at 0. Alpha is left as it is.
+ */
+
+#pragma once
+
+#include "tga.h"
+
+enum ColorSpace
+{
+    SPACE_YCBCR,
+    SPACE_HSV
+};
+
+/**
+ * @return The BT.601 luma of a color, 0.299 red + 0.587 green + 0.114 blue
+ */
+inline int luma(int blue, int green, int red)
+{
+    return (7471 * blue + 38470 * green + 19595 * red + 32768) >> 16;
+}
+
+/**
+ * Replaces every channel by the luma of the pixel.
+ */
+template <typename P>
+void operationGrayscale(P * output, const P * tga, int count);
+
+/**
+ * Converts BGR pixels to the color space. YCbCr and luma use fixed point
+ * multiply-adds in loops without branches, which the compiler vectorizes.
+ */
+template <typename P>
+void operationToSpace(ColorSpace space, P * output, const P * tga, int count);
+
+/**
+ * Converts pixels of the color space back to BGR.
+ */
+template <typename P>
+void operationFromSpace(ColorSpace space, P * output, const P * tga, int count);
+
+/**
+ * Converts BGR pixels to the color space, maps them through a lookup table
+ * there (see operationLookup), and converts them back, a few hundred pixels at
+ * a time in a buffer on the stack. The result is the same as running the three
+ * steps one after the other.
+ * @param mask The channels the lookup changes, changedChannels(table, source)
+ *             worked out once by the caller; with none it only converts there
+ *             and back, and table may be null
+ */
+template <typename P>
+void operationRoundTrip(ColorSpace space, P * output, const P * tga,
+                        const unsigned char * table, const int * source, unsigned mask, int count);
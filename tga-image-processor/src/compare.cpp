@@ -0,0 +1,249 @@
+#include "compare.h"
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "pipeline.h"
+
+using namespace std;
+
+// SSIM windows are 8 x 8 pixels, one every 4 pixels across and down
+const int SSIM_WINDOW = 8;
+const int SSIM_STEP = 4;
+
+// The constants of SSIM for 8-bit values, (0.01 * 255)^2 and (0.03 * 255)^2
+const double SSIM_C1 = 6.5025;
+const double SSIM_C2 = 58.5225;
+
+// Gives both images the number of channels of the one with more
+static void matchChannels(TGA & a, TGA & b)
+{
+    int channels = max(a.channels(), b.channels());
+
+    setChannels(a, channels);
+    setChannels(b, channels);
+}
+
+// The row of b shown in the same place as row y of a
+static const unsigned char * matchingRow(TGA const & a, TGA const & b, int y)
+{
+    bool turned = (a.imageDescriptor ^ b.imageDescriptor) & 0x20;
+    int row = turned ? b.height - 1 - y : y;
+
+    return b.bytes() + (size_t)row * b.width * b.channels();
+}
+
+bool imagesEqual(TGA a, TGA b, ThreadPool & pool)
+{
+    if (a.width != b.width || a.height != b.height) {
+        return false;
+    }
+
+    matchChannels(a, b);
+
+    size_t rowBytes = (size_t)a.width * a.channels();
+    atomic<bool> differ(false);
+
+    pool.parallelFor(a.height, bandRows(a.width), [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            // Bands still waiting when a difference turns up are skipped
+            if (differ.load(memory_order_relaxed)) {
+                return;
+            }
+
+            if (memcmp(a.bytes() + (size_t)y * rowBytes, matchingRow(a, b, y), rowBytes)) {
+                differ = true;
+                return;
+            }
+        }
+    });
+
+    return !differ;
+}
+
+// The mean SSIM of every window of every channel
+static double structuralSimilarity(TGA const & a, TGA const & b, ThreadPool & pool)
+{
+    int width = a.width;
+    int height = a.height;
+    int channels = a.channels();
+    size_t rowBytes = (size_t)width * channels;
+
+    // Images smaller than a window make a single window
+    int windowWidth = min(SSIM_WINDOW, width);
+    int windowHeight = min(SSIM_WINDOW, height);
+    int rows = (height - windowHeight) / SSIM_STEP + 1;
+    int columns = (width - windowWidth) / SSIM_STEP + 1;
+    double size = (double)windowWidth * windowHeight;
+
+    double total = 0.0;
+    mutex merging;
+
+    pool.parallelFor(rows, max(1, bandRows(width) / SSIM_STEP), [&](int begin, int end) {
+        // The sums of every column of bytes over the rows of a window
+        vector<int> sumA(rowBytes);
+        vector<int> sumB(rowBytes);
+        vector<int> squaresA(rowBytes);
+        vector<int> squaresB(rowBytes);
+        vector<int> products(rowBytes);
+        double sum = 0.0;
+
+        for (int r = begin; r < end; ++r) {
+            fill(sumA.begin(), sumA.end(), 0);
+            fill(sumB.begin(), sumB.end(), 0);
+            fill(squaresA.begin(), squaresA.end(), 0);
+            fill(squaresB.begin(), squaresB.end(), 0);
+            fill(products.begin(), products.end(), 0);
+
+            for (int k = 0; k < windowHeight; ++k) {
+                int y = r * SSIM_STEP + k;
+                const unsigned char * rowA = a.bytes() + (size_t)y * rowBytes;
+                const unsigned char * rowB = matchingRow(a, b, y);
+
+                for (size_t i = 0; i < rowBytes; ++i) {
+                    int valueA = rowA[i];
+                    int valueB = rowB[i];
+
+                    sumA[i] += valueA;
+                    sumB[i] += valueB;
+                    squaresA[i] += valueA * valueA;
+                    squaresB[i] += valueB * valueB;
+                    products[i] += valueA * valueB;
+                }
+            }
+
+            for (int column = 0; column < columns; ++column) {
+                for (int c = 0; c < channels; ++c) {
+                    double sa = 0.0;
+                    double sb = 0.0;
+                    double saa = 0.0;
+                    double sbb = 0.0;
+                    double sab = 0.0;
+
+                    for (int x = column * SSIM_STEP; x < column * SSIM_STEP + windowWidth; ++x) {
+                        size_t i = (size_t)x * channels + c;
+
+                        sa += sumA[i];
+                        sb += sumB[i];
+                        saa += squaresA[i];
+                        sbb += squaresB[i];
+                        sab += products[i];
+                    }
+
+                    double meanA = sa / size;
+                    double meanB = sb / size;
+                    double varianceA = saa / size - meanA * meanA;
+                    double varianceB = sbb / size - meanB * meanB;
+                    double covariance = sab / size - meanA * meanB;
+
+                    sum += (2.0 * meanA * meanB + SSIM_C1) * (2.0 * covariance + SSIM_C2) /
+                           ((meanA * meanA + meanB * meanB + SSIM_C1) * (varianceA + varianceB + SSIM_C2));
+                }
+            }
+        }
+
+        lock_guard<mutex> lock(merging);
+        total += sum;
+    });
+
+    return total / ((double)rows * columns * channels);
+}
+
+Comparison compareImages(TGA a, TGA b, ThreadPool & pool)
+{
+    matchChannels(a, b);
+
+    int width = a.width;
+    int channels = a.channels();
+    size_t rowBytes = (size_t)width * channels;
+
+    Comparison comparison;
+    comparison.pixels = a.numPixels();
+
+    uint64_t squares = 0;
+    mutex merging;
+
+    pool.parallelFor(a.height, bandRows(width), [&](int begin, int end) {
+        vector<unsigned char> differences(rowBytes);
+        unsigned char * difference = differences.data();
+
+        int largest = 0;
+        size_t mismatches = 0;
+        uint64_t sum = 0;
+
+        for (int y = begin; y < end; ++y) {
+            const unsigned char * rowA = a.bytes() + (size_t)y * rowBytes;
+            const unsigned char * rowB = matchingRow(a, b, y);
+
+            for (size_t i = 0; i < rowBytes; ++i) {
+                difference[i] = (unsigned char)(rowA[i] > rowB[i] ? rowA[i] - rowB[i] : rowB[i] - rowA[i]);
+            }
+
+            for (size_t i = 0; i < rowBytes; ++i) {
+                largest = max(largest, (int)difference[i]);
+                sum += (uint64_t)(difference[i] * difference[i]);
+            }
+
+            for (int x = 0; x < width; ++x) {
+                int any = 0;
+
+                for (int c = 0; c < channels; ++c) {
+                    any |= difference[x * channels + c];
+                }
+
+                mismatches += any != 0;
+            }
+        }
+
+        lock_guard<mutex> lock(merging);
+        comparison.maxDifference = max(comparison.maxDifference, largest);
+        comparison.mismatches += mismatches;
+        squares += sum;
+    });
+
+    double meanSquare = (double)squares / ((double)comparison.pixels * channels);
+
+    comparison.psnr = meanSquare > 0.0 ? 10.0 * log10(255.0 * 255.0 / meanSquare) : INFINITY;
+    comparison.ssim = structuralSimilarity(a, b, pool);
+
+    return comparison;
+}
+
+bool runCompare(string const & first, string const & second, bool quick, ThreadPool & pool)
+{
+    TGA a = readTGA(first, "File does not exist.");
+    TGA b = readTGA(second, "File does not exist.");
+
+    cout << "... Comparing " << first << " and " << second << endl;
+
+    bool equal = false;
+
+    if (a.width != b.width || a.height != b.height) {
+        cout << "... Sizes differ: " << a.width << "x" << a.height << " and "
+             << b.width << "x" << b.height << endl;
+    }
+    else if (quick) {
+        equal = imagesEqual(move(a), move(b), pool);
+    }
+    else {
+        Comparison comparison = compareImages(move(a), move(b), pool);
+
+        cout << "... Max difference: " << comparison.maxDifference << endl;
+        cout << "... Mismatched pixels: " << comparison.mismatches << " of " << comparison.pixels << endl;
+        cout << "... PSNR: " << comparison.psnr << " dB" << endl;
+        cout << "... SSIM: " << comparison.ssim << endl;
+
+        equal = comparison.mismatches == 0;
+    }
+
+    cout << (equal ? "... Images match!" : "... Images differ!") << endl;
+
+    return equal;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file compare.h
+ * Comparing an image with the one it is expected to match
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "tga.h"
+#include "threadpool.h"
+
+struct Comparison
+{
+    // The largest difference between two bytes of the same pixel and channel
+    int maxDifference = 0;
+
+    // The pixels with any channel that differs, out of all of them
+    size_t mismatches = 0;
+    size_t pixels = 0;
+
+    // The peak signal to noise ratio in dB, infinite for equal images
+    double psnr = 0.0;
+
+    // The mean structural similarity of 8 x 8 windows, 1 for equal images
+    double ssim = 1.0;
+};
+
+/**
+ * @return Whether the images have the same size and pixels, as shown: an image
+ *         stored top to bottom matches the same one stored bottom to top, and
+ *         an opaque image matches the same one with an opaque alpha channel.
+ *         Stops at the first row that differs.
+ */
+bool imagesEqual(TGA a, TGA b, ThreadPool & pool);
+
+/**
+ * Measures how far the pixels of two images of the same size are apart, with
+ * the images matched up as imagesEqual does.
+ *
+ * The differences are taken a row at a time and the windows of SSIM are summed
+ * from the sums of their columns, in loops over the bytes of whole rows that
+ * the compiler vectorizes. Both run in bands of rows across the thread pool.
+ */
+Comparison compareImages(TGA a, TGA b, ThreadPool & pool);
+
+/**
+ * Compares two image files and prints the result: only whether they match if
+ * quick is set, otherwise the measures of compareImages too.
+ *
+ * Prints an error and exits if a file cannot be read.
+ *
+ * @return true if the images match
+ */
+bool runCompare(std::string const & first, std::string const & second, bool quick, ThreadPool & pool);
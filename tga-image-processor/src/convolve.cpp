@@ -0,0 +1,244 @@
+#include "convolve.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#include "buffers.h"
+#include "colorspace.h"
+#include "pipeline.h"
+
+using namespace std;
+
+// Box blurs making up a Gaussian blur
+const int GAUSSIAN_BOXES = 3;
+
+// Slides a window of 2 * radius + 1 pixels along a row
+static void boxRow(unsigned char * output, const unsigned char * input,
+                   int width, int channels, int radius, float scale)
+{
+    int last = width - 1;
+    int inside = min(radius, last);
+    long long sums[4];
+
+    // The window of the first pixel, with the pixels past the edges repeating
+    // them, counted once for all the copies
+    for (int c = 0; c < channels; ++c) {
+        sums[c] = (radius + 1LL) * input[c] + (long long)(radius - inside) * input[last * channels + c];
+
+        for (int i = 1; i <= inside; ++i) {
+            sums[c] += input[i * channels + c];
+        }
+    }
+
+    for (int x = 0; x < width; ++x) {
+        const unsigned char * entering = input + min(x + radius + 1, last) * channels;
+        const unsigned char * leaving = input + max(x - radius, 0) * channels;
+
+        for (int c = 0; c < channels; ++c) {
+            output[x * channels + c] = (unsigned char)(sums[c] * scale + 0.5f);
+            sums[c] += entering[c] - leaving[c];
+        }
+    }
+}
+
+// Slides a window of 2 * radius + 1 rows down the rows [begin, end), a whole
+// row of bytes at a time, summing them as Sum
+template <typename Sum>
+static void boxColumns(unsigned char * output, const unsigned char * input, int width, int height,
+                       int channels, int radius, float scale, int begin, int end)
+{
+    size_t rowBytes = (size_t)width * channels;
+    vector<Sum> sums(rowBytes);
+    Sum * sum = sums.data();
+
+    // The window of the first row: the rows inside the image, plus the edge
+    // rows once for each copy of them past the edges
+    int first = max(begin - radius, 0);
+    int last = min(begin + radius, height - 1);
+    Sum above = first - (begin - radius);
+    Sum below = (begin + radius) - last;
+    const unsigned char * top = input;
+    const unsigned char * bottom = input + (size_t)(height - 1) * rowBytes;
+
+    for (size_t i = 0; i < rowBytes; ++i) {
+        sum[i] = above * top[i] + below * bottom[i];
+    }
+
+    for (int y = first; y <= last; ++y) {
+        const unsigned char * row = input + (size_t)y * rowBytes;
+
+        for (size_t i = 0; i < rowBytes; ++i) {
+            sum[i] += row[i];
+        }
+    }
+
+    for (int y = begin; y < end; ++y) {
+        const unsigned char * entering = input + (size_t)min(y + radius + 1, height - 1) * rowBytes;
+        const unsigned char * leaving = input + (size_t)max(y - radius, 0) * rowBytes;
+        unsigned char * row = output + (size_t)y * rowBytes;
+
+        for (size_t i = 0; i < rowBytes; ++i) {
+            row[i] = (unsigned char)(sum[i] * scale + 0.5f);
+            sum[i] += entering[i] - leaving[i];
+        }
+    }
+}
+
+// One box blur, through a scratch buffer the size of the image
+static void boxPasses(unsigned char * output, const unsigned char * input, unsigned char * scratch,
+                      int width, int height, int channels, int radius, ThreadPool & pool)
+{
+    float scale = (float)(1.0 / (2.0 * radius + 1));
+    size_t rowBytes = (size_t)width * channels;
+    int rows = bandRows(width);
+
+    pool.parallelFor(height, rows, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            boxRow(scratch + y * rowBytes, input + y * rowBytes, width, channels, radius, scale);
+        }
+    });
+
+    // Each band starts its sums over again, so bands are kept large
+    // The sums of narrower windows fit in 32 bits, which vectorize twice as wide
+    bool narrow = (2LL * radius + 1) * 255 <= INT_MAX;
+
+    pool.parallelFor(height, max(rows, min(radius, height / 2) * 2 + 1), [&](int begin, int end) {
+        if (narrow) {
+            boxColumns<int>(output, scratch, width, height, channels, radius, scale, begin, end);
+        }
+        else {
+            boxColumns<long long>(output, scratch, width, height, channels, radius, scale, begin, end);
+        }
+    });
+}
+
+void boxBlur(unsigned char * output, const unsigned char * input,
+             int width, int height, int channels, int radius, ThreadPool & pool)
+{
+    size_t size = (size_t)width * height * channels;
+    vector<unsigned char> scratch = imageBuffers().acquire(size);
+
+    boxPasses(output, input, scratch.data(), width, height, channels, radius, pool);
+
+    imageBuffers().release(scratch);
+}
+
+// The radii of boxes whose successive blurs have the variance of a Gaussian blur
+static void gaussianBoxes(int sigma, int radii[GAUSSIAN_BOXES])
+{
+    const int n = GAUSSIAN_BOXES;
+    double variance = 12.0 * sigma * sigma;
+
+    // The widest odd size below the ideal one, and the next odd size up
+    long long lower = (long long)floor(sqrt(variance / n + 1));
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    long long upper = lower + 2;
+
+    // How many of the boxes take the lower size
+    int count = (int)lround((variance - n * (double)lower * lower - 4.0 * n * lower - 3.0 * n) / (-4.0 * lower - 4));
+
+    for (int i = 0; i < n; ++i) {
+        radii[i] = (int)(((i < count ? lower : upper) - 1) / 2);
+    }
+}
+
+void gaussianBlur(unsigned char * output, const unsigned char * input,
+                  int width, int height, int channels, int sigma, ThreadPool & pool)
+{
+    size_t size = (size_t)width * height * channels;
+    vector<unsigned char> scratch = imageBuffers().acquire(size);
+
+    int radii[GAUSSIAN_BOXES];
+    gaussianBoxes(sigma, radii);
+
+    for (int i = 0; i < GAUSSIAN_BOXES; ++i) {
+        boxPasses(output, i == 0 ? input : output, scratch.data(), width, height, channels, radii[i], pool);
+    }
+
+    imageBuffers().release(scratch);
+}
+
+void unsharpMask(unsigned char * output, const unsigned char * input,
+                 int width, int height, int channels, int sigma, int amount, ThreadPool & pool)
+{
+    size_t rowBytes = (size_t)width * channels;
+    vector<unsigned char> blurred = imageBuffers().acquire(rowBytes * height);
+
+    gaussianBlur(blurred.data(), input, width, height, channels, sigma, pool);
+
+    float strength = amount / 100.0f;
+
+    pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+        const unsigned char * original = input + begin * rowBytes;
+        const unsigned char * blur = blurred.data() + begin * rowBytes;
+        unsigned char * result = output + begin * rowBytes;
+        size_t count = (end - begin) * rowBytes;
+
+        for (size_t i = 0; i < count; ++i) {
+            float v = original[i] + (original[i] - blur[i]) * strength + 0.5f;
+            result[i] = (unsigned char)min(max(v, 0.0f), 255.0f);
+        }
+    });
+
+    imageBuffers().release(blurred);
+}
+
+// Sharpens the luma of width x height pixels whose channel c is at
+// input[c][i * step] for pixel i
+static void sharpenLuma(unsigned char * const output[3], const unsigned char * const input[3], size_t step,
+                        int width, int height, int sigma, int amount, ThreadPool & pool)
+{
+    size_t count = (size_t)width * height;
+    vector<unsigned char> lumas = imageBuffers().acquire(count);
+    vector<unsigned char> blurred = imageBuffers().acquire(count);
+
+    pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+        for (size_t i = (size_t)begin * width; i < (size_t)end * width; ++i) {
+            lumas[i] = (unsigned char)luma(input[0][i * step], input[1][i * step], input[2][i * step]);
+        }
+    });
+
+    gaussianBlur(blurred.data(), lumas.data(), width, height, 1, sigma, pool);
+
+    float strength = amount / 100.0f;
+
+    pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+        for (size_t i = (size_t)begin * width; i < (size_t)end * width; ++i) {
+            float change = (lumas[i] - blurred[i]) * strength + 0.5f;
+
+            for (int c = 0; c < 3; ++c) {
+                float v = input[c][i * step] + change;
+                output[c][i * step] = (unsigned char)min(max(v, 0.0f), 255.0f);
+            }
+        }
+    });
+
+    imageBuffers().release(lumas);
+    imageBuffers().release(blurred);
+}
+
+void lumaSharpen(unsigned char * output, const unsigned char * input,
+                 int width, int height, int channels, int sigma, int amount, ThreadPool & pool)
+{
+    unsigned char * const outputs[3] = { output, output + 1, output + 2 };
+    const unsigned char * const inputs[3] = { input, input + 1, input + 2 };
+
+    sharpenLuma(outputs, inputs, channels, width, height, sigma, amount, pool);
+
+    if (channels == 4 && output != input) {
+        size_t count = (size_t)width * height;
+
+        for (size_t i = 0; i < count; ++i) {
+            output[4 * i + 3] = input[4 * i + 3];
+        }
+    }
+}
+
+void lumaSharpenPlanes(unsigned char * planes[3], int width, int height, int sigma, int amount, ThreadPool & pool)
+{
+    sharpenLuma(planes, planes, 1, width, height, sigma, amount, pool);
+}
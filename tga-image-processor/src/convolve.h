@@ -0,0 +1,59 @@
+/**
+ * @file convolve.h
+ * Separable neighborhood filters: box blur, Gaussian blur, unsharp mask and
+ * luma sharpening
+ */
+
+#pragma once
+
+#include "threadpool.h"
+
+/**
+ * Every filter works on a width x height image of interleaved bytes, channels
+ * of them per pixel, and blurs every channel on its own, alpha included. Pixels
+ * past the edges count as copies of the nearest edge pixel.
+ *
+ * The filters are separable: a horizontal pass over each row writes into a
+ * scratch buffer, and a vertical pass over bands of rows writes the result.
+ * The vertical pass runs over whole rows at a time, which the compiler
+ * vectorizes. Both passes are split across the thread pool by bands of rows.
+ *
+ * The output may be the same buffer as the input.
+ */
+
+/**
+ * Replaces every byte by the mean of the (2 * radius + 1) x (2 * radius + 1)
+ * square around it. The sums slide along the rows and down the columns, so the
+ * cost per pixel is the same for any radius.
+ */
+void boxBlur(unsigned char * output, const unsigned char * input,
+             int width, int height, int channels, int radius, ThreadPool & pool);
+
+/**
+ * Approximates a Gaussian blur with the given standard deviation, in pixels,
+ * by three box blurs of sizes chosen to match its variance.
+ */
+void gaussianBlur(unsigned char * output, const unsigned char * input,
+                  int width, int height, int channels, int sigma, ThreadPool & pool);
+
+/**
+ * Sharpens the image by adding back the difference between it and its Gaussian
+ * blur: output = input + (input - blur) * amount / 100, clamped.
+ *
+ * @param amount The strength in percent
+ */
+void unsharpMask(unsigned char * output, const unsigned char * input,
+                 int width, int height, int channels, int sigma, int amount, ThreadPool & pool);
+
+/**
+ * Sharpens the luma of the image only, leaving its colors alone: the luma is
+ * sharpened as unsharpMask does, and the change is added to every color
+ * channel, which moves Y and keeps Cb and Cr. Alpha is copied.
+ */
+void lumaSharpen(unsigned char * output, const unsigned char * input,
+                 int width, int height, int channels, int sigma, int amount, ThreadPool & pool);
+
+/**
+ * The same for an image split into blue, green and red planes, in place.
+ */
+void lumaSharpenPlanes(unsigned char * planes[3], int width, int height, int sigma, int amount, ThreadPool & pool);
@@ -0,0 +1,499 @@
+#include "expression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// Pixels evaluated at a time, every instruction running over a whole batch
+const int EXPRESSION_BATCH = 64;
+
+// The registers the pixels are loaded into: the channel being computed of each
+// image, then every channel of the tracking image and of the input image in
+// blue, green, red, alpha order. The registers after them hold numbers and the
+// results of the instructions.
+const int REGISTER_A = 0;
+const int REGISTER_B = 1;
+const int REGISTER_A_CHANNELS = 2;
+const int REGISTER_B_CHANNELS = 6;
+const int INPUT_REGISTERS = 10;
+
+struct Function
+{
+    const char * name;
+    Expression::Op op;
+    int arguments;
+};
+
+static const Function FUNCTIONS[] = {
+    { "min", Expression::OP_MIN, 2 },
+    { "max", Expression::OP_MAX, 2 },
+    { "clamp", Expression::OP_CLAMP, 3 },
+    { "lerp", Expression::OP_LERP, 3 },
+    { "select", Expression::OP_SELECT, 3 },
+    { "abs", Expression::OP_ABS, 1 },
+    { "sqrt", Expression::OP_SQRT, 1 }
+};
+
+// The channels of a.x and b.x, in the order of the pixel bytes
+static const char CHANNEL_LETTERS[] = "bgra";
+
+static float evaluate(Expression::Op op, float x, float y, float z)
+{
+    switch (op) {
+    case Expression::OP_ADD:
+        return x + y;
+    case Expression::OP_SUBTRACT:
+        return x - y;
+    case Expression::OP_MULTIPLY:
+        return x * y;
+    case Expression::OP_DIVIDE:
+        return x / y;
+    case Expression::OP_NEGATE:
+        return -x;
+    case Expression::OP_LESS:
+        return x < y ? 1.0f : 0.0f;
+    case Expression::OP_LESS_EQUAL:
+        return x <= y ? 1.0f : 0.0f;
+    case Expression::OP_GREATER:
+        return x > y ? 1.0f : 0.0f;
+    case Expression::OP_GREATER_EQUAL:
+        return x >= y ? 1.0f : 0.0f;
+    case Expression::OP_EQUAL:
+        return x == y ? 1.0f : 0.0f;
+    case Expression::OP_NOT_EQUAL:
+        return x != y ? 1.0f : 0.0f;
+    case Expression::OP_MIN:
+        return min(x, y);
+    case Expression::OP_MAX:
+        return max(x, y);
+    case Expression::OP_CLAMP:
+        return min(max(x, y), z);
+    case Expression::OP_LERP:
+        return x + (y - x) * z;
+    case Expression::OP_SELECT:
+        return x > 0.0f ? y : z;
+    case Expression::OP_ABS:
+        return fabs(x);
+    case Expression::OP_SQRT:
+        return sqrt(max(x, 0.0f));
+    }
+
+    return 0.0f;
+}
+
+// Runs an instruction over a whole batch of its registers; the decoding is
+// done once, and every case is a plain loop the compiler vectorizes
+static void execute(Expression::Instruction const & instruction, float * registers)
+{
+    const int n = EXPRESSION_BATCH;
+
+    float * t = registers + instruction.target * n;
+    const float * x = registers + instruction.operands[0] * n;
+    const float * y = instruction.operands[1] >= 0 ? registers + instruction.operands[1] * n : x;
+    const float * z = instruction.operands[2] >= 0 ? registers + instruction.operands[2] * n : x;
+
+    switch (instruction.op) {
+    case Expression::OP_ADD:
+        for (int i = 0; i < n; ++i) t[i] = x[i] + y[i];
+        break;
+    case Expression::OP_SUBTRACT:
+        for (int i = 0; i < n; ++i) t[i] = x[i] - y[i];
+        break;
+    case Expression::OP_MULTIPLY:
+        for (int i = 0; i < n; ++i) t[i] = x[i] * y[i];
+        break;
+    case Expression::OP_DIVIDE:
+        for (int i = 0; i < n; ++i) t[i] = x[i] / y[i];
+        break;
+    case Expression::OP_NEGATE:
+        for (int i = 0; i < n; ++i) t[i] = -x[i];
+        break;
+    case Expression::OP_LESS:
+        for (int i = 0; i < n; ++i) t[i] = x[i] < y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_LESS_EQUAL:
+        for (int i = 0; i < n; ++i) t[i] = x[i] <= y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_GREATER:
+        for (int i = 0; i < n; ++i) t[i] = x[i] > y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_GREATER_EQUAL:
+        for (int i = 0; i < n; ++i) t[i] = x[i] >= y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_EQUAL:
+        for (int i = 0; i < n; ++i) t[i] = x[i] == y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_NOT_EQUAL:
+        for (int i = 0; i < n; ++i) t[i] = x[i] != y[i] ? 1.0f : 0.0f;
+        break;
+    case Expression::OP_MIN:
+        for (int i = 0; i < n; ++i) t[i] = x[i] < y[i] ? x[i] : y[i];
+        break;
+    case Expression::OP_MAX:
+        for (int i = 0; i < n; ++i) t[i] = x[i] > y[i] ? x[i] : y[i];
+        break;
+    case Expression::OP_CLAMP:
+        for (int i = 0; i < n; ++i) {
+            float v = x[i] > y[i] ? x[i] : y[i];
+            t[i] = v < z[i] ? v : z[i];
+        }
+        break;
+    case Expression::OP_LERP:
+        for (int i = 0; i < n; ++i) t[i] = x[i] + (y[i] - x[i]) * z[i];
+        break;
+    case Expression::OP_SELECT:
+        for (int i = 0; i < n; ++i) t[i] = x[i] > 0.0f ? y[i] : z[i];
+        break;
+    case Expression::OP_ABS:
+        for (int i = 0; i < n; ++i) t[i] = fabsf(x[i]);
+        break;
+    case Expression::OP_SQRT:
+        for (int i = 0; i < n; ++i) t[i] = sqrtf(x[i] > 0.0f ? x[i] : 0.0f);
+        break;
+    }
+}
+
+static void skipSpaces(string const & text, size_t & at)
+{
+    while (at < text.size() && isspace((unsigned char)text[at])) {
+        at++;
+    }
+}
+
+// Consumes the operator if the text continues with it
+static bool accept(string const & text, size_t & at, const char * op)
+{
+    skipSpaces(text, at);
+
+    size_t length = strlen(op);
+
+    if (text.compare(at, length, op) == 0) {
+        at += length;
+        return true;
+    }
+
+    return false;
+}
+
+void Expression::fail(string const & message, size_t at)
+{
+    // The first error is the one worth reporting
+    if (failure.empty()) {
+        failure = message + " at column " + to_string(at + 1);
+    }
+}
+
+int Expression::constant(float value)
+{
+    known.push_back(true);
+    values.push_back(value);
+
+    return (int)known.size() - 1;
+}
+
+int Expression::emit(Op op, int first, int second, int third)
+{
+    int operands[3] = { first, second, third };
+    float numbers[3] = { 0.0f, 0.0f, 0.0f };
+    bool folded = true;
+
+    for (int k = 0; k < 3; ++k) {
+        if (operands[k] >= 0) {
+            folded = folded && known[operands[k]];
+            numbers[k] = values[operands[k]];
+        }
+    }
+
+    // Numbers are worked out now instead of for every pixel
+    if (folded) {
+        return constant(evaluate(op, numbers[0], numbers[1], numbers[2]));
+    }
+
+    known.push_back(false);
+    values.push_back(0.0f);
+
+    Instruction instruction = { op, (int)known.size() - 1, { first, second, third } };
+    code.push_back(instruction);
+
+    return instruction.target;
+}
+
+bool Expression::compile(string const & formula, string & error)
+{
+    code.clear();
+    known.assign(INPUT_REGISTERS, false);
+    values.assign(INPUT_REGISTERS, 0.0f);
+    inputs = 0;
+    inputUsed = false;
+    failure.clear();
+
+    size_t at = 0;
+    result = parseComparison(formula, at);
+
+    skipSpaces(formula, at);
+
+    if (at < formula.size()) {
+        fail(string("unexpected '") + formula[at] + "'", at);
+    }
+
+    if (!failure.empty()) {
+        error = failure;
+        return false;
+    }
+
+    return true;
+}
+
+int Expression::parseComparison(string const & text, size_t & at)
+{
+    int left = parseSum(text, at);
+
+    // The two-character operators first
+    static const char * const operators[] = { "<=", ">=", "==", "!=", "<", ">" };
+    static const Op ops[] = { OP_LESS_EQUAL, OP_GREATER_EQUAL, OP_EQUAL, OP_NOT_EQUAL, OP_LESS, OP_GREATER };
+
+    for (int k = 0; k < 6; ++k) {
+        if (accept(text, at, operators[k])) {
+            return emit(ops[k], left, parseSum(text, at));
+        }
+    }
+
+    return left;
+}
+
+int Expression::parseSum(string const & text, size_t & at)
+{
+    int left = parseProduct(text, at);
+
+    while (failure.empty()) {
+        if (accept(text, at, "+")) {
+            left = emit(OP_ADD, left, parseProduct(text, at));
+        }
+        else if (accept(text, at, "-")) {
+            left = emit(OP_SUBTRACT, left, parseProduct(text, at));
+        }
+        else {
+            break;
+        }
+    }
+
+    return left;
+}
+
+int Expression::parseProduct(string const & text, size_t & at)
+{
+    int left = parseUnary(text, at);
+
+    while (failure.empty()) {
+        if (accept(text, at, "*")) {
+            left = emit(OP_MULTIPLY, left, parseUnary(text, at));
+        }
+        else if (accept(text, at, "/")) {
+            left = emit(OP_DIVIDE, left, parseUnary(text, at));
+        }
+        else {
+            break;
+        }
+    }
+
+    return left;
+}
+
+int Expression::parseUnary(string const & text, size_t & at)
+{
+    if (accept(text, at, "-")) {
+        return emit(OP_NEGATE, parseUnary(text, at));
+    }
+
+    return parsePrimary(text, at);
+}
+
+int Expression::parsePrimary(string const & text, size_t & at)
+{
+    skipSpaces(text, at);
+
+    if (at >= text.size()) {
+        fail("missing value", at);
+        return REGISTER_A;
+    }
+
+    char next = text[at];
+
+    if (isdigit((unsigned char)next) || next == '.') {
+        const char * start = text.c_str() + at;
+        char * end = nullptr;
+        float value = strtof(start, &end);
+
+        if (end == start) {
+            fail("invalid number", at);
+            return REGISTER_A;
+        }
+
+        at += end - start;
+        return constant(value);
+    }
+
+    if (next == '(') {
+        at++;
+        int inner = parseComparison(text, at);
+
+        if (!accept(text, at, ")")) {
+            fail("missing ')'", at);
+        }
+
+        return inner;
+    }
+
+    if (!isalpha((unsigned char)next)) {
+        fail(string("unexpected '") + next + "'", at);
+        return REGISTER_A;
+    }
+
+    size_t start = at;
+    while (at < text.size() && isalpha((unsigned char)text[at])) {
+        at++;
+    }
+
+    string name = text.substr(start, at - start);
+
+    if (name == "a" || name == "b") {
+        bool input = name == "b";
+        int reg = input ? REGISTER_B : REGISTER_A;
+
+        // a.r and the like name a channel
+        if (at + 1 < text.size() && text[at] == '.' && strchr(CHANNEL_LETTERS, text[at + 1]) &&
+            (at + 2 >= text.size() || !isalnum((unsigned char)text[at + 2]))) {
+            int channel = (int)(strchr(CHANNEL_LETTERS, text[at + 1]) - CHANNEL_LETTERS);
+            reg = (input ? REGISTER_B_CHANNELS : REGISTER_A_CHANNELS) + channel;
+            at += 2;
+        }
+
+        inputUsed = inputUsed || input;
+        inputs |= 1u << reg;
+
+        return reg;
+    }
+
+    for (Function const & function : FUNCTIONS) {
+        if (name != function.name) {
+            continue;
+        }
+
+        if (!accept(text, at, "(")) {
+            fail("missing '(' after " + name, at);
+            return REGISTER_A;
+        }
+
+        int arguments[3] = { -1, -1, -1 };
+
+        for (int k = 0; k < function.arguments; ++k) {
+            if (k > 0 && !accept(text, at, ",")) {
+                fail(name + " takes " + to_string(function.arguments) + " arguments", at);
+                return REGISTER_A;
+            }
+
+            arguments[k] = parseComparison(text, at);
+        }
+
+        if (!accept(text, at, ")")) {
+            fail(name + " takes " + to_string(function.arguments) + " arguments", at);
+            return REGISTER_A;
+        }
+
+        return failure.empty() ? emit(function.op, arguments[0], arguments[1], arguments[2]) : REGISTER_A;
+    }
+
+    fail("unknown name " + name, start);
+    return REGISTER_A;
+}
+
+// Loads channel c of n pixels as values from 0 to 1; pixels without alpha are opaque
+template <typename P>
+static void loadChannel(float * target, const P * pixels, int c, int n)
+{
+    if (c >= (int)sizeof(P)) {
+        fill(target, target + n, 1.0f);
+        return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        target[i] = pixels[i].data[c] * (1.0f / 255.0f);
+    }
+}
+
+template <typename P>
+void Expression::run(P * output, const P * tracking, const P * input, int count) const
+{
+    const int batch = EXPRESSION_BATCH;
+
+    // The lanes of a short last batch past count hold stale values, which are
+    // computed but never stored
+    vector<float> storage(known.size() * batch, 0.0f);
+    float * registers = storage.data();
+
+    for (size_t r = 0; r < known.size(); ++r) {
+        if (known[r]) {
+            fill(registers + r * batch, registers + (r + 1) * batch, values[r]);
+        }
+    }
+
+    unsigned char results[3][EXPRESSION_BATCH];
+
+    for (int offset = 0; offset < count; offset += batch) {
+        int n = min(batch, count - offset);
+        const P * a = tracking + offset;
+        const P * b = input ? input + offset : nullptr;
+
+        for (int c = 0; c < 4; ++c) {
+            if (inputs & (1u << (REGISTER_A_CHANNELS + c))) {
+                loadChannel(registers + (REGISTER_A_CHANNELS + c) * batch, a, c, n);
+            }
+            if (inputs & (1u << (REGISTER_B_CHANNELS + c))) {
+                loadChannel(registers + (REGISTER_B_CHANNELS + c) * batch, b, c, n);
+            }
+        }
+
+        for (int c = 0; c < 3; ++c) {
+            if (inputs & (1u << REGISTER_A)) {
+                loadChannel(registers + REGISTER_A * batch, a, c, n);
+            }
+            if (inputs & (1u << REGISTER_B)) {
+                loadChannel(registers + REGISTER_B * batch, b, c, n);
+            }
+
+            for (Instruction const & instruction : code) {
+                execute(instruction, registers);
+            }
+
+            // Clamped to 0 to 1, which also turns NaN into 0
+            const float * value = registers + result * batch;
+
+            for (int i = 0; i < n; ++i) {
+                float v = value[i] > 0.0f ? (value[i] < 1.0f ? value[i] : 1.0f) : 0.0f;
+                results[c][i] = (unsigned char)(v * 255.0f + 0.5f);
+            }
+        }
+
+        // Written once every channel is done, the output may be the tracking image
+        for (int i = 0; i < n; ++i) {
+            P pixel = a[i];
+
+            for (int c = 0; c < 3; ++c) {
+                pixel.data[c] = results[c][i];
+            }
+
+            output[offset + i] = pixel;
+        }
+    }
+}
+
+// The formulas run on both pixel formats
+#define INSTANTIATE_EXPRESSION(P) \
+    template void Expression::run(P *, const P *, const P *, int) const;
+
+INSTANTIATE_EXPRESSION(Pixel)
+INSTANTIATE_EXPRESSION(PixelBGRA)
@@ -0,0 +1,109 @@
+/**
+ * @file expression.h
+ * Per-pixel formulas compiled to register bytecode
+ *
+ * A formula gives the value of every color channel of the output from the
+ * pixels of the tracking image (a) and of an input image (b), with every value
+ * between 0 and 1:
+ *
+ * - a and b are the channel being computed, a.r, a.g, a.b and a.a (alpha, 1
+ *   without one) name a channel of either image, as do b.r, b.g, b.b and b.a
+ * - numbers, + - * /, unary minus and parentheses
+ * - < <= > >= == != give 1 where true and 0 where false
+ * - min(x, y), max(x, y), clamp(x, low, high), lerp(x, y, t), select(c, x, y)
+ *   (x where c is above 0, y elsewhere), abs(x) and sqrt(x)
+ *
+ * "a * b" is multiply and "lerp(a, b, 0.25)" mixes in a quarter of b. The
+ * result is clamped to 0 to 1, and alpha is kept from the tracking image.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tga.h"
+
+class Expression
+{
+  public:
+    /**
+     * Parses the formula and compiles it, folding the parts that only involve
+     * numbers.
+     *
+     * @param error Set to what is wrong with the formula if it cannot be compiled
+     * @return false if the formula is invalid
+     */
+    bool compile(std::string const & formula, std::string & error);
+
+    /**
+     * @return Whether the formula reads the input image (b)
+     */
+    bool readsInput() const { return inputUsed; }
+
+    /**
+     * Evaluates the formula for count pixels. The pixels go through in batches
+     * of EXPRESSION_BATCH, every instruction running over a whole batch of one
+     * channel in a loop the compiler vectorizes, so the cost of decoding the
+     * instructions is shared by the batch.
+     *
+     * @param output Where the result goes, may be the same range as tracking
+     * @param input The matching pixels of the input image, if the formula reads it
+     */
+    template <typename P>
+    void run(P * output, const P * tracking, const P * input, int count) const;
+
+    enum Op
+    {
+        OP_ADD,
+        OP_SUBTRACT,
+        OP_MULTIPLY,
+        OP_DIVIDE,
+        OP_NEGATE,
+        OP_LESS,
+        OP_LESS_EQUAL,
+        OP_GREATER,
+        OP_GREATER_EQUAL,
+        OP_EQUAL,
+        OP_NOT_EQUAL,
+        OP_MIN,
+        OP_MAX,
+        OP_CLAMP,
+        OP_LERP,
+        OP_SELECT,
+        OP_ABS,
+        OP_SQRT
+    };
+
+    // Writes the result of op on up to three registers into target
+    struct Instruction
+    {
+        Op op;
+        int target;
+        int operands[3];
+    };
+
+  private:
+    int parseComparison(std::string const & text, size_t & at);
+    int parseSum(std::string const & text, size_t & at);
+    int parseProduct(std::string const & text, size_t & at);
+    int parseUnary(std::string const & text, size_t & at);
+    int parsePrimary(std::string const & text, size_t & at);
+
+    int constant(float value);
+    int emit(Op op, int first, int second = -1, int third = -1);
+    void fail(std::string const & message, size_t at);
+
+    std::vector<Instruction> code;
+
+    // Per register, whether it holds a number known before running, and which
+    std::vector<bool> known;
+    std::vector<float> values;
+
+    // The input registers read, one bit per register
+    unsigned inputs = 0;
+
+    int result = 0;
+    bool inputUsed = false;
+    std::string failure;
+};
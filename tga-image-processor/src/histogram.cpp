@@ -0,0 +1,154 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+
+using namespace std;
+
+// Pixels per chunk, each chunk adding its bins to the result once
+const int HISTOGRAM_CHUNK = 1 << 20;
+
+static const char * const CHANNEL_NAMES[4] = { "blue", "green", "red", "alpha" };
+
+Histogram computeHistogram(const unsigned char * pixels, size_t count, int channels, ThreadPool & pool)
+{
+    Histogram histogram;
+    histogram.channels = channels;
+    histogram.pixels = count;
+
+    mutex merging;
+
+    pool.parallelFor((int)((count + HISTOGRAM_CHUNK - 1) / HISTOGRAM_CHUNK), 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; ++chunk) {
+            size_t first = (size_t)chunk * HISTOGRAM_CHUNK;
+            size_t last = min(count, first + HISTOGRAM_CHUNK);
+
+            // A chunk has fewer than 2^32 pixels
+            unsigned counts[4][256] = {};
+            const unsigned char * bytes = pixels + first * channels;
+
+            for (size_t i = first; i < last; ++i) {
+                for (int c = 0; c < channels; ++c) {
+                    counts[c][bytes[c]]++;
+                }
+                bytes += channels;
+            }
+
+            lock_guard<mutex> lock(merging);
+
+            for (int c = 0; c < channels; ++c) {
+                for (int v = 0; v < 256; ++v) {
+                    histogram.counts[c][v] += counts[c][v];
+                }
+            }
+        }
+    });
+
+    return histogram;
+}
+
+int percentile(Histogram const & histogram, int channel, double fraction)
+{
+    // At least one pixel, so that 0 finds the smallest value in use
+    double target = max(1.0, ceil(fraction * histogram.pixels));
+    size_t seen = 0;
+
+    for (int v = 0; v < 256; ++v) {
+        seen += histogram.counts[channel][v];
+
+        if (seen >= target) {
+            return v;
+        }
+    }
+
+    return 255;
+}
+
+void printStats(Histogram const & histogram, ostream & out)
+{
+    for (int c = 0; c < histogram.channels; ++c) {
+        double sum = 0.0;
+        double squares = 0.0;
+
+        for (int v = 0; v < 256; ++v) {
+            sum += (double)histogram.counts[c][v] * v;
+            squares += (double)histogram.counts[c][v] * v * v;
+        }
+
+        double pixels = max((size_t)1, histogram.pixels);
+        double mean = sum / pixels;
+        double deviation = sqrt(max(0.0, squares / pixels - mean * mean));
+
+        out << "... Stats for " << CHANNEL_NAMES[c] << ": min " << percentile(histogram, c, 0.0)
+            << ", max " << percentile(histogram, c, 1.0) << ", mean " << mean << ", stddev " << deviation
+            << ", median " << percentile(histogram, c, 0.5) << ", 1% " << percentile(histogram, c, 0.01)
+            << ", 99% " << percentile(histogram, c, 0.99) << endl;
+    }
+}
+
+bool writeHistogram(Histogram const & histogram, string const & filename)
+{
+    ofstream file(filename);
+
+    file << "value";
+    for (int c = 0; c < histogram.channels; ++c) {
+        file << "," << CHANNEL_NAMES[c];
+    }
+    file << "\n";
+
+    for (int v = 0; v < 256; ++v) {
+        file << v;
+        for (int c = 0; c < histogram.channels; ++c) {
+            file << "," << histogram.counts[c][v];
+        }
+        file << "\n";
+    }
+
+    file.close();
+
+    return !file.fail();
+}
+
+void autolevelsTable(Histogram const & histogram, double clip, unsigned char * table)
+{
+    for (int c = 0; c < 3; ++c) {
+        int low = percentile(histogram, c, clip / 100.0);
+        int high = percentile(histogram, c, 1.0 - clip / 100.0);
+
+        for (int v = 0; v < 256; ++v) {
+            int mapped = v;
+
+            // A channel with a single value is left as it is
+            if (high > low) {
+                mapped = (int)lround((v - low) * 255.0 / (high - low));
+            }
+
+            table[256 * c + v] = (unsigned char)min(max(mapped, 0), 255);
+        }
+    }
+}
+
+void equalizeTable(Histogram const & histogram, unsigned char * table)
+{
+    for (int c = 0; c < 3; ++c) {
+        // The pixels at or below each value, less those of the smallest value
+        // in use, which maps to 0
+        size_t smallest = histogram.counts[c][percentile(histogram, c, 0.0)];
+        size_t rest = histogram.pixels - smallest;
+        size_t seen = 0;
+
+        for (int v = 0; v < 256; ++v) {
+            seen += histogram.counts[c][v];
+
+            int mapped = v;
+
+            if (rest > 0) {
+                mapped = (int)lround((double)(seen > smallest ? seen - smallest : 0) * 255.0 / rest);
+            }
+
+            table[256 * c + v] = (unsigned char)mapped;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/**
+ * @file histogram.h
+ * Per-channel histograms and the statistics and tone curves computed from them
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "threadpool.h"
+
+struct Histogram
+{
+    int channels = 0;
+    size_t pixels = 0;
+
+    // The number of pixels with each value, per channel in blue, green, red,
+    // alpha order
+    size_t counts[4][256] = {};
+};
+
+/**
+ * Counts the values of every channel of count pixels of interleaved bytes.
+ *
+ * The pixels are split across the thread pool, each chunk counting into bins
+ * of its own on the stack, which are added to the result once the chunk is
+ * done. No counter is shared while counting.
+ */
+Histogram computeHistogram(const unsigned char * pixels, size_t count, int channels, ThreadPool & pool);
+
+/**
+ * @return The smallest value that at least the given fraction of the pixels
+ *         are at or below in the channel: 0 gives the minimum and 1 the maximum
+ */
+int percentile(Histogram const & histogram, int channel, double fraction);
+
+/**
+ * Prints the minimum, maximum, mean, standard deviation, median, and 1st and
+ * 99th percentiles of every channel, a line per channel.
+ */
+void printStats(Histogram const & histogram, std::ostream & out);
+
+/**
+ * Writes the histogram as CSV: a header line, then a line per value with the
+ * count of every channel.
+ *
+ * @return false if the file cannot be written
+ */
+bool writeHistogram(Histogram const & histogram, std::string const & filename);
+
+/**
+ * Fills a table per color channel, in blue, green, red order, that stretches
+ * each channel to the full range: the values below its clip percentile become
+ * 0, those above the percentile from the top become 255, and those in between
+ * are spread linearly.
+ *
+ * @param clip The percentage of pixels to clip at each end
+ * @param table 3 x 256 entries, as operationLookup takes them
+ */
+void autolevelsTable(Histogram const & histogram, double clip, unsigned char * table);
+
+/**
+ * Fills a table per color channel that equalizes the histogram of each one,
+ * spreading its values so that they are used about equally often.
+ *
+ * @param table 3 x 256 entries, as operationLookup takes them
+ */
+void equalizeTable(Histogram const & histogram, unsigned char * table);
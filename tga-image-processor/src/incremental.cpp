@@ -0,0 +1,350 @@
+#include "incremental.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// The first line of a sidecar file, with the version of its format
+const char * const TILE_RECORD_MAGIC = "tiles 1";
+
+const unsigned long long HASH_SEED = 0x27d4eb2f165667c5ULL;
+const unsigned long long HASH_PRIME1 = 0x9e3779b185ebca87ULL;
+const unsigned long long HASH_PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+
+static inline unsigned long long rotateLeft(unsigned long long x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Mixes size bytes into the hash, eight at a time
+static unsigned long long hashBytes(unsigned long long hash, const unsigned char * bytes, size_t size)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+
+        hash = rotateLeft(hash ^ (word * HASH_PRIME2), 31) * HASH_PRIME1;
+    }
+
+    for (; i < size; ++i) {
+        hash = rotateLeft(hash ^ (bytes[i] * HASH_PRIME1), 11) * HASH_PRIME2;
+    }
+
+    return hash;
+}
+
+// Spreads every bit of the hash over the others, once it is complete
+static unsigned long long finishHash(unsigned long long hash)
+{
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME1;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// Where a tile is in its image
+struct TileArea
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+static TileArea tileArea(int tile, int width, int height)
+{
+    int columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    TileArea area;
+    area.x = tile % columns * TILE_SIZE;
+    area.y = tile / columns * TILE_SIZE;
+    area.width = min(TILE_SIZE, width - area.x);
+    area.height = min(TILE_SIZE, height - area.y);
+
+    return area;
+}
+
+// Hashes the rows of a tile, rowStride bytes apart, with the size of the tile
+// first so that tiles of different shapes differ
+static unsigned long long hashArea(const unsigned char * first, size_t rowStride, TileArea const & area, int channels)
+{
+    int shape[2] = { area.width, area.height };
+    unsigned long long hash = hashBytes(HASH_SEED, (const unsigned char*)shape, sizeof(shape));
+
+    for (int row = 0; row < area.height; ++row) {
+        hash = hashBytes(hash, first + row * rowStride, (size_t)area.width * channels);
+    }
+
+    return finishHash(hash);
+}
+
+string tileRecordName(string const & output)
+{
+    return output + ".tiles";
+}
+
+unsigned long long hashArguments(vector<string> const & arguments)
+{
+    unsigned long long hash = HASH_SEED;
+
+    // Each argument with its terminating zero, so that they cannot run together
+    for (string const & argument : arguments) {
+        hash = hashBytes(hash, (const unsigned char*)argument.c_str(), argument.size() + 1);
+    }
+
+    return finishHash(hash);
+}
+
+bool canPatchTiles(vector<Stage> const & stages)
+{
+    for (size_t i = 0; i < stages.size(); ++i) {
+        Method method = stages[i].method;
+
+        if (method == METHOD_FLIP_VERTICAL && i + 1 == stages.size()) {
+            continue;
+        }
+
+        if (isPass(method)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int tileCount(int width, int height)
+{
+    return ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+vector<unsigned long long> hashTiles(TGA const & image, ThreadPool & pool)
+{
+    vector<unsigned long long> hashes(tileCount(image.width, image.height));
+
+    const unsigned char * bytes = image.bytes();
+    int channels = image.channels();
+    size_t rowStride = (size_t)image.width * channels;
+
+    pool.parallelFor((int)hashes.size(), 16, [&](int begin, int end) {
+        for (int tile = begin; tile < end; ++tile) {
+            TileArea area = tileArea(tile, image.width, image.height);
+            const unsigned char * first = bytes + area.y * rowStride + (size_t)area.x * channels;
+
+            hashes[tile] = hashArea(first, rowStride, area, channels);
+        }
+    });
+
+    return hashes;
+}
+
+int stripColumns(int tiles)
+{
+    return max(1, min(tiles, 32767 / TILE_SIZE));
+}
+
+bool stripFits(int count)
+{
+    int columns = stripColumns(count);
+    int rows = (count + columns - 1) / columns;
+
+    return rows <= 32767 / TILE_SIZE;
+}
+
+TGA gatherTiles(TGA const & image, vector<int> const & tiles, ThreadPool & pool)
+{
+    int count = (int)tiles.size();
+    int columns = stripColumns(count);
+    int channels = image.channels();
+
+    TGA strip = image;
+    strip.mapping.reset();
+    strip.view = nullptr;
+    strip.width = (short)(columns * TILE_SIZE);
+    strip.height = (short)((count + columns - 1) / columns * TILE_SIZE);
+    strip.imageData.assign(strip.dataSize(), 0);
+
+    const unsigned char * bytes = image.bytes();
+    size_t rowStride = (size_t)image.width * channels;
+    size_t stripStride = (size_t)strip.width * channels;
+
+    pool.parallelFor(count, 16, [&](int begin, int end) {
+        for (int slot = begin; slot < end; ++slot) {
+            TileArea area = tileArea(tiles[slot], image.width, image.height);
+            const unsigned char * from = bytes + area.y * rowStride + (size_t)area.x * channels;
+            unsigned char * to = strip.imageData.data() + (size_t)(slot / columns * TILE_SIZE) * stripStride +
+                                 (size_t)(slot % columns * TILE_SIZE) * channels;
+
+            for (int row = 0; row < area.height; ++row) {
+                memcpy(to + row * stripStride, from + row * rowStride, (size_t)area.width * channels);
+            }
+        }
+    });
+
+    return strip;
+}
+
+// The first pixel of a slot of the grid
+static const unsigned char * slotPixels(TGA const & strip, int slot)
+{
+    int columns = strip.width / TILE_SIZE;
+    size_t stripStride = (size_t)strip.width * strip.channels();
+
+    return strip.bytes() + (size_t)(slot / columns * TILE_SIZE) * stripStride +
+           (size_t)(slot % columns * TILE_SIZE) * strip.channels();
+}
+
+unsigned long long hashSlot(TGA const & strip, int slot, int tile, int width, int height)
+{
+    return hashArea(slotPixels(strip, slot), (size_t)strip.width * strip.channels(),
+                    tileArea(tile, width, height), strip.channels());
+}
+
+bool patchTiles(string const & filename, TGA const & strip, vector<int> const & tiles,
+                vector<int> const & slots, int width, int height)
+{
+    int fd = ::open(filename.c_str(), O_WRONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    int channels = strip.channels();
+    size_t stripStride = (size_t)strip.width * channels;
+    size_t rowStride = (size_t)width * channels;
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < tiles.size(); ++i) {
+        TileArea area = tileArea(tiles[i], width, height);
+        const unsigned char * from = slotPixels(strip, slots[i]);
+
+        // The file was written by writeTGA, with the pixels right after the header
+        for (int row = 0; ok && row < area.height; ++row) {
+            off_t offset = TGA_HEADER_SIZE + (off_t)(area.y + row) * rowStride + (off_t)area.x * channels;
+            size_t size = (size_t)area.width * channels;
+
+            ok = pwrite(fd, from + row * stripStride, size, offset) == (ssize_t)size;
+        }
+    }
+
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+static void writeHashes(ostream & file, const char * name, vector<unsigned long long> const & hashes)
+{
+    char digits[17];
+
+    file << name;
+    for (unsigned long long hash : hashes) {
+        snprintf(digits, sizeof(digits), "%016llx", hash);
+        file << " " << digits;
+    }
+    file << "\n";
+}
+
+static bool readHashes(string const & line, string const & name, vector<unsigned long long> & hashes)
+{
+    istringstream words(line);
+    string word;
+
+    if (!(words >> word) || word != name) {
+        return false;
+    }
+
+    hashes.clear();
+
+    while (words >> word) {
+        hashes.push_back(strtoull(word.c_str(), nullptr, 16));
+    }
+
+    return true;
+}
+
+bool readTileRecord(string const & filename, TileRecord & record)
+{
+    ifstream file(filename);
+    string line;
+
+    if (!getline(file, line) || line != TILE_RECORD_MAGIC) {
+        return false;
+    }
+
+    int tileSize = 0;
+    string header;
+
+    if (!(file >> tileSize >> hex >> record.job >> header >> dec >> record.modified >> record.size) ||
+        tileSize != TILE_SIZE || header.size() != 2 * TGA_HEADER_SIZE) {
+        return false;
+    }
+
+    record.header.resize(TGA_HEADER_SIZE);
+
+    for (int i = 0; i < TGA_HEADER_SIZE; ++i) {
+        record.header[i] = (unsigned char)strtoul(header.substr(2 * i, 2).c_str(), nullptr, 16);
+    }
+
+    getline(file, line);
+
+    record.inputs.clear();
+    record.output.clear();
+
+    while (getline(file, line)) {
+        vector<unsigned long long> hashes;
+
+        if (readHashes(line, "input", hashes)) {
+            record.inputs.push_back(hashes);
+        }
+        else if (readHashes(line, "output", hashes)) {
+            record.output = hashes;
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+bool writeTileRecord(string const & filename, TileRecord const & record)
+{
+    ofstream file(filename);
+    char digits[17];
+
+    file << TILE_RECORD_MAGIC << "\n";
+
+    snprintf(digits, sizeof(digits), "%016llx", record.job);
+    file << TILE_SIZE << " " << digits << " ";
+
+    for (unsigned char byte : record.header) {
+        snprintf(digits, sizeof(digits), "%02x", byte);
+        file << digits;
+    }
+
+    file << " " << record.modified << " " << record.size << "\n";
+
+    for (vector<unsigned long long> const & hashes : record.inputs) {
+        writeHashes(file, "input", hashes);
+    }
+
+    writeHashes(file, "output", record.output);
+
+    file.close();
+
+    return !file.fail();
+}
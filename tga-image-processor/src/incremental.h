@@ -0,0 +1,124 @@
+/**
+ * @file incremental.h
+ * Per-tile hashes of the images of a job, to recompute only what changed
+ *
+ * Images are cut into tiles of TILE_SIZE x TILE_SIZE pixels in the order their
+ * rows are stored, numbered row by row, with narrower and shorter tiles along
+ * the right and last edges. Jobs whose stages all work pixel by pixel give
+ * every tile of the output from the same tile of each image they read, so when
+ * the images change only the tiles whose hashes changed need to be computed
+ * again, and only those whose result changed written over the old output.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "pipeline.h"
+#include "threadpool.h"
+
+// The width and height of a tile, in pixels
+const int TILE_SIZE = 64;
+
+/**
+ * What a job read and wrote the last time its output was written, kept in a
+ * sidecar file next to the output (see tileRecordName).
+ */
+struct TileRecord
+{
+    // The hash of the arguments of the job and the header of its first image,
+    // which decide the header of the output
+    unsigned long long job = 0;
+    std::vector<unsigned char> header;
+
+    // The modification time in nanoseconds and the size of the output file
+    long long modified = 0;
+    long long size = 0;
+
+    // The tile hashes of every image read, the first image then the inputs of
+    // the stages in order, and of the output
+    std::vector<std::vector<unsigned long long>> inputs;
+    std::vector<unsigned long long> output;
+};
+
+/**
+ * @return The name of the sidecar file of the given output, output.tiles
+ */
+std::string tileRecordName(std::string const & output);
+
+/**
+ * @return The hash of the arguments of a job
+ */
+unsigned long long hashArguments(std::vector<std::string> const & arguments);
+
+/**
+ * @return true if every stage works pixel by pixel, so that each tile of the
+ *         output only depends on the same tile of the images; a vertical flip
+ *         is allowed at the end, where it only flips the origin bit
+ */
+bool canPatchTiles(std::vector<Stage> const & stages);
+
+/**
+ * @return The number of tiles of an image of the given size
+ */
+int tileCount(int width, int height);
+
+/**
+ * Hashes every tile of the image, across the thread pool.
+ */
+std::vector<unsigned long long> hashTiles(TGA const & image, ThreadPool & pool);
+
+/**
+ * Copies the given tiles of the image into a grid of tiles of their own, tile
+ * i of the list going to slot i, TILE_SIZE x TILE_SIZE pixels each, in rows of
+ * stripColumns(tiles.size()). The slot pixels past the edge of a smaller tile
+ * are black. The result keeps the header of the image and has the size of the
+ * grid.
+ */
+TGA gatherTiles(TGA const & image, std::vector<int> const & tiles, ThreadPool & pool);
+
+/**
+ * @return The number of slots in a row of the grid of gatherTiles
+ */
+int stripColumns(int tiles);
+
+/**
+ * @return false if the grid of gatherTiles for count tiles is too large for the
+ *         16-bit sizes of the header
+ */
+bool stripFits(int count);
+
+/**
+ * Hashes the tile in the given slot of a grid from gatherTiles, as hashTiles
+ * would hash it in its image.
+ *
+ * @param width The width of the image the tile belongs to
+ * @param height The height of the image the tile belongs to
+ */
+unsigned long long hashSlot(TGA const & strip, int slot, int tile, int width, int height);
+
+/**
+ * Writes the tiles in the given slots of a grid from gatherTiles into an
+ * uncompressed TGA file of the given size, in place, leaving the rest of the
+ * file as it is.
+ *
+ * @return false if the file cannot be opened or written
+ */
+bool patchTiles(std::string const & filename, TGA const & strip, std::vector<int> const & tiles,
+                std::vector<int> const & slots, int width, int height);
+
+/**
+ * Reads a sidecar file.
+ *
+ * @return false if there is none or it cannot be read
+ */
+bool readTileRecord(std::string const & filename, TileRecord & record);
+
+/**
+ * Writes a sidecar file.
+ *
+ * @return false if the file cannot be written
+ */
+bool writeTileRecord(std::string const & filename, TileRecord const & record);
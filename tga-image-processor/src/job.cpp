@@ -0,0 +1,552 @@
+#include "job.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include "planar.h"
+
+using namespace std;
+
+// TGA images are at most 65535 pixels across
+const int MAX_RADIUS = 65535;
+
+bool stringEndingWith(string const & src, string const & extension)
+{
+    if (src.size() >= extension.size()) {
+        const char * start = src.c_str() + (src.size() - extension.size());
+        return strcmp(start, extension.c_str()) == 0;
+    }
+
+    return false;
+}
+
+string readFileArgument(int & cmdIndex, int argc, char **argv)
+{
+    if (cmdIndex >= argc) {
+        cout << "Missing argument." << endl;
+        exit(1);
+    }
+
+    if (!stringEndingWith(argv[cmdIndex], ".tga") && !stringEndingWith(argv[cmdIndex], ".mosaic") &&
+        strcmp(argv[cmdIndex], "-")) {
+        cout << "Invalid argument, invalid file name." << endl;
+        exit(1);
+    }
+
+    return argv[cmdIndex++];
+}
+
+int readIntegerArgument(int & cmdIndex, int argc, char **argv)
+{
+    if (cmdIndex >= argc) {
+        cout << "Missing argument." << endl;
+        exit(1);
+    }
+
+    int value = 0;
+    
+    try {
+        value = std::stoi(argv[cmdIndex]);
+    }
+    catch(...) {
+        cout << "Invalid argument, expected number." << endl;
+        exit(1);
+    }
+
+    cmdIndex++;
+
+    return value;
+}
+
+static double readFactorArgument(int & cmdIndex, int argc, char **argv)
+{
+    if (cmdIndex >= argc) {
+        cout << "Missing argument." << endl;
+        exit(1);
+    }
+
+    double value = 0.0;
+
+    try {
+        value = std::stod(argv[cmdIndex]);
+    }
+    catch(...) {
+        cout << "Invalid argument, expected number." << endl;
+        exit(1);
+    }
+
+    if (!(value > 0.0)) {
+        cout << "Invalid argument, expected a positive factor." << endl;
+        exit(1);
+    }
+
+    cmdIndex++;
+
+    return value;
+}
+
+// Reads the percentage of pixels autolevels clips at each end, under half of them
+static double readPercentArgument(int & cmdIndex, int argc, char **argv)
+{
+    if (cmdIndex >= argc) {
+        cout << "Missing argument." << endl;
+        exit(1);
+    }
+
+    double value = 0.0;
+
+    try {
+        value = std::stod(argv[cmdIndex]);
+    }
+    catch(...) {
+        cout << "Invalid argument, expected number." << endl;
+        exit(1);
+    }
+
+    if (!(value >= 0.0 && value < 50.0)) {
+        cout << "Invalid argument, expected a percentage from 0 to under 50." << endl;
+        exit(1);
+    }
+
+    cmdIndex++;
+
+    return value;
+}
+
+// Reads the filter name that may follow resize and scale
+static void readFilterArgument(int & cmdIndex, int argc, char **argv, Stage & stage)
+{
+    if (cmdIndex < argc && parseResizeFilter(argv[cmdIndex], stage.filter)) {
+        cmdIndex++;
+    }
+}
+
+Job parseJob(int argIndex, int argc, char **argv)
+{
+    Job job;
+    job.output = argv[argIndex];
+    job.arguments.assign(argv + argIndex, argv + argc);
+
+    if (!stringEndingWith(job.output, ".tga") && !stringEndingWith(job.output, ".mosaic") && job.output != "-") {
+        cout << "Invalid file name." << endl;
+        exit(1);
+    }
+
+    // The image itself goes to stdout, so keep the progress messages out of it
+    if (job.output == "-") {
+        cout.rdbuf(cerr.rdbuf());
+    }
+
+    if (argc < argIndex + 2 || (!stringEndingWith(argv[argIndex + 1], ".tga") &&
+                                !stringEndingWith(argv[argIndex + 1], ".mosaic") && strcmp(argv[argIndex + 1], "-"))) {
+        cout << "Invalid file name." << endl;
+        exit(1);
+    }
+
+    job.firstImage = argv[argIndex + 1];
+
+    int cmdIndex = argIndex + 2;
+
+    // Each method's message, printed once it has parsed
+    ostringstream progress;
+
+    do {
+        
+        if (cmdIndex >= argc) {
+            cout << "Invalid method name." << endl;
+            exit(1);
+        }
+
+        const string method = argv[cmdIndex++];
+
+        Stage stage;
+
+        if (method == "multiply") {
+
+            stage.method = METHOD_MULTIPLY;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Multiplying" << endl;
+        }
+        else if (method == "subtract") {
+
+            stage.method = METHOD_SUBTRACT;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Subtracting" << endl;
+        }
+        else if (method == "overlay") {
+
+            stage.method = METHOD_OVERLAY;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Overlaying" << endl;
+        }
+        else if (method == "screen") {
+
+            stage.method = METHOD_SCREEN;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Screen" << endl;
+        }
+        else if (method == "combine") {
+
+            stage.method = METHOD_COMBINE;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+            stage.input2Name = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Combining" << endl;
+        }
+        else if (method == "flip") {
+
+            stage.method = METHOD_FLIP;
+
+            progress << "... Flipping" << endl;
+        }
+        else if (method == "flipv") {
+
+            stage.method = METHOD_FLIP_VERTICAL;
+
+            progress << "... Flipping vertically" << endl;
+        }
+        else if (method == "mirror") {
+
+            stage.method = METHOD_MIRROR;
+
+            progress << "... Mirroring" << endl;
+        }
+        else if (method == "rotate90" || method == "rotate270") {
+
+            stage.method = method == "rotate90" ? METHOD_ROTATE90 : METHOD_ROTATE270;
+
+            progress << "... Rotating" << endl;
+        }
+        else if (method == "transpose") {
+
+            stage.method = METHOD_TRANSPOSE;
+
+            progress << "... Transposing" << endl;
+        }
+        else if (method == "blur" || method == "gaussian" || method == "unsharp" || method == "lumasharpen") {
+
+            stage.method = method == "blur" ? METHOD_BLUR : method == "gaussian" ? METHOD_GAUSSIAN :
+                           method == "unsharp" ? METHOD_UNSHARP : METHOD_LUMA_SHARPEN;
+            stage.radius = readIntegerArgument(cmdIndex, argc, argv);
+
+            if (stage.radius < 0) {
+                cout << "Invalid argument, expected a radius of 0 or more pixels." << endl;
+                exit(1);
+            }
+
+            // A window as wide as the largest image already spans it whole
+            stage.radius = min(stage.radius, MAX_RADIUS);
+
+            if (method == "unsharp" || method == "lumasharpen") {
+                stage.amount = readIntegerArgument(cmdIndex, argc, argv);
+
+                progress << "... Sharpening" << endl;
+            }
+            else {
+                progress << "... Blurring" << endl;
+            }
+        }
+        else if (method == "resize") {
+
+            stage.method = METHOD_RESIZE;
+            stage.width = readIntegerArgument(cmdIndex, argc, argv);
+            stage.height = readIntegerArgument(cmdIndex, argc, argv);
+
+            if (stage.width < 1 || stage.height < 1) {
+                cout << "Invalid argument, expected a positive width and height." << endl;
+                exit(1);
+            }
+
+            readFilterArgument(cmdIndex, argc, argv, stage);
+
+            progress << "... Resizing" << endl;
+        }
+        else if (method == "scale") {
+
+            stage.method = METHOD_RESIZE;
+            stage.factor = readFactorArgument(cmdIndex, argc, argv);
+
+            readFilterArgument(cmdIndex, argc, argv, stage);
+
+            progress << "... Resizing" << endl;
+        }
+        else if (method == "grayscale") {
+
+            stage.method = METHOD_GRAYSCALE;
+
+            progress << "... Converting to grayscale" << endl;
+        }
+        else if (method == "toycbcr" || method == "tohsv" || method == "fromycbcr" || method == "fromhsv") {
+
+            stage.method = method.compare(0, 2, "to") == 0 ? METHOD_TO_SPACE : METHOD_FROM_SPACE;
+            stage.space = method == "toycbcr" || method == "fromycbcr" ? SPACE_YCBCR : SPACE_HSV;
+
+            progress << "... Converting colors" << endl;
+        }
+        else if (method == "hue") {
+
+            // Shifted in HSV, round the wheel
+            int degrees = readIntegerArgument(cmdIndex, argc, argv);
+            int shift = (int)lround(degrees * 256.0 / 360.0);
+
+            stage.method = METHOD_ROUND_TRIP;
+            stage.space = SPACE_HSV;
+            stage.table = identityTable();
+
+            for (int v = 0; v < 256; ++v) {
+                stage.table[512 + v] = (unsigned char)((v + shift) & 255);
+            }
+
+            progress << "... Shifting hue" << endl;
+        }
+        else if (method == "saturation") {
+
+            // Scaled in HSV
+            int percent = readIntegerArgument(cmdIndex, argc, argv);
+
+            if (percent < 0) {
+                cout << "Invalid argument, expected a percentage of 0 or more." << endl;
+                exit(1);
+            }
+
+            stage.method = METHOD_ROUND_TRIP;
+            stage.space = SPACE_HSV;
+            stage.table = identityTable();
+
+            for (int v = 0; v < 256; ++v) {
+                stage.table[256 + v] = (unsigned char)min((v * (long long)percent + 50) / 100, 255LL);
+            }
+
+            progress << "... Saturating" << endl;
+        }
+        else if (method == "expr") {
+
+            if (cmdIndex >= argc) {
+                cout << "Missing argument." << endl;
+                exit(1);
+            }
+
+            stage.method = METHOD_EXPRESSION;
+            stage.expression = make_shared<Expression>();
+
+            string error;
+
+            if (!stage.expression->compile(argv[cmdIndex++], error)) {
+                cout << "Invalid argument, " << error << "." << endl;
+                exit(1);
+            }
+
+            // The image b stands for
+            if (cmdIndex < argc && (stringEndingWith(argv[cmdIndex], ".tga") ||
+                                    stringEndingWith(argv[cmdIndex], ".mosaic") || !strcmp(argv[cmdIndex], "-"))) {
+                stage.inputName = readFileArgument(cmdIndex, argc, argv);
+            }
+
+            if (stage.expression->readsInput() && stage.inputName.empty()) {
+                cout << "Invalid argument, the formula reads b but no image is given." << endl;
+                exit(1);
+            }
+
+            progress << "... Evaluating expression" << endl;
+        }
+        else if (method == "stats") {
+
+            stage.method = METHOD_STATS;
+
+            progress << "... Computing statistics" << endl;
+        }
+        else if (method == "histogram") {
+
+            stage.method = METHOD_HISTOGRAM;
+
+            if (cmdIndex >= argc) {
+                cout << "Missing argument." << endl;
+                exit(1);
+            }
+
+            if (!stringEndingWith(argv[cmdIndex], ".csv")) {
+                cout << "Invalid argument, expected a .csv file name." << endl;
+                exit(1);
+            }
+
+            stage.reportName = argv[cmdIndex++];
+
+            progress << "... Writing histogram" << endl;
+        }
+        else if (method == "autolevels") {
+
+            stage.method = METHOD_AUTOLEVELS;
+            stage.factor = readPercentArgument(cmdIndex, argc, argv);
+
+            progress << "... Auto levels" << endl;
+        }
+        else if (method == "equalize") {
+
+            stage.method = METHOD_EQUALIZE;
+
+            progress << "... Equalizing" << endl;
+        }
+        else if (method == "over" || method == "overpremultiplied") {
+
+            stage.method = method == "over" ? METHOD_OVER : METHOD_OVER_PREMULTIPLIED;
+            stage.inputName = readFileArgument(cmdIndex, argc, argv);
+
+            progress << "... Compositing" << endl;
+        }
+        else if (method == "premultiply") {
+
+            stage.method = METHOD_PREMULTIPLY;
+
+            progress << "... Premultiplying" << endl;
+        }
+        else if (method == "unpremultiply") {
+
+            stage.method = METHOD_UNPREMULTIPLY;
+
+            progress << "... Unpremultiplying" << endl;
+        }
+        else if (method == "onlyred" || method == "onlygreen" || method == "onlyblue")  {
+
+            stage.method = METHOD_ONLY;
+            stage.red = method == "onlyred";
+            stage.green = method == "onlygreen";
+            stage.blue = method == "onlyblue";
+
+            progress << "... Operation = " << method << endl;
+        }
+        else if (method == "addred" || method == "addgreen" || method == "addblue") {
+
+            int value = readIntegerArgument(cmdIndex, argc, argv);
+            
+            int red = 0;
+            int green = 0;
+            int blue = 0;
+            if (method == "addred") {
+                red = value;
+            }
+            else if (method == "addgreen") {
+                green = value;
+            }
+            else {
+                blue = value;
+            }
+
+            stage.method = METHOD_ADD;
+            stage.red = red;
+            stage.green = green;
+            stage.blue = blue;
+
+            progress << "... Operation = " << method << endl;
+        }
+        else if (method == "scalered" || method == "scalegreen" || method == "scaleblue") {
+
+            int value = readIntegerArgument(cmdIndex, argc, argv);
+            
+            int red = 1;
+            int green = 1;
+            int blue = 1;
+            if (method == "scalered") {
+                red = value;
+            }
+            else if (method == "scalegreen") {
+                green = value;
+            }
+            else {
+                blue = value;
+            }
+
+            stage.method = METHOD_SCALE;
+            stage.red = red;
+            stage.green = green;
+            stage.blue = blue;
+
+            progress << "... Operation = " << method << endl;
+        }
+        else {
+            cout << "Invalid method name." << endl;
+            exit(1); 
+        }
+
+        job.stages.push_back(stage);
+
+        cout << progress.str();
+        job.messages += progress.str();
+        progress.str("");
+    }
+    while (cmdIndex < argc);
+
+    // Runs of add, scale and only become single table lookups
+    job.stages = compileStages(job.stages);
+
+    return job;
+}
+
+// Checks an input image against the tracking image, width x height pixels at its stage
+static TGA readInput(TGA const & trackingImage, int width, int height, string const & filename,
+                     ImageLoader const & load)
+{
+    TGA input2 = load(filename,  "Invalid argument, file does not exist.");
+
+    // Images are blended pixel by pixel, so they must all be the same size
+    if (input2.width != width || input2.height != height) {
+        cout << "Invalid argument, image dimensions do not match." << endl;
+        exit(1);
+    }
+
+    // The chain runs on the pixel format of the first image
+    setChannels(input2, trackingImage.channels());
+
+    // Rows are paired in the order they are stored, so an image stored the
+    // other way up is turned over first
+    setOrigin(input2, (trackingImage.imageDescriptor & 0x20) != 0);
+
+    return input2;
+}
+
+TGA loadJob(Job & job, ImageLoader const & load)
+{
+    TGA trackingImage = load(job.firstImage, "File does not exist.");
+
+    // The size of the tracking image at each stage, turned by rotations and
+    // transposes and changed by resize
+    int width = trackingImage.width;
+    int height = trackingImage.height;
+
+    for (size_t i = 0; i < job.stages.size(); ++i) {
+        Stage & stage = job.stages[i];
+
+        stageSize(stage, width, height);
+
+        // The header holds 16-bit sizes
+        if (width > 32767 || height > 32767) {
+            cout << "Invalid argument, the resized image would be too large." << endl;
+            exit(1);
+        }
+
+        if (!stage.inputName.empty()) {
+            stage.input = readInput(trackingImage, width, height, stage.inputName, load);
+        }
+
+        if (!stage.input2Name.empty()) {
+            stage.input2 = readInput(trackingImage, width, height, stage.input2Name, load);
+        }
+    }
+
+    return trackingImage;
+}
+
+TGA runJob(TGA image, Job const & job, bool planar, ThreadPool & pool)
+{
+    // Run the whole chain in one fused pass
+    return planar ? runPlanarPipeline(move(image), job.stages, pool)
+                  : runPipeline(move(image), job.stages, pool);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file job.h
+ * Parsing, loading and running of one job: an output, a first image and a method chain
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "pipeline.h"
+#include "threadpool.h"
+
+struct Job
+{
+    std::string output;
+    std::string firstImage;
+    std::vector<Stage> stages;
+
+    // The arguments the job was parsed from, from the output on
+    std::vector<std::string> arguments;
+
+    // The messages printed while parsing, for runs that reuse the parsed job
+    std::string messages;
+};
+
+/**
+ * Reads an image for a job. Prints errorMessage and exits if it cannot be read.
+ */
+typedef std::function<TGA (std::string const & filename, std::string const & errorMessage)> ImageLoader;
+
+bool stringEndingWith(std::string const & src, std::string const & extension);
+
+/**
+ * @return The .tga or .mosaic file name (or "-") at argv[cmdIndex], moving past it
+ */
+std::string readFileArgument(int & cmdIndex, int argc, char **argv);
+
+/**
+ * @return The number at argv[cmdIndex], moving past it
+ */
+int readIntegerArgument(int & cmdIndex, int argc, char **argv);
+
+/**
+ * Parses "[output] [firstImage] [method] [...]" starting at argv[argIndex] and
+ * compiles the methods (see compileStages). No image is read yet.
+ *
+ * Prints an error and exits if the arguments are invalid. Once the output is
+ * known to be stdout, progress messages go to stderr.
+ */
+Job parseJob(int argIndex, int argc, char **argv);
+
+/**
+ * Reads the first image of the job and the inputs of its stages, converted to
+ * the pixel format of the first image. Every input must have the size of the
+ * image at its stage, after the rotations, transposes and resizes before it.
+ *
+ * @return The first image
+ */
+TGA loadJob(Job & job, ImageLoader const & load);
+
+/**
+ * Runs the stages of a loaded job over its first image.
+ *
+ * @param planar Process the channels as separate planes
+ * @return The resulting image
+ */
+TGA runJob(TGA image, Job const & job, bool planar, ThreadPool & pool);
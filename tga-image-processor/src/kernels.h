@@ -0,0 +1,143 @@
+/**
+ * @file kernels.h
+ * Per-pixel kernels specialized at compile time for the channels they change
+ *
+ * Each kernel is a template over the pixel format and a channel mask (bit c
+ * set for channel c, in blue, green, red order), so every combination compiles
+ * into its own loop without branches, with the untouched channels copied as
+ * part of the pixel. The mask is worked out once, and the instance picked from
+ * a table of all eight (see KERNELS_BY_MASK) before the kernel runs.
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#include "tga.h"
+
+// The instances of a kernel template for every channel mask, indexed by mask
+#define KERNELS_BY_MASK(kernel, P) \
+    { &kernel<P, 0>, &kernel<P, 1>, &kernel<P, 2>, &kernel<P, 3>, \
+      &kernel<P, 4>, &kernel<P, 5>, &kernel<P, 6>, &kernel<P, 7> }
+
+/**
+ * @return The mask of the channels whose value is not the identity one
+ * @param values Per channel values in blue, green, red order
+ */
+inline unsigned changedChannels(const int * values, int identity)
+{
+    unsigned mask = 0;
+
+    for (int c = 0; c < 3; ++c) {
+        if (values[c] != identity) {
+            mask |= 1u << c;
+        }
+    }
+
+    return mask;
+}
+
+/**
+ * @return The mask of the channels a lookup changes: those read from another
+ *         channel or through a table that is not the identity
+ */
+inline unsigned changedChannels(const unsigned char * table, const int * source)
+{
+    unsigned mask = 0;
+
+    for (int c = 0; c < 3; ++c) {
+        bool identity = source[c] == c;
+
+        for (int v = 0; identity && v < 256; ++v) {
+            identity = table[256 * c + v] == v;
+        }
+
+        if (!identity) {
+            mask |= 1u << c;
+        }
+    }
+
+    return mask;
+}
+
+inline unsigned char clampToByte(int v)
+{
+    return (unsigned char)std::min(std::max(v, 0), 255);
+}
+
+/**
+ * Adds values[c] to every channel c in the mask, clamping the result.
+ */
+template <typename P, unsigned mask>
+void addChannels(P * output, const P * tga, const int * values, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        P pixel = tga[i];
+
+        for (int c = 0; c < 3; ++c) {
+            if (mask & (1u << c)) {
+                pixel.data[c] = clampToByte(pixel.data[c] + values[c]);
+            }
+        }
+
+        output[i] = pixel;
+    }
+}
+
+/**
+ * Multiplies every channel c in the mask by values[c], clamping the result.
+ */
+template <typename P, unsigned mask>
+void scaleChannels(P * output, const P * tga, const int * values, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        P pixel = tga[i];
+
+        for (int c = 0; c < 3; ++c) {
+            if (mask & (1u << c)) {
+                pixel.data[c] = clampToByte(pixel.data[c] * values[c]);
+            }
+        }
+
+        output[i] = pixel;
+    }
+}
+
+/**
+ * Copies one channel into all three.
+ */
+template <typename P, unsigned channel>
+void onlyChannel(P * output, const P * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        P pixel = tga[i];
+
+        pixel.data[0] = pixel.data[channel];
+        pixel.data[1] = pixel.data[channel];
+        pixel.data[2] = pixel.data[channel];
+
+        output[i] = pixel;
+    }
+}
+
+/**
+ * Maps every channel c in the mask through its table, reading channel source[c]
+ * (see operationLookup).
+ */
+template <typename P, unsigned mask>
+void lookupChannels(P * output, const P * tga, const unsigned char * table, const int * source, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        // Read from a copy, the output may be the input
+        P pixel = tga[i];
+        P result = pixel;
+
+        for (int c = 0; c < 3; ++c) {
+            if (mask & (1u << c)) {
+                result.data[c] = table[256 * c + pixel.data[source[c]]];
+            }
+        }
+
+        output[i] = result;
+    }
+}
@@ -1,591 +1,240 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <fstream>
 #include <cstring>
+#include <utility>
 
-// Used for flippling the image
-// The reverse function is used to reverse the imageData vector in the TGA struct
-#include <algorithm>
+#include "tga.h"
+#include "job.h"
+#include "batch.h"
+#include "compare.h"
+#include "mipmap.h"
+#include "mosaic.h"
+#include "server.h"
+#include "stream.h"
 
 using namespace std;
 
-struct Pixel
-{
-    // blue, green, red;
-    unsigned char data[3]; 
-};
-
-struct TGA
-{
-    // Header
-    char idLength;
-    char colorMapType;
-    char dataTypeCode;
-    short colorMapOrigin;
-    short colorMapLength;
-    char colorMapDepth;
-    short xOrigin;
-    short yOrigin;
-    short width;
-    short height;
-    char bitsPerPixel;
-    char imageDescriptor;
-
-    // Pixels
-    vector <Pixel> imageData;
-};
-
-TGA readTGA(string const &filename, 
-            string const & errorMessage = "Error: Cannot open TGA File")
-{
-    // Open the tga file in binary mode
-    ifstream file(filename, std::ios::binary);
-
-    // Make sure the file is opened successfully
-    if ( !file.is_open() ) {
-        cout << errorMessage << endl;
-        exit(1);
-    }
-
-    TGA tga;
-
-    // Read the header data
-
-    file.read((char*)&tga.idLength, 1);
-    file.read((char*)&tga.colorMapType, 1);
-    file.read((char*)&tga.dataTypeCode, 1);
-    file.read((char*)&tga.colorMapOrigin, 2);
-    file.read((char*)&tga.colorMapLength, 2);
-    file.read((char*)&tga.colorMapDepth, 1);
-    file.read((char*)&tga.xOrigin, 2);
-    file.read((char*)&tga.yOrigin, 2);
-    file.read((char*)&tga.width, 2);
-    file.read((char*)&tga.height, 2);
-    file.read((char*)&tga.bitsPerPixel, 1);
-    file.read((char*)&tga.imageDescriptor, 1);
-
-    // Read all the image data pixels
-    int numPixels = tga.width * tga.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        // Pixels are arranged in BGR format
-        Pixel pixel;
-        file.read((char*) &pixel.data[0], 1);
-        file.read((char*) &pixel.data[1], 1);
-        file.read((char*) &pixel.data[2], 1);
-
-        tga.imageData.push_back(pixel);
-    }
-
-    return tga;
-}
-
-void writeTGA(const TGA & tga, const string & filename)
-{
-    // Open the new file in binary mode
-    ofstream file(filename, std::ios::binary);
-
-    // Make sure the file is opened successfully
-    if ( !file.is_open() ) {
-        cerr << "Error: Writing TGA File" << endl;
-        cerr << "Error: Cannot open TGA File: " << filename << endl;
-        cerr << "Exiting the program" << endl;
-        exit(1);
-    }
-
-    // Write the header
-
-    file.write((char*)&tga.idLength, 1);
-    file.write((char*)&tga.colorMapType, 1);
-    file.write((char*)&tga.dataTypeCode, 1);
-    file.write((char*)&tga.colorMapOrigin, 2);
-    file.write((char*)&tga.colorMapLength, 2);
-    file.write((char*)&tga.colorMapDepth, 1);
-    file.write((char*)&tga.xOrigin, 2);
-    file.write((char*)&tga.yOrigin, 2);
-    file.write((char*)&tga.width, 2);
-    file.write((char*)&tga.height, 2);
-    file.write((char*)&tga.bitsPerPixel, 1);
-    file.write((char*)&tga.imageDescriptor, 1);
-
-    // Write all the image data pixels
-    int numPixels = tga.width * tga.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        // Pixels are arranged in BGR format
-        Pixel pixel = tga.imageData[i];
-
-        file.write((char*) &pixel.data[0], 1);
-        file.write((char*) &pixel.data[1], 1);
-        file.write((char*) &pixel.data[2], 1);
-    }
-}
-
-int clamp(int v) 
+void printUsage()
 {
-    if (v < 0) {
-        v = 0;
-    }
-
-    if (v > 255) {
-        v = 255;
-    }
-
-    return v;
+    cout << "Project 2: Image Processing, Spring 2023" << endl;
+    cout << endl;
+    cout << "Usage:" << endl;
+    cout << "\t./project2.out [options] [output] [firstImage] [method] [...]" << endl;
+    cout << "\t./project2.out [options] --batch [manifest]" << endl;
+    cout << "\t./project2.out [options] --serve [socket]" << endl;
+    cout << "\t./project2.out [options] compare [image] [expectedImage]" << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "\t--threads N\tRun on N threads instead of one per core" << endl;
+    cout << "\t--planar\tProcess the channels as separate planes" << endl;
+    cout << "\t--stream N\tProcess N rows at a time without loading whole images" << endl;
+    cout << "\t--rle\t\tWrite the output with run-length encoding" << endl;
+    cout << "\t--mipmaps MODE\tAlso write the mip chain of the output, as numbered files or one atlas" << endl;
+    cout << "\t--batch FILE\tRun the jobs listed in FILE, one per line, in one process" << endl;
+    cout << "\t--cache N\tKeep up to N MB of images in memory between batch jobs or of mosaic tiles" << endl;
+    cout << "\t--serve SOCKET\tRun the jobs sent to the Unix socket SOCKET by project2-client, keeping caches warm" << endl;
+    cout << "\t--incremental\tOnly recompute the tiles of batch outputs whose inputs changed" << endl;
+    cout << "\t--quick\t\tOnly tell whether compared images match, stopping at the first difference" << endl;
+    cout << endl;
+    cout << "Use - as the output or an input to write to stdout or read from stdin." << endl;
 }
 
-TGA operationMultiply(TGA const &lhs, TGA const &rhs)
+int main(int argc, char **argv)
 {
-    // lhs and rhs have same header and so does the resultant tga file
-    TGA output = lhs;
+    int argIndex = 1;
 
-    int numPixels = lhs.width * lhs.height;
+    // Options come before the output file
+    int threads = 0;
+    bool planar = false;
+    int streamRows = 0;
+    bool rle = false;
+    string manifest;
+    string socketPath;
+    int cacheSize = 1024;
+    MipmapLayout mipmaps = MIPMAPS_NONE;
+    bool quick = false;
+    bool incremental = false;
 
-    for (int i = 0; i < numPixels; ++i) {
+    while (argIndex < argc && !strncmp(argv[argIndex], "--", 2) && strcmp(argv[argIndex], "--help")) {
 
-        for (int j = 0; j < 3; ++j) {
-            float a = (float) lhs.imageData[i].data[j];
-            float b = (float) rhs.imageData[i].data[j];
+        const string option = argv[argIndex++];
 
-            a /= 255.0;
-            b /= 255.0;
+        if (option == "--threads") {
+            threads = readIntegerArgument(argIndex, argc, argv);
 
-            output.imageData[i].data[j] = (unsigned char)(int)(((a * b) * 255.0) + 0.5);
+            if (threads < 1) {
+                cout << "Invalid argument, expected a positive number of threads." << endl;
+                exit(1);
+            }
         }
-    }
-
-    return output;
-}
-
-TGA operationAddition(TGA const & lhs, TGA const & rhs)
-{
-    // lhs and rhs have same header and so does the resultant tga file
-    TGA output = lhs;
-
-    int numPixels = lhs.width * lhs.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        for (int j = 0; j < 3; ++j) {
-            int a = lhs.imageData[i].data[j];
-            int b = rhs.imageData[i].data[j];
-
-            int r = (a + b);
-
-            r = clamp(r);
-
-            output.imageData[i].data[j] = (unsigned char)r;
+        else if (option == "--planar") {
+            planar = true;
         }
-    }
-
-    return output;
-}
-
-TGA operationSubtraction(TGA const & lhs, TGA const & rhs)
-{
-    // lhs and rhs have same header and so does the resultant tga file
-    TGA output = lhs;
-
-    int numPixels = lhs.width * lhs.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        for (int j = 0; j < 3; ++j) {
-            int a = lhs.imageData[i].data[j];
-            int b = rhs.imageData[i].data[j];
-
-            int r = (a - b);
-
-            r = clamp(r);
-
-            output.imageData[i].data[j] = (unsigned char)r;
+        else if (option == "--quick") {
+            quick = true;
         }
-    }
-
-    return output;
-}
-
-
-TGA operationScreen(TGA const &lhs, TGA const &rhs)
-{
-    // lhs and rhs have same header and so does the resultant tga file
-    TGA output = lhs;
-
-    int numPixels = lhs.width * lhs.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        for (int j = 0; j < 3; ++j) {
-            float a = (float) lhs.imageData[i].data[j];
-            float b = (float) rhs.imageData[i].data[j];
-
-            a /= 255.0;
-            b /= 255.0;
-
-            float r = 1 - ((1 - a) * (1 - b));
-
-            output.imageData[i].data[j] = (unsigned char)(int)((r * 255.0) + 0.5);
+        else if (option == "--incremental") {
+            incremental = true;
         }
-    }
-
-    return output;
-}
-
-
-TGA operationOverlay(TGA const &lhs, TGA const &rhs)
-{
-    // lhs and rhs have same header and so does the resultant tga file
-    TGA output = lhs;
-
-    int numPixels = lhs.width * lhs.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-
-        for (int j = 0; j < 3; ++j) {
-            float a = (float) lhs.imageData[i].data[j];
-            float b = (float) rhs.imageData[i].data[j];
-
-            a /= 255.0;
-            b /= 255.0;
+        else if (option == "--rle") {
+            rle = true;
+        }
+        else if (option == "--stream") {
+            streamRows = readIntegerArgument(argIndex, argc, argv);
 
-            float r = 0.0;
+            if (streamRows < 1) {
+                cout << "Invalid argument, expected a positive number of rows." << endl;
+                exit(1);
+            }
+        }
+        else if (option == "--mipmaps") {
+            string mode = argIndex < argc ? argv[argIndex++] : "";
 
-            if (b <= 0.5) {
-                r = 2 * a * b;
+            if (mode == "numbered") {
+                mipmaps = MIPMAPS_NUMBERED;
+            }
+            else if (mode == "atlas") {
+                mipmaps = MIPMAPS_ATLAS;
             }
             else {
-                r = 1 - (2 * (1 - a) * (1 - b));
+                cout << "Invalid argument, expected numbered or atlas." << endl;
+                exit(1);
             }
-
-            output.imageData[i].data[j] = (unsigned char)(int)((r * 255.0) + 0.5);
         }
-    }
-
-    return output;
-}
-
-TGA operationAddition(TGA const & tga, int red, int green, int blue)
-{
-    // tga and the output will have the same header and imageData dimension
-    TGA output = tga;
-
-    int numPixels = tga.width * tga.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-        
-        int value[3] = {
-            blue, green, red
-        };
-
-        for (int j = 0; j < 3; ++j) {
-            int a = tga.imageData[i].data[j];
-            int b = value[j];
-
-            int r = (a + b);
-
-            r = clamp(r);
+        else if (option == "--batch") {
+            if (argIndex >= argc) {
+                cout << "Missing argument." << endl;
+                exit(1);
+            }
 
-            output.imageData[i].data[j] = (unsigned char)r;
+            manifest = argv[argIndex++];
         }
-    }
-
-    return output;
-}
-
-
-
-TGA operationScale(TGA const & tga, int red, int green, int blue)
-{
-    // tga and the output will have the same header and imageData dimension
-    TGA output = tga;
-
-    int numPixels = tga.width * tga.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-        
-        int value[3] = {
-            blue, green, red
-        };
-
-        for (int j = 0; j < 3; ++j) {
-            int a = tga.imageData[i].data[j];
-            int b = value[j];
-
-            int r = (a * b);
-
-            r = clamp(r);
+        else if (option == "--serve") {
+            if (argIndex >= argc) {
+                cout << "Missing argument." << endl;
+                exit(1);
+            }
 
-            output.imageData[i].data[j] = (unsigned char)r;
+            socketPath = argv[argIndex++];
         }
-    }
-
-    return output;
-}
+        else if (option == "--cache") {
+            cacheSize = readIntegerArgument(argIndex, argc, argv);
 
-
-
-TGA operationOnly(TGA const & tga, bool red, bool green, bool blue)
-{
-    // tga and the output will have the same header and imageData dimension
-    TGA output = tga;
-
-    int numPixels = tga.width * tga.height;
-
-    for (int i = 0; i < numPixels; ++i) {
-        
-        // order = blue, green, red
-        if (red) {
-            output.imageData[i].data[0] = tga.imageData[i].data[2];
-            output.imageData[i].data[1] = tga.imageData[i].data[2];
-            output.imageData[i].data[2] = tga.imageData[i].data[2];
-        }
-        else if (green) {
-            output.imageData[i].data[0] = tga.imageData[i].data[1];
-            output.imageData[i].data[1] = tga.imageData[i].data[1];
-            output.imageData[i].data[2] = tga.imageData[i].data[1];
+            if (cacheSize < 0) {
+                cout << "Invalid argument, expected a cache size in MB." << endl;
+                exit(1);
+            }
         }
-        else if (blue) {
-            output.imageData[i].data[0] = tga.imageData[i].data[0];
-            output.imageData[i].data[1] = tga.imageData[i].data[0];
-            output.imageData[i].data[2] = tga.imageData[i].data[0];
+        else {
+            cout << "Invalid option." << endl;
+            exit(1);
         }
     }
 
-    return output;
-}
-
-
-TGA operationCombine(TGA const & red, TGA const & green, TGA const & blue)
-{
-    // tga and the output will have the same header and imageData dimension
-    TGA output = red;
+    // The jobs come from the clients, with their own options
+    if (!socketPath.empty()) {
+        if (!manifest.empty() || streamRows || mipmaps || incremental || argIndex != argc) {
+            cout << "Invalid option, --serve only takes --threads and --cache." << endl;
+            exit(1);
+        }
 
-    int numPixels = red.width * red.height;
+        runServer(socketPath, threads, (size_t)cacheSize << 20);
 
-    for (int i = 0; i < numPixels; ++i) {
-        output.imageData[i].data[0] = blue.imageData[i].data[0];
-        output.imageData[i].data[1] = green.imageData[i].data[1];
-        output.imageData[i].data[2] = red.imageData[i].data[2];
+        return 0;
     }
 
-    return output;
-}
-
-
-TGA operationFlip(TGA const & tga)
-{
-    // tga and the output will have the same header and imageData dimension
-    TGA output = tga;
+    if (!manifest.empty()) {
+        if (streamRows || argIndex != argc) {
+            cout << "Invalid option, --batch takes its jobs from the manifest only and cannot stream." << endl;
+            exit(1);
+        }
 
-    reverse(output.imageData.begin(), output.imageData.end());
+        // Outputs are patched in place, so they must be uncompressed single images
+        if (incremental && (rle || mipmaps)) {
+            cout << "Invalid option, --incremental cannot be combined with --rle or --mipmaps." << endl;
+            exit(1);
+        }
 
-    return output;
-}
+        ThreadPool pool(threads);
 
-void printUsage()
-{
-    cout << "Project 2: Image Processing, Spring 2023" << endl;
-    cout << endl;
-    cout << "Usage:" << endl;
-    cout << "\t./project2.out [output] [firstImage] [method] [...]" << endl;
-}
+        runBatch(manifest, planar, rle, mipmaps, (size_t)cacheSize << 20, incremental, pool);
 
-bool stringEndingWith(string const & src, string const & extension)
-{
-    if (src.size() >= extension.size()) {
-        const char * start = src.c_str() + (src.size() - extension.size());
-        return strcmp(start, extension.c_str()) == 0;
+        return 0;
     }
 
-    return false;
-}
+    // Exits with 1 if the images differ, as a failed check
+    if (argIndex < argc && !strcmp(argv[argIndex], "compare")) {
+        if (argIndex + 3 != argc) {
+            cout << "Invalid argument, compare takes two image files." << endl;
+            exit(1);
+        }
 
-TGA readTGAArgument(int & cmdIndex, int argc, char **argv)
-{
-    if (cmdIndex >= argc) {
-        cout << "Missing argument." << endl;
-        exit(1);
-    }
+        ThreadPool pool(threads);
 
-    if (!stringEndingWith(argv[cmdIndex], ".tga")) {
-        cout << "Invalid argument, invalid file name." << endl;
-        exit(1);
+        return runCompare(argv[argIndex + 1], argv[argIndex + 2], quick, pool) ? 0 : 1;
     }
 
-    TGA input2 = readTGA(argv[cmdIndex],  "Invalid argument, file does not exist.");
-
-    cmdIndex++;
-
-    return input2;
-}
-
-int readIntegerArgument(int & cmdIndex, int argc, char **argv)
-{
-    if (cmdIndex >= argc) {
-        cout << "Missing argument." << endl;
-        exit(1);
+    if (argIndex == argc || (argIndex == argc - 1 && !strcmp(argv[argIndex], "--help")) ) {
+        printUsage();
+        return 0;
     }
 
-    int value = 0;
-    
-    try {
-        value = std::stoi(argv[cmdIndex]);
-    }
-    catch(...) {
-        cout << "Invalid argument, expected number." << endl;
+    if (incremental) {
+        cout << "Invalid option, --incremental only applies to --batch." << endl;
         exit(1);
     }
 
-    cmdIndex++;
-
-    return value;
-}
-
-int main(int argc, char **argv)
-{
-    if (argc == 1 || (argc == 2 && !strcmp(argv[1], "--help")) ) {
-        printUsage();
-        return 0;
-    }
-
-    const string output = argv[1];
-    
-    if (!stringEndingWith(output, ".tga")) {
-        cout << "Invalid file name." << endl;
+    if (planar && streamRows) {
+        cout << "Invalid option, --planar and --stream cannot be combined." << endl;
         exit(1);
     }
 
-    if (argc < 3 || !stringEndingWith(argv[2], ".tga")) {
-        cout << "Invalid file name." << endl;
+    if (mipmaps && streamRows) {
+        cout << "Invalid option, --mipmaps and --stream cannot be combined." << endl;
         exit(1);
     }
 
-    TGA trackingImage = readTGA(argv[2], "File does not exist.");
+    // Parse the methods first, then run them all together
+    Job job = parseJob(argIndex, argc, argv);
 
-    int cmdIndex = 3;
+    ThreadPool pool(threads);
 
-    do {
-        
-        if (cmdIndex >= argc) {
-            cout << "Invalid method name." << endl;
+    // Mosaics run tile by tile, each tile a whole image of its own
+    if (usesMosaics(job)) {
+        if (streamRows || mipmaps) {
+            cout << "Invalid option, mosaics cannot be streamed or written with mipmaps." << endl;
             exit(1);
         }
 
-        const string method = argv[cmdIndex++];
-
-        if (method == "multiply") {
-
-            TGA input = readTGAArgument(cmdIndex, argc, argv);
-            TGA output = operationMultiply(trackingImage, input);
-            trackingImage = output;
-
-            cout << "... Multiplying" << endl;
-        }
-        else if (method == "subtract") {
-
-            TGA input = readTGAArgument(cmdIndex, argc, argv);
-            TGA output = operationSubtraction(trackingImage, input);
-            trackingImage = output;
-
-            cout << "... Subtracting" << endl;
-        }
-        else if (method == "overlay") {
-
-            TGA input = readTGAArgument(cmdIndex, argc, argv);
-            TGA output = operationOverlay(trackingImage, input);
-            trackingImage = output;
-
-            cout << "... Overlaying" << endl;
-        }
-        else if (method == "screen") {
-
-            TGA input = readTGAArgument(cmdIndex, argc, argv);
-            TGA output = operationScreen(input, trackingImage);
-            trackingImage = output;
-
-            cout << "... Screen" << endl;
-        }
-        else if (method == "combine") {
-
-            TGA greenLayer = readTGAArgument(cmdIndex, argc, argv);
-            TGA blueLayer = readTGAArgument(cmdIndex, argc, argv);
-            TGA output = operationCombine(trackingImage, greenLayer, blueLayer);
-            trackingImage = output;
+        runMosaic(job, planar, rle, (size_t)cacheSize << 20, pool);
 
-            cout << "... Combining" << endl;
-        }
-        else if (method == "flip") {
+        return 0;
+    }
 
-            trackingImage = operationFlip(trackingImage);
+    // Streaming reads the images band by band as it goes, the others load them now
+    if (streamRows) {
+        cout << "... streaming output to " << job.output << "!" << endl;
 
-            cout << "... Flipping" << endl;
-        }
-        else if (method == "onlyred" || method == "onlygreen" || method == "onlyblue")  {
+        runStreaming(job.firstImage, job.stages, job.output, streamRows, rle, pool);
 
-            trackingImage = operationOnly(
-                trackingImage, 
-                method == "onlyred",
-                method == "onlygreen", 
-                method == "onlyblue"
-            );
-
-            cout << "... Operation = " << method << endl;
-        }
-        else if (method == "addred" || method == "addgreen" || method == "addblue") {
-
-            int value = readIntegerArgument(cmdIndex, argc, argv);
-            
-            int red = 0;
-            int green = 0;
-            int blue = 0;
-            if (method == "addred") {
-                red = value;
-            }
-            else if (method == "addgreen") {
-                green = value;
-            }
-            else {
-                blue = value;
-            }
-
-            trackingImage = operationAddition(trackingImage, red, green, blue);
+        return 0;
+    }
 
-            cout << "... Operation = " << method << endl;
-        }
-        else if (method == "scalered" || method == "scalegreen" || method == "scaleblue") {
-
-            int value = readIntegerArgument(cmdIndex, argc, argv);
-            
-            int red = 1;
-            int green = 1;
-            int blue = 1;
-            if (method == "scalered") {
-                red = value;
-            }
-            else if (method == "scalegreen") {
-                green = value;
-            }
-            else {
-                blue = value;
-            }
+    TGA trackingImage = loadJob(job, readTGA);
+    TGA result = runJob(move(trackingImage), job, planar, pool);
 
-            trackingImage = operationScale(trackingImage, red, green, blue);
+    cout << "... and saving output to " << job.output << "!" << endl;
 
-            cout << "... Operation = " << method << endl;
-        }
-        else {
-            cout << "Invalid method name." << endl;
-            exit(1); 
-        }
+    if (mipmaps == MIPMAPS_NUMBERED) {
+        writeMipmaps(buildMipmaps(move(result), pool), job.output, rle);
+    }
+    else if (mipmaps == MIPMAPS_ATLAS) {
+        writeTGA(packMipmaps(buildMipmaps(move(result), pool)), job.output, rle);
+    }
+    else {
+        writeTGA(result, job.output, rle);
     }
-    while (cmdIndex < argc);
-
-    cout << "... and saving output to " << output << "!" << endl;
-
-    writeTGA(trackingImage, output);
 
     return 0;
-}
\ No newline at end of file
+}
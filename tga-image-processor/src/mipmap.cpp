@@ -0,0 +1,180 @@
+#include "mipmap.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "pipeline.h"
+
+using namespace std;
+
+// Averages the 2 x 2 blocks of two rows of a level into a row of the next one
+static void halveRow(unsigned char * output, int width, const unsigned char * top, const unsigned char * bottom,
+                     int sourceWidth, int channels, unsigned short * sums)
+{
+    size_t bytes = (size_t)sourceWidth * channels;
+
+    // Both rows summed first, a whole row at a time
+    for (size_t i = 0; i < bytes; ++i) {
+        sums[i] = (unsigned short)(top[i] + bottom[i]);
+    }
+
+    for (int x = 0; x < width; ++x) {
+        const unsigned short * left = sums + (size_t)(2 * x) * channels;
+        const unsigned short * right = sums + (size_t)min(2 * x + 1, sourceWidth - 1) * channels;
+
+        for (int c = 0; c < channels; ++c) {
+            output[(size_t)x * channels + c] = (unsigned char)((left[c] + right[c] + 2) >> 2);
+        }
+    }
+}
+
+// Builds the rows of the levels first + 1 to last that come from the rows
+// [begin, end) of level first; begin is a multiple of 2 ^ (last - first)
+static void halveBand(vector<TGA> & levels, size_t first, size_t last, int begin, int end)
+{
+    int channels = levels[first].channels();
+    vector<unsigned short> sums((size_t)levels[first].width * channels);
+
+    for (size_t l = first + 1; l <= last; ++l) {
+        TGA const & above = levels[l - 1];
+        TGA & level = levels[l];
+
+        // The rows of the band in this level; a band ending at the bottom of
+        // the level above takes the rest of this one
+        end = end == above.height ? level.height : end / 2;
+        begin = begin / 2;
+
+        const unsigned char * source = above.bytes();
+        unsigned char * output = level.imageData.data();
+        size_t sourceRowBytes = (size_t)above.width * channels;
+        size_t rowBytes = (size_t)level.width * channels;
+
+        for (int y = begin; y < end; ++y) {
+            const unsigned char * top = source + (size_t)(2 * y) * sourceRowBytes;
+            const unsigned char * bottom = source + (size_t)min(2 * y + 1, above.height - 1) * sourceRowBytes;
+
+            halveRow(output + (size_t)y * rowBytes, level.width, top, bottom, above.width, channels, sums.data());
+        }
+    }
+}
+
+vector<TGA> buildMipmaps(TGA image, ThreadPool & pool)
+{
+    // Copies of the image share its pixels, every level starts as one
+    shareTGA(image);
+
+    vector<TGA> levels(1, image);
+
+    int width = image.width;
+    int height = image.height;
+
+    while (width > 1 || height > 1) {
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+
+        TGA level = image;
+        level.width = (short)width;
+        level.height = (short)height;
+        level.resetBytes();
+
+        levels.push_back(move(level));
+    }
+
+    size_t first = 0;
+
+    while (first + 1 < levels.size()) {
+        // Bands of 2 ^ depth rows, about as many pixels as the bands of a pipeline
+        // pass, are halved depth levels deep while they are in the cache
+        int rows = bandRows(levels[first].width);
+        size_t depth = 1;
+
+        while ((2 << depth) <= rows && first + depth + 1 < levels.size()) {
+            depth++;
+        }
+
+        size_t last = first + depth;
+
+        pool.parallelFor(levels[first].height, 1 << depth, [&](int begin, int end) {
+            halveBand(levels, first, last, begin, end);
+        });
+
+        first = last;
+    }
+
+    return levels;
+}
+
+TGA packMipmaps(vector<TGA> const & levels)
+{
+    TGA const & image = levels[0];
+    int channels = image.channels();
+
+    int width = image.width + (levels.size() > 1 ? levels[1].width : 0);
+    int height = 0;
+
+    for (size_t l = 1; l < levels.size(); ++l) {
+        height += levels[l].height;
+    }
+
+    height = max(height, (int)image.height);
+
+    // The header holds 16-bit sizes
+    if (width > 32767) {
+        cout << "Error: The mipmap atlas would be too large." << endl;
+        exit(1);
+    }
+
+    TGA atlas = image;
+    atlas.width = (short)width;
+    atlas.height = (short)height;
+
+    unsigned char * pixels = atlas.resetBytes();
+    size_t rowBytes = (size_t)width * channels;
+
+    memset(pixels, 0, atlas.dataSize());
+
+    int x = 0;
+    int y = 0;
+
+    for (size_t l = 0; l < levels.size(); ++l) {
+        TGA const & level = levels[l];
+        size_t levelRowBytes = (size_t)level.width * channels;
+
+        for (int row = 0; row < level.height; ++row) {
+            memcpy(pixels + (size_t)(y + row) * rowBytes + (size_t)x * channels,
+                   level.bytes() + (size_t)row * levelRowBytes, levelRowBytes);
+        }
+
+        // The first level fills the left, the others stack up to its right
+        if (l == 0) {
+            x = level.width;
+        }
+        else {
+            y += level.height;
+        }
+    }
+
+    return atlas;
+}
+
+string mipmapFilename(string const & filename, int level)
+{
+    // Before the .tga extension
+    return filename.substr(0, filename.size() - 4) + "_" + to_string(level) + ".tga";
+}
+
+void writeMipmaps(vector<TGA> const & levels, string const & filename, bool rle)
+{
+    if (filename == "-") {
+        cout << "Error: Numbered mipmaps cannot be written to stdout." << endl;
+        exit(1);
+    }
+
+    writeTGA(levels[0], filename, rle);
+
+    for (size_t l = 1; l < levels.size(); ++l) {
+        writeTGA(levels[l], mipmapFilename(filename, (int)l), rle);
+    }
+}
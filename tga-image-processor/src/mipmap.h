@@ -0,0 +1,64 @@
+/**
+ * @file mipmap.h
+ * Mip chains of output images: every level half the size of the one before
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "threadpool.h"
+
+enum MipmapLayout
+{
+    MIPMAPS_NONE,
+
+    // The image itself and every level in a file of its own, numbered
+    MIPMAPS_NUMBERED,
+
+    // One image with the levels packed next to the image
+    MIPMAPS_ATLAS
+};
+
+/**
+ * Builds the whole mip chain of an image: each level is half the width and
+ * height of the one before, rounded down and at least 1, down to 1 x 1. Every
+ * pixel is the mean of a 2 x 2 block of the level above; the last row and
+ * column of odd sizes are dropped.
+ *
+ * All the levels are built in one sweep over the image: bands of rows are
+ * halved again and again while they are still in the cache, as many levels
+ * deep as the band is high, and the levels past that are built the same way
+ * from the deepest one. The bands run across the thread pool.
+ *
+ * @return The levels, starting with the image itself
+ */
+std::vector<TGA> buildMipmaps(TGA image, ThreadPool & pool);
+
+/**
+ * Packs the levels into one image: the first level at the left, and the others
+ * stacked from the bottom up in a column to its right. The rest is black, and
+ * transparent if the image has alpha.
+ *
+ * Prints an error and exits if the atlas is too large for a TGA file.
+ */
+TGA packMipmaps(std::vector<TGA> const & levels);
+
+/**
+ * @return The file name of a level written as a file of its own, the number
+ *         of the level added to the file name: "out.tga" gives "out_2.tga"
+ */
+std::string mipmapFilename(std::string const & filename, int level);
+
+/**
+ * Writes the first level to the file name and every other one to the file
+ * name numbered after it (see mipmapFilename).
+ *
+ * Prints an error and exits if a file cannot be written, or if the file name
+ * is stdout ("-"), which cannot be numbered.
+ *
+ * @param rle Compress the files with run-length encoding
+ */
+void writeMipmaps(std::vector<TGA> const & levels, std::string const & filename, bool rle);
@@ -0,0 +1,339 @@
+#include "mosaic.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include "buffers.h"
+
+using namespace std;
+
+// The most tiles a mosaic can have, so that they can be counted in an int
+const long long MOSAIC_MAX_TILES = 1 << 24;
+
+static void invalidMosaic(string const & filename)
+{
+    cout << "Error: Invalid mosaic file: " << filename << endl;
+    exit(1);
+}
+
+// The directory of a file, with its trailing slash, empty for the current one
+static string directoryOf(string const & filename)
+{
+    size_t slash = filename.find_last_of('/');
+
+    return slash == string::npos ? "" : filename.substr(0, slash + 1);
+}
+
+bool isMosaicName(string const & filename)
+{
+    return stringEndingWith(filename, ".mosaic");
+}
+
+bool usesMosaics(Job const & job)
+{
+    if (isMosaicName(job.output) || isMosaicName(job.firstImage)) {
+        return true;
+    }
+
+    for (Stage const & stage : job.stages) {
+        if (isMosaicName(stage.inputName) || isMosaicName(stage.input2Name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Mosaic::open(string const & filename)
+{
+    name = filename;
+
+    // A single image is a mosaic of one tile, read the header only for its size
+    if (!isMosaicName(filename)) {
+        TGAReader reader;
+
+        if (!reader.open(filename)) {
+            cout << "Invalid argument, file does not exist." << endl;
+            exit(1);
+        }
+
+        fullWidth = reader.header().width;
+        fullHeight = reader.header().height;
+        columnWidth = max((int)fullWidth, 1);
+        rowHeight = max((int)fullHeight, 1);
+        columnCount = 1;
+        rowCount = 1;
+        tiles.assign(1, filename);
+
+        return;
+    }
+
+    ifstream file(filename);
+
+    if (!file) {
+        cout << "Error: Cannot open mosaic file: " << filename << endl;
+        exit(1);
+    }
+
+    string magic;
+    file >> magic >> fullWidth >> fullHeight >> columnWidth >> rowHeight;
+
+    // Every tile must fit the 16-bit sizes of a TGA file
+    if (!file || magic != "mosaic" || fullWidth < 1 || fullHeight < 1 ||
+        columnWidth < 1 || columnWidth > 32767 || rowHeight < 1 || rowHeight > 32767) {
+        invalidMosaic(filename);
+    }
+
+    long long columns = (fullWidth + columnWidth - 1) / columnWidth;
+    long long rows = (fullHeight + rowHeight - 1) / rowHeight;
+
+    if (columns * rows > MOSAIC_MAX_TILES) {
+        invalidMosaic(filename);
+    }
+
+    columnCount = (int)columns;
+    rowCount = (int)rows;
+    tiles.assign((size_t)columnCount * rowCount, "");
+
+    string directory = directoryOf(filename);
+    string line;
+
+    getline(file, line);
+
+    while (getline(file, line)) {
+        istringstream words(line);
+        int column = 0;
+        int row = 0;
+        string tileName;
+
+        // Blank lines and comments are skipped
+        if (!(words >> tileName) || tileName[0] == '#') {
+            continue;
+        }
+
+        words.clear();
+        words.str(line);
+
+        if (!(words >> column >> row) || column < 0 || column >= columnCount || row < 0 || row >= rowCount) {
+            invalidMosaic(filename);
+        }
+
+        // The file name is the rest of the line, spaces included
+        getline(words >> ws, tileName);
+
+        string & tile = tiles[(size_t)row * columnCount + column];
+
+        if (tileName.empty() || !tile.empty()) {
+            invalidMosaic(filename);
+        }
+
+        tile = tileName[0] == '/' ? tileName : directory + tileName;
+    }
+
+    for (string const & tile : tiles) {
+        if (tile.empty()) {
+            invalidMosaic(filename);
+        }
+    }
+}
+
+int Mosaic::channels(ImageCache & cache) const
+{
+    return tile(cache, 0, 0).channels();
+}
+
+bool Mosaic::topFirst(ImageCache & cache) const
+{
+    return (tile(cache, 0, 0).imageDescriptor & 0x20) != 0;
+}
+
+TGA Mosaic::tile(ImageCache & cache, int column, int row) const
+{
+    string const & filename = tiles[(size_t)row * columnCount + column];
+    TGA image = cache.load(filename, "Invalid argument, file does not exist.");
+
+    long long width = min((long long)columnWidth, fullWidth - (long long)column * columnWidth);
+    long long height = min((long long)rowHeight, fullHeight - (long long)row * rowHeight);
+
+    if (image.width != width || image.height != height) {
+        cout << "Error: Mosaic tile " << filename << " does not have the size of its place in " << name << endl;
+        exit(1);
+    }
+
+    return image;
+}
+
+TGA Mosaic::region(ImageCache & cache, long long x, long long y, int width, int height, int channels,
+                   bool topFirst) const
+{
+    // The rows of the grid are counted the way up the first tile is stored, so
+    // for a mosaic stored the other way up the region is at the other end
+    bool ownTopFirst = this->topFirst(cache);
+    bool flipped = ownTopFirst != topFirst;
+    long long from = flipped ? fullHeight - y - height : y;
+
+    int firstColumn = (int)(x / columnWidth);
+    int lastColumn = (int)((x + width - 1) / columnWidth);
+    int firstRow = (int)(from / rowHeight);
+    int lastRow = (int)((from + height - 1) / rowHeight);
+
+    TGA first = tile(cache, firstColumn, firstRow);
+
+    if (firstColumn == lastColumn && firstRow == lastRow && x % columnWidth == 0 && from % rowHeight == 0 &&
+        width == first.width && height == first.height) {
+        setChannels(first, channels);
+        setOrigin(first, topFirst);
+        return first;
+    }
+
+    // Anything else is put together from the parts of the tiles it covers,
+    // with the header of the first one
+    TGA result = first;
+    result.mapping.reset();
+    result.view = nullptr;
+    result.width = (short)width;
+    result.height = (short)height;
+    result.bitsPerPixel = 8 * channels;
+    result.imageDescriptor = (result.imageDescriptor & ~0x2F) | (channels == 4 ? 8 : 0) | (topFirst ? 0x20 : 0);
+    result.imageData = imageBuffers().acquire(result.dataSize());
+
+    size_t rowBytes = (size_t)width * channels;
+
+    for (int row = firstRow; row <= lastRow; ++row) {
+        for (int column = firstColumn; column <= lastColumn; ++column) {
+            TGA part = tile(cache, column, row);
+
+            long long left = (long long)column * columnWidth;
+            long long top = (long long)row * rowHeight;
+
+            // The overlap of the tile and the region, in the coordinates of the tile
+            int beginX = (int)(max(x, left) - left);
+            int endX = (int)(min(x + width, left + part.width) - left);
+            int beginY = (int)(max(from, top) - top);
+            int endY = (int)(min(from + height, top + part.height) - top);
+
+            // A tile stored the other way up from the first one is turned over
+            bool upsideDown = ((part.imageDescriptor & 0x20) != 0) != ownTopFirst;
+
+            for (int line = beginY; line < endY; ++line) {
+                int stored = upsideDown ? part.height - 1 - line : line;
+                long long target = flipped ? from + height - 1 - (top + line) : top + line - from;
+
+                unsigned char * to = result.imageData.data() + (size_t)target * rowBytes +
+                                     (size_t)(left + beginX - x) * channels;
+                const unsigned char * pixels = part.bytes() + ((size_t)stored * part.width + beginX) * part.channels();
+
+                convertPixels(to, channels, pixels, part.channels(), endX - beginX);
+            }
+        }
+    }
+
+    return result;
+}
+
+void runMosaic(Job & job, bool planar, bool rle, size_t cacheSize, ThreadPool & pool)
+{
+    if (!isMosaicName(job.output)) {
+        cout << "Invalid argument, mosaics can only be written to a .mosaic output." << endl;
+        exit(1);
+    }
+
+    // Each tile of the output must only depend on the same part of the images
+    for (Stage const & stage : job.stages) {
+        if (isPass(stage.method)) {
+            cout << "Invalid argument, mosaics can only run the methods that work pixel by pixel." << endl;
+            exit(1);
+        }
+    }
+
+    Mosaic first;
+    first.open(job.firstImage);
+
+    vector<Mosaic> inputs(job.stages.size());
+    vector<Mosaic> inputs2(job.stages.size());
+
+    for (size_t i = 0; i < job.stages.size(); ++i) {
+        if (!job.stages[i].inputName.empty()) {
+            inputs[i].open(job.stages[i].inputName);
+        }
+        if (!job.stages[i].input2Name.empty()) {
+            inputs2[i].open(job.stages[i].input2Name);
+        }
+
+        if ((!job.stages[i].inputName.empty() &&
+             (inputs[i].width() != first.width() || inputs[i].height() != first.height())) ||
+            (!job.stages[i].input2Name.empty() &&
+             (inputs2[i].width() != first.width() || inputs2[i].height() != first.height()))) {
+            cout << "Invalid argument, image dimensions do not match." << endl;
+            exit(1);
+        }
+    }
+
+    cout << "... writing mosaic " << job.output << "!" << endl;
+
+    ImageCache cache(cacheSize);
+
+    // The chain runs on the pixel format and the way up of the first image
+    int channels = first.channels(cache);
+    bool topFirst = first.topFirst(cache);
+
+    string directory = directoryOf(job.output);
+    string stem = job.output.substr(directory.size(), job.output.size() - directory.size() - strlen(".mosaic"));
+
+    ostringstream manifest;
+    manifest << "mosaic " << first.width() << " " << first.height() << " "
+             << first.tileWidth() << " " << first.tileHeight() << "\n";
+
+    for (int row = 0; row < first.rows(); ++row) {
+        for (int column = 0; column < first.columns(); ++column) {
+            long long x = (long long)column * first.tileWidth();
+            long long y = (long long)row * first.tileHeight();
+            int width = (int)min((long long)first.tileWidth(), first.width() - x);
+            int height = (int)min((long long)first.tileHeight(), first.height() - y);
+
+            TGA image = first.region(cache, x, y, width, height, channels, topFirst);
+
+            for (size_t i = 0; i < job.stages.size(); ++i) {
+                if (!job.stages[i].inputName.empty()) {
+                    job.stages[i].input = inputs[i].region(cache, x, y, width, height, channels, topFirst);
+                }
+                if (!job.stages[i].input2Name.empty()) {
+                    job.stages[i].input2 = inputs2[i].region(cache, x, y, width, height, channels, topFirst);
+                }
+            }
+
+            TGA result = runJob(move(image), job, planar, pool);
+
+            string tileName = stem + "_" + to_string(column) + "_" + to_string(row) + ".tga";
+            writeTGA(result, directory + tileName, rle);
+            manifest << column << " " << row << " " << tileName << "\n";
+
+            imageBuffers().release(result.imageData);
+
+            // Only the cache keeps tiles between the parts
+            for (Stage & stage : job.stages) {
+                imageBuffers().release(stage.input.imageData);
+                imageBuffers().release(stage.input2.imageData);
+                stage.input = TGA();
+                stage.input2 = TGA();
+            }
+        }
+    }
+
+    // Written last, so the mosaic file only lists tiles that exist
+    ofstream file(job.output);
+    file << manifest.str();
+    file.close();
+
+    if (file.fail()) {
+        cerr << "Error: Cannot write mosaic file: " << job.output << endl;
+        exit(1);
+    }
+
+    cout << "... Wrote " << first.columns() * first.rows() << " tiles, " << cache.misses()
+         << " tiles read from files and " << cache.hits() << " from memory" << endl;
+}
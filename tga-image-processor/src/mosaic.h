@@ -0,0 +1,117 @@
+/**
+ * @file mosaic.h
+ * Virtual images made of a grid of TGA tiles, processed one tile at a time
+ *
+ * A mosaic file describes an image too large for one TGA file, whose sizes are
+ * 16-bit, as a grid of tiles:
+ *
+ *     mosaic WIDTH HEIGHT TILEWIDTH TILEHEIGHT
+ *     COLUMN ROW tile.tga
+ *     ...
+ *
+ * with one line for every tile, the file names relative to the mosaic file.
+ * The tiles of the last column and row are narrower and shorter if the size is
+ * not a multiple of the tile size. Rows are counted in the order the first
+ * tile stores them, and tiles stored the other way up are turned over. Parts
+ * of a mosaic stored the other way up from the first image of a chain are
+ * taken from the other end of the grid and turned over, so that images are
+ * matched as they are shown.
+ *
+ * The tiles are only read when a part of the image is needed, and kept in an
+ * ImageCache, so a chain over mosaics never holds more than the cache allows.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "batch.h"
+#include "job.h"
+#include "threadpool.h"
+
+class Mosaic
+{
+  public:
+    /**
+     * Reads a mosaic file without reading any tile, or makes a mosaic of a
+     * single tile out of a .tga file. Prints an error and exits if the file
+     * cannot be read or is invalid.
+     */
+    void open(std::string const & filename);
+
+    long long width() const { return fullWidth; }
+    long long height() const { return fullHeight; }
+
+    int columns() const { return columnCount; }
+    int rows() const { return rowCount; }
+
+    // The size of the tiles, but for the last column and row
+    int tileWidth() const { return columnWidth; }
+    int tileHeight() const { return rowHeight; }
+
+    /**
+     * @return The number of channels of the first tile, reading it
+     */
+    int channels(ImageCache & cache) const;
+
+    /**
+     * @return Whether the first tile stores its first row at the top, reading it
+     */
+    bool topFirst(ImageCache & cache) const;
+
+    /**
+     * Reads the pixels from x to x + width and y to y + height out of the tiles
+     * they fall into, converted to the given number of channels and with its
+     * rows stored first at the top if topFirst is set, or at the bottom. y
+     * counts rows the way up topFirst says, from the other end of the grid if
+     * the mosaic is stored the other way up. A part that is exactly one tile is
+     * that tile, as it is in the cache.
+     *
+     * Prints an error and exits if a tile cannot be read or does not have the
+     * size of its place in the grid.
+     */
+    TGA region(ImageCache & cache, long long x, long long y, int width, int height, int channels,
+               bool topFirst) const;
+
+  private:
+    TGA tile(ImageCache & cache, int column, int row) const;
+
+    std::string name;
+    long long fullWidth = 0;
+    long long fullHeight = 0;
+    int columnWidth = 0;
+    int rowHeight = 0;
+    int columnCount = 0;
+    int rowCount = 0;
+
+    // The file of every tile, row by row
+    std::vector<std::string> tiles;
+};
+
+/**
+ * @return true if the file name is that of a mosaic, ending with .mosaic
+ */
+bool isMosaicName(std::string const & filename);
+
+/**
+ * @return true if the output or any image of the job is a mosaic
+ */
+bool usesMosaics(Job const & job);
+
+/**
+ * Runs a job whose output is a mosaic, tile by tile. The output has the grid of
+ * the first image, a mosaic or a single .tga file, and every tile goes through
+ * the chain with the same part of every input, which can be mosaics with other
+ * grids or .tga files of the same size. The output tiles are written next to
+ * the output mosaic file, named after it (out_COLUMN_ROW.tga).
+ *
+ * Only the methods that work pixel by pixel can run on mosaics. Prints an error
+ * and exits otherwise, or if the images cannot be read or have different sizes.
+ *
+ * @param planar Process the channels as separate planes
+ * @param rle Compress the output tiles with run-length encoding
+ * @param cacheSize The number of bytes of tiles to keep in memory
+ */
+void runMosaic(Job & job, bool planar, bool rle, size_t cacheSize, ThreadPool & pool);
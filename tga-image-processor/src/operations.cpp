@@ -0,0 +1,420 @@
+#include "operations.h"
+#include "blend.h"
+#include "kernels.h"
+
+// Used for flippling the image
+// The reverse functions are used to reverse the order of the pixels
+#include <algorithm>
+
+using namespace std;
+
+// BGRA results take the alpha of the first image, BGR pixels have none
+static inline void keepAlpha(Pixel &, Pixel const &)
+{
+}
+
+static inline void keepAlpha(PixelBGRA & output, PixelBGRA const & tracking)
+{
+    output.data[3] = tracking.data[3];
+}
+
+// Runs a blend on the vector kernels, which keep the alpha of BGRA pixels themselves
+template <typename P>
+static bool blendPixels(BlendMode mode, P * output, const P * lhs, const P * rhs, int count)
+{
+    return blendBytes(mode, (unsigned char*)output, (const unsigned char*)lhs, (const unsigned char*)rhs,
+                      (size_t)count * sizeof(P), sizeof(P) == sizeof(PixelBGRA));
+}
+
+int clamp(int v) 
+{
+    if (v < 0) {
+        v = 0;
+    }
+
+    if (v > 255) {
+        v = 255;
+    }
+
+    return v;
+}
+
+template <typename P>
+void operationMultiplyReference(P * output, const P * lhs, const P * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+
+        for (int j = 0; j < 3; ++j) {
+            float a = (float) lhs[i].data[j];
+            float b = (float) rhs[i].data[j];
+
+            a /= 255.0;
+            b /= 255.0;
+
+            output[i].data[j] = (unsigned char)(int)(((a * b) * 255.0) + 0.5);
+        }
+
+        keepAlpha(output[i], lhs[i]);
+    }
+}
+
+template <typename P>
+void operationMultiply(P * output, const P * lhs, const P * rhs, int count)
+{
+    if (!blendPixels(BLEND_MULTIPLY, output, lhs, rhs, count)) {
+        operationMultiplyReference(output, lhs, rhs, count);
+    }
+}
+
+template <typename P>
+void operationAddition(P * output, const P * lhs, const P * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+
+        for (int j = 0; j < 3; ++j) {
+            int a = lhs[i].data[j];
+            int b = rhs[i].data[j];
+
+            int r = (a + b);
+
+            r = clamp(r);
+
+            output[i].data[j] = (unsigned char)r;
+        }
+
+        keepAlpha(output[i], lhs[i]);
+    }
+}
+
+template <typename P>
+void operationSubtraction(P * output, const P * lhs, const P * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+
+        for (int j = 0; j < 3; ++j) {
+            int a = lhs[i].data[j];
+            int b = rhs[i].data[j];
+
+            int r = (a - b);
+
+            r = clamp(r);
+
+            output[i].data[j] = (unsigned char)r;
+        }
+
+        keepAlpha(output[i], lhs[i]);
+    }
+}
+
+template <typename P>
+void operationScreenReference(P * output, const P * lhs, const P * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+
+        for (int j = 0; j < 3; ++j) {
+            float a = (float) lhs[i].data[j];
+            float b = (float) rhs[i].data[j];
+
+            a /= 255.0;
+            b /= 255.0;
+
+            float r = 1 - ((1 - a) * (1 - b));
+
+            output[i].data[j] = (unsigned char)(int)((r * 255.0) + 0.5);
+        }
+
+        keepAlpha(output[i], lhs[i]);
+    }
+}
+
+template <typename P>
+void operationScreen(P * output, const P * lhs, const P * rhs, int count)
+{
+    if (!blendPixels(BLEND_SCREEN, output, lhs, rhs, count)) {
+        operationScreenReference(output, lhs, rhs, count);
+    }
+}
+
+template <typename P>
+void operationOverlayReference(P * output, const P * lhs, const P * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+
+        for (int j = 0; j < 3; ++j) {
+            float a = (float) lhs[i].data[j];
+            float b = (float) rhs[i].data[j];
+
+            a /= 255.0;
+            b /= 255.0;
+
+            float r = 0.0;
+
+            if (b <= 0.5) {
+                r = 2 * a * b;
+            }
+            else {
+                r = 1 - (2 * (1 - a) * (1 - b));
+            }
+
+            output[i].data[j] = (unsigned char)(int)((r * 255.0) + 0.5);
+        }
+
+        keepAlpha(output[i], lhs[i]);
+    }
+}
+
+template <typename P>
+void operationOverlay(P * output, const P * lhs, const P * rhs, int count)
+{
+    if (!blendPixels(BLEND_OVERLAY, output, lhs, rhs, count)) {
+        operationOverlayReference(output, lhs, rhs, count);
+    }
+}
+
+template <typename P>
+void operationAddition(P * output, const P * tga, int red, int green, int blue, int count)
+{
+    static void (* const kernels[8])(P *, const P *, const int *, int) = KERNELS_BY_MASK(addChannels, P);
+
+    int values[3] = {
+        blue, green, red
+    };
+
+    // Channels that add 0 are left alone
+    kernels[changedChannels(values, 0)](output, tga, values, count);
+}
+
+template <typename P>
+void operationScale(P * output, const P * tga, int red, int green, int blue, int count)
+{
+    static void (* const kernels[8])(P *, const P *, const int *, int) = KERNELS_BY_MASK(scaleChannels, P);
+
+    int values[3] = {
+        blue, green, red
+    };
+
+    // Channels scaled by 1 are left alone
+    kernels[changedChannels(values, 1)](output, tga, values, count);
+}
+
+template <typename P>
+void operationOnly(P * output, const P * tga, bool red, bool green, bool blue, int count)
+{
+    // order = blue, green, red
+    if (red) {
+        onlyChannel<P, 2>(output, tga, count);
+    }
+    else if (green) {
+        onlyChannel<P, 1>(output, tga, count);
+    }
+    else if (blue) {
+        onlyChannel<P, 0>(output, tga, count);
+    }
+    else if (output != tga) {
+        copy(tga, tga + count, output);
+    }
+}
+
+template <typename P>
+void operationLookup(P * output, const P * tga, const unsigned char * table, const int * source, int count)
+{
+    static void (* const kernels[8])(P *, const P *, const unsigned char *, const int *, int) =
+        KERNELS_BY_MASK(lookupChannels, P);
+
+    kernels[changedChannels(table, source)](output, tga, table, source, count);
+}
+
+template <typename P>
+void operationCombine(P * output, const P * red, const P * green, const P * blue, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        output[i].data[0] = blue[i].data[0];
+        output[i].data[1] = green[i].data[1];
+        output[i].data[2] = red[i].data[2];
+
+        keepAlpha(output[i], red[i]);
+    }
+}
+
+template <typename P>
+void operationFlip(P * output, const P * tga, int count)
+{
+    if (output == tga) {
+        reverse(output, output + count);
+    }
+    else {
+        reverse_copy(tga, tga + count, output);
+    }
+}
+
+template <typename P>
+void operationTranspose(P * output, int outputStride, const P * input,
+                        ptrdiff_t columnStep, ptrdiff_t rowStep, int width, int height)
+{
+    for (int tileY = 0; tileY < height; tileY += TRANSPOSE_TILE) {
+        int endY = min(height, tileY + TRANSPOSE_TILE);
+
+        for (int tileX = 0; tileX < width; tileX += TRANSPOSE_TILE) {
+            int endX = min(width, tileX + TRANSPOSE_TILE);
+
+            for (int y = tileY; y < endY; ++y) {
+                P * row = output + (ptrdiff_t)y * outputStride;
+                const P * from = input + (ptrdiff_t)y * rowStep;
+
+                for (int x = tileX; x < endX; ++x) {
+                    row[x] = from[x * columnStep];
+                }
+            }
+        }
+    }
+}
+
+// round(x / 255); x / 255 is never halfway between two integers
+static inline int divide255(int x)
+{
+    return (x + 127) / 255;
+}
+
+void operationPremultiplyReference(PixelBGRA * output, const PixelBGRA * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int alpha = tga[i].data[3];
+
+        for (int j = 0; j < 3; ++j) {
+            output[i].data[j] = (unsigned char)divide255(tga[i].data[j] * alpha);
+        }
+
+        output[i].data[3] = (unsigned char)alpha;
+    }
+}
+
+void operationUnpremultiplyReference(PixelBGRA * output, const PixelBGRA * tga, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int alpha = tga[i].data[3];
+
+        for (int j = 0; j < 3; ++j) {
+            // Rounded to nearest, halfway up
+            int r = alpha ? (tga[i].data[j] * 255 + alpha / 2) / alpha : 0;
+
+            output[i].data[j] = (unsigned char)clamp(r);
+        }
+
+        output[i].data[3] = (unsigned char)alpha;
+    }
+}
+
+void operationOverPremultipliedReference(PixelBGRA * output, const PixelBGRA * lhs, const PixelBGRA * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int transparency = 255 - lhs[i].data[3];
+
+        // The alpha of the result comes out of the same formula
+        for (int j = 0; j < 4; ++j) {
+            int r = lhs[i].data[j] + divide255(rhs[i].data[j] * transparency);
+
+            output[i].data[j] = (unsigned char)clamp(r);
+        }
+    }
+}
+
+void operationOverReference(PixelBGRA * output, const PixelBGRA * lhs, const PixelBGRA * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        PixelBGRA top;
+        PixelBGRA bottom;
+
+        operationPremultiplyReference(&top, lhs + i, 1);
+        operationPremultiplyReference(&bottom, rhs + i, 1);
+        operationOverPremultipliedReference(&top, &top, &bottom, 1);
+        operationUnpremultiplyReference(output + i, &top, 1);
+    }
+}
+
+// BGR pixels are opaque, compositing leaves them as they are
+static void composite(CompositeMode, Pixel * output, const Pixel * lhs, const Pixel *, int count)
+{
+    if (output != lhs) {
+        copy(lhs, lhs + count, output);
+    }
+}
+
+static void composite(CompositeMode mode, PixelBGRA * output, const PixelBGRA * lhs,
+                      const PixelBGRA * rhs, int count)
+{
+    // The vector kernels do whole vectors, the reference versions the rest
+    int done = (int)compositePixels(mode, (unsigned char*)output, (const unsigned char*)lhs,
+                                    (const unsigned char*)rhs, count);
+
+    output += done;
+    lhs += done;
+    rhs += done;
+    count -= done;
+
+    switch (mode) {
+    case COMPOSITE_OVER:
+        operationOverReference(output, lhs, rhs, count);
+        break;
+    case COMPOSITE_OVER_PREMULTIPLIED:
+        operationOverPremultipliedReference(output, lhs, rhs, count);
+        break;
+    case COMPOSITE_PREMULTIPLY:
+        operationPremultiplyReference(output, lhs, count);
+        break;
+    case COMPOSITE_UNPREMULTIPLY:
+        operationUnpremultiplyReference(output, lhs, count);
+        break;
+    }
+}
+
+template <typename P>
+void operationOver(P * output, const P * lhs, const P * rhs, int count)
+{
+    composite(COMPOSITE_OVER, output, lhs, rhs, count);
+}
+
+template <typename P>
+void operationOverPremultiplied(P * output, const P * lhs, const P * rhs, int count)
+{
+    composite(COMPOSITE_OVER_PREMULTIPLIED, output, lhs, rhs, count);
+}
+
+template <typename P>
+void operationPremultiply(P * output, const P * tga, int count)
+{
+    composite(COMPOSITE_PREMULTIPLY, output, tga, tga, count);
+}
+
+template <typename P>
+void operationUnpremultiply(P * output, const P * tga, int count)
+{
+    composite(COMPOSITE_UNPREMULTIPLY, output, tga, tga, count);
+}
+
+// The operations are compiled for both pixel formats
+#define INSTANTIATE_OPERATIONS(P) \
+    template void operationMultiply(P *, const P *, const P *, int); \
+    template void operationScreen(P *, const P *, const P *, int); \
+    template void operationOverlay(P *, const P *, const P *, int); \
+    template void operationMultiplyReference(P *, const P *, const P *, int); \
+    template void operationScreenReference(P *, const P *, const P *, int); \
+    template void operationOverlayReference(P *, const P *, const P *, int); \
+    template void operationAddition(P *, const P *, const P *, int); \
+    template void operationSubtraction(P *, const P *, const P *, int); \
+    template void operationAddition(P *, const P *, int, int, int, int); \
+    template void operationScale(P *, const P *, int, int, int, int); \
+    template void operationOnly(P *, const P *, bool, bool, bool, int); \
+    template void operationLookup(P *, const P *, const unsigned char *, const int *, int); \
+    template void operationCombine(P *, const P *, const P *, const P *, int); \
+    template void operationFlip(P *, const P *, int); \
+    template void operationTranspose(P *, int, const P *, ptrdiff_t, ptrdiff_t, int, int); \
+    template void operationOver(P *, const P *, const P *, int); \
+    template void operationOverPremultiplied(P *, const P *, const P *, int); \
+    template void operationPremultiply(P *, const P *, int); \
+    template void operationUnpremultiply(P *, const P *, int);
+
+INSTANTIATE_OPERATIONS(Pixel)
+INSTANTIATE_OPERATIONS(PixelBGRA)
+
+// Planes are transposed a byte at a time
+template void operationTranspose(unsigned char *, int, const unsigned char *, ptrdiff_t, ptrdiff_t, int, int);
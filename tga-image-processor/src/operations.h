@@ -0,0 +1,142 @@
+/**
+ * @file operations.h
+ * Per-pixel image operations
+ *
+ * Every operation works on a range of count pixels and writes into a caller
+ * provided output range. The output may be the same range as the first input,
+ * so operations can run in place and be chained over small blocks of an image.
+ */
+
+#pragma once
+
+#include "tga.h"
+
+int clamp(int v);
+
+// Every operation below works on BGR (Pixel) and BGRA (PixelBGRA) pixels. The
+// colors are handled the same way in both, and BGRA results take their alpha
+// from the first image (the tracking image of a chain)
+
+/**
+ * Multiply, screen and overlay run on the fastest vector kernel the CPU supports
+ * (see blend.h) and fall back to the scalar reference versions otherwise.
+ * Both give bit-identical results.
+ */
+template <typename P>
+void operationMultiply(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationScreen(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationOverlay(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationMultiplyReference(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationScreenReference(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationOverlayReference(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationAddition(P * output, const P * lhs, const P * rhs, int count);
+
+template <typename P>
+void operationSubtraction(P * output, const P * lhs, const P * rhs, int count);
+
+/**
+ * Adds a constant to each channel, clamping the result.
+ */
+template <typename P>
+void operationAddition(P * output, const P * tga, int red, int green, int blue, int count);
+
+/**
+ * Multiplies each channel by a constant, clamping the result.
+ */
+template <typename P>
+void operationScale(P * output, const P * tga, int red, int green, int blue, int count);
+
+/**
+ * Copies a single channel into all three channels.
+ */
+template <typename P>
+void operationOnly(P * output, const P * tga, bool red, bool green, bool blue, int count);
+
+/**
+ * Maps each channel through a 256-entry table: channel c of the output is
+ * table[256 * c + v], where v is channel source[c] of the input. Channels are
+ * in blue, green, red order.
+ */
+template <typename P>
+void operationLookup(P * output, const P * tga, const unsigned char * table, const int * source, int count);
+
+/**
+ * Takes each channel from a different image.
+ */
+template <typename P>
+void operationCombine(P * output, const P * red, const P * green, const P * blue, int count);
+
+/**
+ * Reverses the order of the pixels, rotating the image by 180 degrees, or
+ * mirroring it when run over a single row.
+ * The output and the input must either be the same range or not overlap.
+ */
+template <typename P>
+void operationFlip(P * output, const P * tga, int count);
+
+// Pixels per side of the tiles of operationTranspose
+const int TRANSPOSE_TILE = 32;
+
+/**
+ * Copies a width x height block of pixels with rows and columns swapped:
+ * pixel x of output row y is input[x * columnStep + y * rowStep]. Rotations
+ * and transposes are this with different steps.
+ *
+ * The block is copied in square tiles, so the input rows a tile reads across
+ * stay in the cache until the tile is done with them.
+ *
+ * @param outputStride The number of pixels from one output row to the next
+ */
+template <typename P>
+void operationTranspose(P * output, int outputStride, const P * input,
+                        ptrdiff_t columnStep, ptrdiff_t rowStep, int width, int height);
+
+/**
+ * Composites lhs over rhs with straight alpha: the colors of lhs cover those of
+ * rhs as much as the alpha of lhs says. BGR pixels are opaque, so with them
+ * the result is lhs.
+ *
+ * The compositing operations run on vector kernels when there are some (see
+ * compositePixels in blend.h), and on the reference versions otherwise.
+ */
+template <typename P>
+void operationOver(P * output, const P * lhs, const P * rhs, int count);
+
+/**
+ * The same as operationOver, for pixels whose colors are premultiplied by their alpha.
+ */
+template <typename P>
+void operationOverPremultiplied(P * output, const P * lhs, const P * rhs, int count);
+
+/**
+ * Multiplies the colors by the alpha of their pixel.
+ */
+template <typename P>
+void operationPremultiply(P * output, const P * tga, int count);
+
+/**
+ * Divides premultiplied colors by the alpha of their pixel again. The colors of
+ * fully transparent pixels are lost and become black.
+ */
+template <typename P>
+void operationUnpremultiply(P * output, const P * tga, int count);
+
+void operationOverReference(PixelBGRA * output, const PixelBGRA * lhs, const PixelBGRA * rhs, int count);
+
+void operationOverPremultipliedReference(PixelBGRA * output, const PixelBGRA * lhs, const PixelBGRA * rhs, int count);
+
+void operationPremultiplyReference(PixelBGRA * output, const PixelBGRA * tga, int count);
+
+void operationUnpremultiplyReference(PixelBGRA * output, const PixelBGRA * tga, int count);
@@ -0,0 +1,751 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <utility>
+
+#include "buffers.h"
+#include "convolve.h"
+#include "kernels.h"
+#include "operations.h"
+
+using namespace std;
+
+// Pixels per block, about 3 or 4 KB of the tracking image and of every input
+const int BLOCK_SIZE = 1024;
+
+// The kernel of a method that needs nothing picked at run time; method is a
+// constant, so every branch but one compiles away
+template <typename P, Method method>
+static void methodKernel(Stage const & stage, P * output, const P * tracking,
+                         const P * input, const P * input2, int count)
+{
+    if (method == METHOD_MULTIPLY) {
+        operationMultiply(output, tracking, input, count);
+    }
+    else if (method == METHOD_SUBTRACT) {
+        operationSubtraction(output, tracking, input, count);
+    }
+    else if (method == METHOD_OVERLAY) {
+        operationOverlay(output, tracking, input, count);
+    }
+    else if (method == METHOD_SCREEN) {
+        // Screen is symmetric, the tracking image goes first to keep its alpha
+        operationScreen(output, tracking, input, count);
+    }
+    else if (method == METHOD_COMBINE) {
+        operationCombine(output, tracking, input, input2, count);
+    }
+    else if (method == METHOD_OVER) {
+        operationOver(output, tracking, input, count);
+    }
+    else if (method == METHOD_OVER_PREMULTIPLIED) {
+        operationOverPremultiplied(output, tracking, input, count);
+    }
+    else if (method == METHOD_PREMULTIPLY) {
+        operationPremultiply(output, tracking, count);
+    }
+    else if (method == METHOD_UNPREMULTIPLY) {
+        operationUnpremultiply(output, tracking, count);
+    }
+    else if (method == METHOD_GRAYSCALE) {
+        operationGrayscale(output, tracking, count);
+    }
+    else if (method == METHOD_TO_SPACE) {
+        operationToSpace(stage.space, output, tracking, count);
+    }
+    else if (method == METHOD_FROM_SPACE) {
+        operationFromSpace(stage.space, output, tracking, count);
+    }
+    else if (method == METHOD_EXPRESSION) {
+        stage.expression->run(output, tracking, input, count);
+    }
+}
+
+template <typename P, unsigned mask>
+static void addKernel(Stage const & stage, P * output, const P * tracking, const P *, const P *, int count)
+{
+    int values[3] = {
+        stage.blue, stage.green, stage.red
+    };
+
+    addChannels<P, mask>(output, tracking, values, count);
+}
+
+template <typename P, unsigned mask>
+static void scaleKernel(Stage const & stage, P * output, const P * tracking, const P *, const P *, int count)
+{
+    int values[3] = {
+        stage.blue, stage.green, stage.red
+    };
+
+    scaleChannels<P, mask>(output, tracking, values, count);
+}
+
+template <typename P, unsigned channel>
+static void onlyKernel(Stage const &, P * output, const P * tracking, const P *, const P *, int count)
+{
+    onlyChannel<P, channel>(output, tracking, count);
+}
+
+template <typename P, unsigned mask>
+static void lookupKernel(Stage const & stage, P * output, const P * tracking, const P *, const P *, int count)
+{
+    lookupChannels<P, mask>(output, tracking, stage.table.data(), stage.source, count);
+}
+
+template <typename P, unsigned mask>
+static void roundTripKernel(Stage const & stage, P * output, const P * tracking, const P *, const P *, int count)
+{
+    operationRoundTrip(stage.space, output, tracking, stage.table.empty() ? nullptr : stage.table.data(),
+                       stage.source, mask, count);
+}
+
+// Whole image passes run on their own, outside the per-pixel kernels
+template <typename P>
+static void passKernel(Stage const &, P *, const P *, const P *, const P *, int)
+{
+}
+
+template <typename P>
+StageKernel<P> selectKernel(Stage const & stage)
+{
+    static const StageKernel<P> adds[8] = KERNELS_BY_MASK(addKernel, P);
+    static const StageKernel<P> scales[8] = KERNELS_BY_MASK(scaleKernel, P);
+    static const StageKernel<P> lookups[8] = KERNELS_BY_MASK(lookupKernel, P);
+    static const StageKernel<P> roundTrips[8] = KERNELS_BY_MASK(roundTripKernel, P);
+
+    int values[3] = {
+        stage.blue, stage.green, stage.red
+    };
+
+    switch (stage.method) {
+    case METHOD_MULTIPLY:
+        return &methodKernel<P, METHOD_MULTIPLY>;
+    case METHOD_SUBTRACT:
+        return &methodKernel<P, METHOD_SUBTRACT>;
+    case METHOD_OVERLAY:
+        return &methodKernel<P, METHOD_OVERLAY>;
+    case METHOD_SCREEN:
+        return &methodKernel<P, METHOD_SCREEN>;
+    case METHOD_COMBINE:
+        return &methodKernel<P, METHOD_COMBINE>;
+    case METHOD_OVER:
+        return &methodKernel<P, METHOD_OVER>;
+    case METHOD_OVER_PREMULTIPLIED:
+        return &methodKernel<P, METHOD_OVER_PREMULTIPLIED>;
+    case METHOD_PREMULTIPLY:
+        return &methodKernel<P, METHOD_PREMULTIPLY>;
+    case METHOD_UNPREMULTIPLY:
+        return &methodKernel<P, METHOD_UNPREMULTIPLY>;
+    case METHOD_GRAYSCALE:
+        return &methodKernel<P, METHOD_GRAYSCALE>;
+    case METHOD_TO_SPACE:
+        return &methodKernel<P, METHOD_TO_SPACE>;
+    case METHOD_FROM_SPACE:
+        return &methodKernel<P, METHOD_FROM_SPACE>;
+    case METHOD_ROUND_TRIP:
+        // Without a table it only converts there and back
+        return roundTrips[stage.table.empty() ? 0 : changedChannels(stage.table.data(), stage.source)];
+    case METHOD_EXPRESSION:
+        return &methodKernel<P, METHOD_EXPRESSION>;
+    case METHOD_ADD:
+        // Channels that add 0 or scale by 1 are left alone
+        return adds[changedChannels(values, 0)];
+    case METHOD_SCALE:
+        return scales[changedChannels(values, 1)];
+    case METHOD_ONLY:
+        return stage.red ? &onlyKernel<P, 2> : stage.green ? &onlyKernel<P, 1> : &onlyKernel<P, 0>;
+    case METHOD_LOOKUP:
+        return lookups[changedChannels(stage.table.data(), stage.source)];
+    case METHOD_FLIP:
+    case METHOD_FLIP_VERTICAL:
+    case METHOD_MIRROR:
+    case METHOD_ROTATE90:
+    case METHOD_ROTATE270:
+    case METHOD_TRANSPOSE:
+    case METHOD_BLUR:
+    case METHOD_GAUSSIAN:
+    case METHOD_UNSHARP:
+    case METHOD_LUMA_SHARPEN:
+    case METHOD_RESIZE:
+    case METHOD_STATS:
+    case METHOD_HISTOGRAM:
+    case METHOD_AUTOLEVELS:
+    case METHOD_EQUALIZE:
+        break;
+    }
+
+    return &passKernel<P>;
+}
+
+template StageKernel<Pixel> selectKernel(Stage const &);
+template StageKernel<PixelBGRA> selectKernel(Stage const &);
+
+template <typename P>
+vector<StageKernel<P>> selectKernels(vector<Stage> const & stages)
+{
+    vector<StageKernel<P>> kernels;
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        kernels.push_back(selectKernel<P>(stages[i]));
+    }
+
+    return kernels;
+}
+
+template vector<StageKernel<Pixel>> selectKernels(vector<Stage> const &);
+template vector<StageKernel<PixelBGRA>> selectKernels(vector<Stage> const &);
+
+void applyStage(Stage const & stage, Pixel * output, const Pixel * tracking,
+                const Pixel * input, const Pixel * input2, int count)
+{
+    selectKernel<Pixel>(stage)(stage, output, tracking, input, input2, count);
+}
+
+void applyStage(Stage const & stage, PixelBGRA * output, const PixelBGRA * tracking,
+                const PixelBGRA * input, const PixelBGRA * input2, int count)
+{
+    selectKernel<PixelBGRA>(stage)(stage, output, tracking, input, input2, count);
+}
+
+bool isGeometric(Method method)
+{
+    return method == METHOD_FLIP || method == METHOD_FLIP_VERTICAL || method == METHOD_MIRROR ||
+           swapsAxes(method);
+}
+
+bool swapsAxes(Method method)
+{
+    return method == METHOD_ROTATE90 || method == METHOD_ROTATE270 || method == METHOD_TRANSPOSE;
+}
+
+TransposeSteps transposeSteps(Method method, int width, int height, bool topFirst)
+{
+    ptrdiff_t w = width;
+    ptrdiff_t h = height;
+
+    // Rows go bottom to top unless the first row is at the top, which turns
+    // the image the other way round
+    if (method == METHOD_TRANSPOSE) {
+        if (topFirst) {
+            return { 0, w, 1 };
+        }
+        return { (h - 1) * w + w - 1, -w, -1 };
+    }
+
+    if ((method == METHOD_ROTATE90) != topFirst) {
+        return { w - 1, w, -1 };
+    }
+
+    return { (h - 1) * w, -w, 1 };
+}
+
+bool isNeighborhood(Method method)
+{
+    return method == METHOD_BLUR || method == METHOD_GAUSSIAN || method == METHOD_UNSHARP ||
+           method == METHOD_LUMA_SHARPEN;
+}
+
+bool usesHistogram(Method method)
+{
+    return method == METHOD_STATS || method == METHOD_HISTOGRAM || method == METHOD_AUTOLEVELS ||
+           method == METHOD_EQUALIZE;
+}
+
+bool histogramStage(Stage const & stage, Histogram const & histogram, Stage & lookup)
+{
+    if (stage.method == METHOD_STATS) {
+        printStats(histogram, cout);
+        return false;
+    }
+
+    if (stage.method == METHOD_HISTOGRAM) {
+        if (!writeHistogram(histogram, stage.reportName)) {
+            cerr << "Error: Cannot write histogram file: " << stage.reportName << endl;
+            exit(1);
+        }
+        return false;
+    }
+
+    lookup.method = METHOD_LOOKUP;
+    lookup.table.resize(3 * 256);
+
+    if (stage.method == METHOD_AUTOLEVELS) {
+        autolevelsTable(histogram, stage.factor, lookup.table.data());
+    }
+    else {
+        equalizeTable(histogram, lookup.table.data());
+    }
+
+    return true;
+}
+
+void stageSize(Stage const & stage, int & width, int & height)
+{
+    if (swapsAxes(stage.method)) {
+        swap(width, height);
+    }
+    else if (stage.method == METHOD_RESIZE && stage.factor > 0.0) {
+        // Capped well past the largest size a header holds
+        width = max(1, (int)lround(min(width * stage.factor, 65536.0)));
+        height = max(1, (int)lround(min(height * stage.factor, 65536.0)));
+    }
+    else if (stage.method == METHOD_RESIZE) {
+        width = stage.width;
+        height = stage.height;
+    }
+}
+
+bool isPass(Method method)
+{
+    return isGeometric(method) || isNeighborhood(method) || method == METHOD_RESIZE || usesHistogram(method);
+}
+
+// Stages that do the same to every pixel wherever it is in the image; the
+// histogram does not depend on where the pixels are either
+static bool isPositionIndependent(Method method)
+{
+    return method == METHOD_ADD || method == METHOD_SCALE || method == METHOD_ONLY ||
+           method == METHOD_LOOKUP || method == METHOD_PREMULTIPLY || method == METHOD_UNPREMULTIPLY ||
+           method == METHOD_GRAYSCALE || method == METHOD_TO_SPACE || method == METHOD_FROM_SPACE ||
+           method == METHOD_ROUND_TRIP || usesHistogram(method);
+}
+
+// Moves the vertical flips that only have position independent stages after
+// them to the end, leaving at most one
+static vector<Stage> deferVerticalFlips(vector<Stage> const & stages)
+{
+    size_t tail = stages.size();
+
+    while (tail > 0 && (isPositionIndependent(stages[tail - 1].method) ||
+                        stages[tail - 1].method == METHOD_FLIP_VERTICAL)) {
+        tail--;
+    }
+
+    vector<Stage> deferred(stages.begin(), stages.begin() + tail);
+    bool flipped = false;
+
+    for (size_t i = tail; i < stages.size(); ++i) {
+        if (stages[i].method == METHOD_FLIP_VERTICAL) {
+            flipped = !flipped;
+        }
+        else {
+            deferred.push_back(stages[i]);
+        }
+    }
+
+    if (flipped) {
+        Stage flip;
+        flip.method = METHOD_FLIP_VERTICAL;
+        deferred.push_back(flip);
+    }
+
+    return deferred;
+}
+
+static bool isPointStage(Stage const & stage)
+{
+    return stage.method == METHOD_ADD || stage.method == METHOD_SCALE || stage.method == METHOD_ONLY;
+}
+
+// Applies a point stage after the lookup stage compiled so far
+static void composeStage(Stage & lookup, Stage const & stage)
+{
+    int value[3] = {
+        stage.blue, stage.green, stage.red
+    };
+
+    if (stage.method == METHOD_ONLY) {
+        int picked = stage.red ? 2 : stage.green ? 1 : 0;
+
+        // Every channel now ends up as the picked one
+        for (int c = 0; c < 3; ++c) {
+            if (c != picked) {
+                lookup.source[c] = lookup.source[picked];
+                copy(lookup.table.begin() + 256 * picked, lookup.table.begin() + 256 * (picked + 1),
+                     lookup.table.begin() + 256 * c);
+            }
+        }
+        return;
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        unsigned char * table = lookup.table.data() + 256 * c;
+
+        for (int i = 0; i < 256; ++i) {
+            int v = stage.method == METHOD_ADD ? table[i] + value[c] : table[i] * value[c];
+            table[i] = (unsigned char)clamp(v);
+        }
+    }
+}
+
+// Turns every conversion to a color space, the lookup after it if any and the
+// conversion back into one round trip stage
+static vector<Stage> fuseRoundTrips(vector<Stage> const & stages)
+{
+    vector<Stage> fused;
+
+    for (size_t i = 0; i < stages.size(); ) {
+        size_t back = i + 1;
+
+        if (back < stages.size() && stages[back].method == METHOD_LOOKUP) {
+            back++;
+        }
+
+        if (stages[i].method != METHOD_TO_SPACE || back >= stages.size() ||
+            stages[back].method != METHOD_FROM_SPACE || stages[back].space != stages[i].space) {
+            fused.push_back(stages[i++]);
+            continue;
+        }
+
+        Stage trip;
+        trip.method = METHOD_ROUND_TRIP;
+        trip.space = stages[i].space;
+
+        if (back == i + 2) {
+            trip.table = stages[i + 1].table;
+            copy(stages[i + 1].source, stages[i + 1].source + 3, trip.source);
+        }
+
+        fused.push_back(trip);
+        i = back + 1;
+    }
+
+    return fused;
+}
+
+vector<unsigned char> identityTable()
+{
+    vector<unsigned char> table(3 * 256);
+
+    for (int c = 0; c < 3; ++c) {
+        for (int v = 0; v < 256; ++v) {
+            table[256 * c + v] = (unsigned char)v;
+        }
+    }
+
+    return table;
+}
+
+vector<Stage> compileStages(vector<Stage> const & chain)
+{
+    vector<Stage> stages = deferVerticalFlips(chain);
+    vector<Stage> compiled;
+
+    for (size_t i = 0; i < stages.size(); ) {
+        if (!isPointStage(stages[i])) {
+            compiled.push_back(stages[i++]);
+            continue;
+        }
+
+        // Start from the identity and fold in the whole run
+        Stage lookup;
+        lookup.method = METHOD_LOOKUP;
+        lookup.table = identityTable();
+
+        for (; i < stages.size() && isPointStage(stages[i]); ++i) {
+            composeStage(lookup, stages[i]);
+        }
+
+        compiled.push_back(lookup);
+    }
+
+    return fuseRoundTrips(compiled);
+}
+
+int bandRows(int width)
+{
+    return max(1, 65536 / max(1, width));
+}
+
+// Runs the per-pixel stages [first, last) over the pixels [begin, end), each
+// with its kernel
+template <typename P>
+static void runFused(vector<Stage> const & stages, vector<StageKernel<P>> const & kernels,
+                     size_t first, size_t last, P * output, const P * source, int begin, int end)
+{
+    for (int offset = begin; offset < end; offset += BLOCK_SIZE) {
+        int block = min(BLOCK_SIZE, end - offset);
+        const P * tracking = source + offset;
+
+        for (size_t i = first; i < last; ++i) {
+            Stage const & stage = stages[i];
+            const P * inputPixels = (const P*)stage.input.bytes();
+            const P * input2Pixels = (const P*)stage.input2.bytes();
+            const P * input = inputPixels ? inputPixels + offset : nullptr;
+            const P * input2 = input2Pixels ? input2Pixels + offset : nullptr;
+
+            kernels[i](stage, output + offset, tracking, input, input2, block);
+            tracking = output + offset;
+        }
+    }
+}
+
+template <typename P>
+static void runFlip(ThreadPool & pool, P * output, const P * source, int count)
+{
+    if (output != source) {
+        // Each band of the output is the reverse of the mirrored band of the source
+        pool.parallelFor(count, 65536, [&](int begin, int end) {
+            operationFlip(output + begin, source + (count - end), end - begin);
+        });
+        return;
+    }
+
+    // In place, each band of the first half swaps with its mirror in the second half
+    pool.parallelFor(count / 2, 65536, [&](int begin, int end) {
+        swap_ranges(output + begin, output + end, reverse_iterator<P*>(output + (count - begin)));
+    });
+}
+
+template <typename P>
+static void runFlipVertical(ThreadPool & pool, P * output, const P * source, int width, int height)
+{
+    size_t rowBytes = (size_t)width * sizeof(P);
+
+    if (output != source) {
+        pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+            for (int y = begin; y < end; ++y) {
+                memcpy(output + (size_t)y * width, source + (size_t)(height - 1 - y) * width, rowBytes);
+            }
+        });
+        return;
+    }
+
+    // In place, each row of the bottom half swaps with its mirror in the top half
+    pool.parallelFor(height / 2, bandRows(width), [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            P * row = output + (size_t)y * width;
+            swap_ranges(row, row + width, output + (size_t)(height - 1 - y) * width);
+        }
+    });
+}
+
+template <typename P>
+static void runMirror(ThreadPool & pool, P * output, const P * source, int width, int height)
+{
+    pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            operationFlip(output + (size_t)y * width, source + (size_t)y * width, width);
+        }
+    });
+}
+
+// Writes the rotated or transposed source, outputWidth x outputHeight pixels
+template <typename P>
+static void runTranspose(ThreadPool & pool, TransposeSteps const & steps, P * output, const P * source,
+                         int outputWidth, int outputHeight)
+{
+    // Bands of whole rows of tiles
+    int grain = (bandRows(outputWidth) + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    pool.parallelFor(outputHeight, grain, [&](int begin, int end) {
+        operationTranspose(output + (size_t)begin * outputWidth, outputWidth,
+                           source + steps.base + begin * steps.rowStep, steps.columnStep, steps.rowStep,
+                           outputWidth, end - begin);
+    });
+}
+
+// Runs a geometric stage as a whole image pass, into output where it can
+template <typename P>
+static void runGeometry(ThreadPool & pool, Method method, TGA & image, P *& output, const P * source)
+{
+    int width = image.width;
+    int height = image.height;
+
+    if (swapsAxes(method)) {
+        // Rows become columns, which cannot be done in place: the pass writes
+        // into a second buffer, which then takes the place of the first one
+        vector<unsigned char> spare;
+        P * target = output;
+
+        if (source == output) {
+            spare = imageBuffers().acquire(image.dataSize());
+            target = (P*)spare.data();
+        }
+
+        runTranspose(pool, transposeSteps(method, width, height, image.imageDescriptor & 0x20), target, source, height, width);
+
+        if (target != output) {
+            image.imageData.swap(spare);
+            imageBuffers().release(spare);
+            output = target;
+        }
+
+        image.width = (short)height;
+        image.height = (short)width;
+    }
+    else if (method == METHOD_FLIP_VERTICAL) {
+        runFlipVertical(pool, output, source, width, height);
+    }
+    else if (method == METHOD_MIRROR) {
+        runMirror(pool, output, source, width, height);
+    }
+    else {
+        runFlip(pool, output, source, width * height);
+    }
+}
+
+// Runs a blur or sharpening stage over the image, into output
+static void runNeighborhood(ThreadPool & pool, Stage const & stage, TGA const & image,
+                            unsigned char * output, const unsigned char * source)
+{
+    int width = image.width;
+    int height = image.height;
+    int channels = image.channels();
+
+    if (stage.method == METHOD_BLUR) {
+        boxBlur(output, source, width, height, channels, stage.radius, pool);
+    }
+    else if (stage.method == METHOD_GAUSSIAN) {
+        gaussianBlur(output, source, width, height, channels, stage.radius, pool);
+    }
+    else if (stage.method == METHOD_LUMA_SHARPEN) {
+        lumaSharpen(output, source, width, height, channels, stage.radius, stage.amount, pool);
+    }
+    else {
+        unsharpMask(output, source, width, height, channels, stage.radius, stage.amount, pool);
+    }
+}
+
+// Resamples the image from source into a new buffer, which takes the place of output
+template <typename P>
+static void runResize(ThreadPool & pool, Stage const & stage, TGA & image, P *& output, const P * source)
+{
+    int width = image.width;
+    int height = image.height;
+    int resizedWidth = width;
+    int resizedHeight = height;
+
+    stageSize(stage, resizedWidth, resizedHeight);
+
+    vector<unsigned char> resized = imageBuffers().acquire((size_t)resizedWidth * resizedHeight * sizeof(P));
+
+    resizeImage(resized.data(), resizedWidth, resizedHeight, (const unsigned char*)source,
+                width, height, sizeof(P), stage.filter, pool);
+
+    image.imageData.swap(resized);
+    imageBuffers().release(resized);
+
+    image.width = (short)resizedWidth;
+    image.height = (short)resizedHeight;
+    output = (P*)image.imageData.data();
+}
+
+// Counts the image for a stage that works from its histogram, and maps it from
+// source into output through the curve of autolevels and equalize; returns
+// whether it wrote into output
+template <typename P>
+static bool runHistogram(ThreadPool & pool, Stage const & stage, TGA const & image, P * output, const P * source)
+{
+    Histogram histogram = computeHistogram((const unsigned char*)source, image.numPixels(), sizeof(P), pool);
+    vector<Stage> lookup(1);
+
+    if (!histogramStage(stage, histogram, lookup[0])) {
+        return false;
+    }
+
+    vector<StageKernel<P>> kernels = selectKernels<P>(lookup);
+    int width = image.width;
+
+    pool.parallelFor(image.height, bandRows(width), [&](int beginRow, int endRow) {
+        runFused(lookup, kernels, 0, 1, output, source, beginRow * width, endRow * width);
+    });
+
+    return true;
+}
+
+template <typename P>
+static TGA runPipelineOn(TGA image, vector<Stage> const & stages, ThreadPool & pool)
+{
+
+    // Keep the mapped file alive while its pixels are the source of the first pass
+    shared_ptr<MappedFile> mapping = image.mapping;
+    const P * source = (const P*)image.bytes();
+
+    // An image read from a file gets a buffer of its own, anything else runs in place
+    P * output = (P*)(image.view ? image.resetBytes() : image.writableBytes());
+
+    // A vertical flip left at the end only turns the image over in its header
+    size_t end = stages.size();
+    bool flipOrigin = end > 0 && stages[end - 1].method == METHOD_FLIP_VERTICAL;
+
+    if (flipOrigin) {
+        end--;
+    }
+
+    // The kernel of every per-pixel stage is picked once, for the whole chain
+    vector<StageKernel<P>> kernels = selectKernels<P>(stages);
+
+    size_t first = 0;
+
+    while (first < end) {
+
+        if (isGeometric(stages[first].method)) {
+            runGeometry(pool, stages[first].method, image, output, source);
+            source = output;
+            first++;
+            continue;
+        }
+
+        if (isNeighborhood(stages[first].method)) {
+            runNeighborhood(pool, stages[first], image, (unsigned char*)output, (const unsigned char*)source);
+            source = output;
+            first++;
+            continue;
+        }
+
+        if (stages[first].method == METHOD_RESIZE) {
+            runResize(pool, stages[first], image, output, source);
+            source = output;
+            first++;
+            continue;
+        }
+
+        if (usesHistogram(stages[first].method)) {
+            if (runHistogram(pool, stages[first], image, output, source)) {
+                source = output;
+            }
+            first++;
+            continue;
+        }
+
+        size_t last = first;
+        while (last < end && !isPass(stages[last].method)) {
+            last++;
+        }
+
+        int width = image.width;
+
+        // Bands of rows run on all the threads, each one block by block
+        pool.parallelFor(image.height, bandRows(width), [&](int beginRow, int endRow) {
+            runFused(stages, kernels, first, last, output, source, beginRow * width, endRow * width);
+        });
+
+        source = output;
+        first = last;
+    }
+
+    if (source != output) {
+        memcpy(output, source, image.dataSize());
+    }
+
+    if (flipOrigin) {
+        image.imageDescriptor ^= 0x20;
+    }
+
+    return image;
+}
+
+TGA runPipeline(TGA image, vector<Stage> const & stages, ThreadPool & pool)
+{
+    if (image.channels() == 4) {
+        return runPipelineOn<PixelBGRA>(move(image), stages, pool);
+    }
+
+    return runPipelineOn<Pixel>(move(image), stages, pool);
+}
@@ -0,0 +1,266 @@
+/**
+ * @file pipeline.h
+ * Fused execution of a chain of image operations
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "colorspace.h"
+#include "expression.h"
+#include "histogram.h"
+#include "resize.h"
+#include "threadpool.h"
+
+enum Method
+{
+    METHOD_MULTIPLY,
+    METHOD_SUBTRACT,
+    METHOD_OVERLAY,
+    METHOD_SCREEN,
+    METHOD_COMBINE,
+    METHOD_FLIP,
+    METHOD_FLIP_VERTICAL,
+    METHOD_MIRROR,
+    METHOD_ROTATE90,
+    METHOD_ROTATE270,
+    METHOD_TRANSPOSE,
+    METHOD_BLUR,
+    METHOD_GAUSSIAN,
+    METHOD_UNSHARP,
+    METHOD_LUMA_SHARPEN,
+    METHOD_RESIZE,
+    METHOD_STATS,
+    METHOD_HISTOGRAM,
+    METHOD_AUTOLEVELS,
+    METHOD_EQUALIZE,
+    METHOD_ONLY,
+    METHOD_ADD,
+    METHOD_SCALE,
+    METHOD_OVER,
+    METHOD_OVER_PREMULTIPLIED,
+    METHOD_PREMULTIPLY,
+    METHOD_UNPREMULTIPLY,
+    METHOD_LOOKUP,
+    METHOD_GRAYSCALE,
+    METHOD_TO_SPACE,
+    METHOD_FROM_SPACE,
+    METHOD_ROUND_TRIP,
+    METHOD_EXPRESSION
+};
+
+/**
+ * One method of the chain given on the command line.
+ */
+struct Stage
+{
+    Method method;
+
+    // Images blended with or composited under the tracking image; combine takes
+    // green and blue from them
+    std::string inputName;
+    std::string input2Name;
+    TGA input;
+    TGA input2;
+
+    // Per channel amounts for add and scale, or the channel picked by only
+    int red = 0;
+    int green = 0;
+    int blue = 0;
+
+    // The radius of blur or the standard deviation of gaussian, unsharp and
+    // lumasharpen, in pixels, and the strength of the sharpening in percent
+    int radius = 0;
+    int amount = 0;
+
+    // The size resize goes to, or for scale the factor to multiply it by; for
+    // autolevels the factor is the percentage of pixels clipped at each end
+    int width = 0;
+    int height = 0;
+    double factor = 0.0;
+    ResizeFilter filter = FILTER_LANCZOS3;
+
+    // The CSV file histogram writes the counts to
+    std::string reportName;
+
+    // Lookup stages: a 256-entry table per channel in blue, green, red order,
+    // and the channel of the tracking image each one is looked up with. Round
+    // trips look the pixels up in their color space, with no table for none
+    std::vector<unsigned char> table;
+    int source[3] = { 0, 1, 2 };
+
+    // The color space converted to or from, or through by a round trip
+    ColorSpace space = SPACE_YCBCR;
+
+    // The compiled formula of expr, shared by the copies of the stage
+    std::shared_ptr<Expression> expression;
+};
+
+/**
+ * @return true for the methods that move pixels around instead of changing them:
+ *         flip, the vertical flip, mirror, the rotations and transpose
+ */
+bool isGeometric(Method method);
+
+/**
+ * @return true for the rotations and transpose, which swap width and height
+ */
+bool swapsAxes(Method method);
+
+/**
+ * @return true for the methods that read the pixels around each pixel: the
+ *         blurs, unsharp and lumasharpen (see convolve.h)
+ */
+bool isNeighborhood(Method method);
+
+/**
+ * @return true for the methods that work from the histogram of the image so
+ *         far: stats, histogram, autolevels and equalize
+ */
+bool usesHistogram(Method method);
+
+/**
+ * @return true for the methods that run as whole image passes instead of being
+ *         fused: the geometric, neighborhood and histogram methods and resize
+ */
+bool isPass(Method method);
+
+/**
+ * Carries out a stage that works from the histogram of the image so far: stats
+ * prints the numbers and histogram writes the counts to its file, exiting if it
+ * cannot, while autolevels and equalize compute their curve.
+ *
+ * @param lookup Set to a lookup stage that maps the image through the curve
+ * @return true if the stage changes the pixels, through lookup
+ */
+bool histogramStage(Stage const & stage, Histogram const & histogram, Stage & lookup);
+
+/**
+ * Changes width and height to the size of the image after the stage: swapped
+ * by the rotations and transposes, and set or scaled by resize.
+ */
+void stageSize(Stage const & stage, int & width, int & height);
+
+/**
+ * Where the pixels of a rotation or a transpose come from: pixel x of output
+ * row y is pixel base + x * columnStep + y * rowStep of the input (see
+ * operationTranspose). Rotating by 90 degrees turns the image clockwise, and
+ * transposing keeps the top left corner in place, as the image is shown
+ * according to the origin bit of its header.
+ *
+ * @param width The width of the input
+ * @param height The height of the input
+ * @param topFirst Whether the origin bit puts the first row at the top
+ */
+struct TransposeSteps
+{
+    ptrdiff_t base;
+    ptrdiff_t columnStep;
+    ptrdiff_t rowStep;
+};
+
+TransposeSteps transposeSteps(Method method, int width, int height, bool topFirst);
+
+/**
+ * @return A lookup table that maps every channel to itself
+ */
+std::vector<unsigned char> identityTable();
+
+/**
+ * Compiles every run of consecutive add, scale and only stages into a single
+ * lookup stage. They all map each channel through a function of one byte (only
+ * also picks the channel to read), so a run composes into one table per channel
+ * and costs one lookup per byte however long it is.
+ *
+ * A conversion to a color space, the lookup in between if any and the
+ * conversion back become a single round trip stage, which converts a few
+ * hundred pixels at a time on the stack instead of writing the converted pixels
+ * into the image.
+ *
+ * Vertical flips followed by nothing but stages that treat every pixel alike
+ * are moved to the end of the chain, where a pair cancels out and a single one
+ * is left for the runners to apply by turning over the origin bit of the
+ * header, without touching any pixel.
+ *
+ * @return The stages to run, with the same result as the given ones
+ */
+std::vector<Stage> compileStages(std::vector<Stage> const & stages);
+
+/**
+ * The kernel of a per-pixel stage for one pixel format, with the arguments of
+ * applyStage. Each is a template instance specialized for its method, and for
+ * add, scale, only and lookup for the channels they change (see kernels.h), so
+ * it runs without testing any of them per pixel.
+ */
+template <typename P>
+using StageKernel = void (*)(Stage const & stage, P * output, const P * tracking,
+                             const P * input, const P * input2, int count);
+
+/**
+ * Picks the kernel of a stage, once before running it over a whole pass. Whole
+ * image passes get one that does nothing.
+ */
+template <typename P>
+StageKernel<P> selectKernel(Stage const & stage);
+
+/**
+ * @return The kernel of every stage
+ */
+template <typename P>
+std::vector<StageKernel<P>> selectKernels(std::vector<Stage> const & stages);
+
+/**
+ * Runs one per-pixel stage over count pixels, picking its kernel first.
+ *
+ * @param output Where the result goes, may be the same range as tracking
+ * @param tracking The pixels of the image so far
+ * @param input The matching pixels of the input image, if the stage has one
+ * @param input2 The matching pixels of the second input image of combine
+ */
+void applyStage(Stage const & stage, Pixel * output, const Pixel * tracking,
+                const Pixel * input, const Pixel * input2, int count);
+
+/**
+ * The same for BGRA pixels. The result keeps the alpha of the tracking image,
+ * except for the compositing methods.
+ */
+void applyStage(Stage const & stage, PixelBGRA * output, const PixelBGRA * tracking,
+                const PixelBGRA * input, const PixelBGRA * input2, int count);
+
+/**
+ * @return The number of rows handed to a thread at a time, about 64K pixels
+ */
+int bandRows(int width);
+
+/**
+ * Applies the stages to the image in order.
+ *
+ * Consecutive per-pixel stages are fused: the image is processed in blocks small
+ * enough to stay in the L1 cache and every stage runs over a block before moving
+ * on to the next one, so a chain costs one pass over memory instead of one per
+ * stage. Flips and the other geometric methods reorder the whole image and run
+ * as passes of their own, in place except for the rotations and transpose,
+ * which write into a second buffer. A vertical flip at the end of the chain
+ * only flips the origin bit of the header (see compileStages). The blurs,
+ * unsharp and lumasharpen read around each pixel and run as passes of their
+ * own too, between the fused runs of the stages around them, and so does
+ * resize, which writes into a new buffer of its own size. The methods that work from the histogram
+ * count the whole image first, in one pass, and autolevels and equalize then map
+ * it through their curve in a second one.
+ * Every pass is split into bands of rows that run across the thread pool.
+ *
+ * The chain runs on BGRA pixels if the first image has alpha and on BGR pixels
+ * otherwise; the inputs must have the same number of channels (see setChannels).
+ *
+ * @param image The first image of the chain
+ * @param stages The methods to apply
+ * @param pool The threads to run on
+ * @return The resulting image, with the header of the first image and the
+ *         size after the last stage (see stageSize)
+ */
+TGA runPipeline(TGA image, std::vector<Stage> const & stages, ThreadPool & pool);
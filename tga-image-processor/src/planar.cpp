@@ -0,0 +1,613 @@
+#include "planar.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+#include "blend.h"
+#include "buffers.h"
+#include "convolve.h"
+#include "operations.h"
+
+using namespace std;
+
+// Bytes per plane in a block, about 4 KB of each plane of every image
+const int PLANE_BLOCK_SIZE = 4096;
+
+PlanarImage toPlanar(TGA const & tga, ThreadPool & pool, unsigned mask)
+{
+    PlanarImage image;
+    image.width = tga.width;
+    image.height = tga.height;
+
+    int count = image.numPixels();
+    const Pixel * pixels = tga.pixels();
+
+    for (int c = 0; c < 3; ++c) {
+        if (mask & (1u << c)) {
+            image.planes[c] = imageBuffers().acquire(count);
+        }
+    }
+
+    pool.parallelFor(count, 65536, [&](int begin, int end) {
+        const unsigned char * bytes = pixels[0].data;
+
+        // All three planes in one loop, which the compiler vectorizes with shuffles
+        if (mask == PLANE_ALL) {
+            unsigned char * blue = image.planes[0].data();
+            unsigned char * green = image.planes[1].data();
+            unsigned char * red = image.planes[2].data();
+
+            for (int i = begin; i < end; ++i) {
+                blue[i] = bytes[3 * i];
+                green[i] = bytes[3 * i + 1];
+                red[i] = bytes[3 * i + 2];
+            }
+            return;
+        }
+
+        for (int c = 0; c < 3; ++c) {
+            if (image.planes[c].empty()) {
+                continue;
+            }
+
+            unsigned char * plane = image.planes[c].data();
+
+            for (int i = begin; i < end; ++i) {
+                plane[i] = bytes[3 * i + c];
+            }
+        }
+    });
+
+    return image;
+}
+
+void releasePlanes(PlanarImage & image)
+{
+    for (int c = 0; c < 3; ++c) {
+        imageBuffers().release(image.planes[c]);
+    }
+}
+
+TGA fromPlanar(PlanarImage const & image, TGA header, ThreadPool & pool)
+{
+    TGA output = move(header);
+    output.width = (short)image.width;
+    output.height = (short)image.height;
+    Pixel * pixels = output.resetPixels();
+
+    const unsigned char * blue = image.planes[0].data();
+    const unsigned char * green = image.planes[1].data();
+    const unsigned char * red = image.planes[2].data();
+
+    pool.parallelFor(image.numPixels(), 65536, [&](int begin, int end) {
+        unsigned char * bytes = pixels[0].data;
+
+        for (int i = begin; i < end; ++i) {
+            bytes[3 * i] = blue[i];
+            bytes[3 * i + 1] = green[i];
+            bytes[3 * i + 2] = red[i];
+        }
+    });
+
+    return output;
+}
+
+// Blends count bytes of two planes, on the vector kernels when there are some
+static void blendPlane(BlendMode mode, unsigned char * output,
+                       const unsigned char * lhs, const unsigned char * rhs, int count)
+{
+    if (blendBytes(mode, output, lhs, rhs, count)) {
+        return;
+    }
+
+    // The reference operations are per byte too, run them on whole pixels and
+    // finish the last few bytes through a padded pixel
+    void (*reference)(Pixel *, const Pixel *, const Pixel *, int) =
+        mode == BLEND_MULTIPLY ? operationMultiplyReference<Pixel> :
+        mode == BLEND_SCREEN ? operationScreenReference<Pixel> : operationOverlayReference<Pixel>;
+
+    int whole = count / 3;
+    reference((Pixel*)output, (const Pixel*)lhs, (const Pixel*)rhs, whole);
+
+    int done = whole * 3;
+
+    if (done < count) {
+        Pixel a = {{0, 0, 0}};
+        Pixel b = {{0, 0, 0}};
+        Pixel r;
+
+        memcpy(a.data, lhs + done, count - done);
+        memcpy(b.data, rhs + done, count - done);
+        reference(&r, &a, &b, 1);
+        memcpy(output + done, r.data, count - done);
+    }
+}
+
+static void subtractPlane(unsigned char * output, const unsigned char * lhs,
+                          const unsigned char * rhs, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int r = lhs[i] - rhs[i];
+        output[i] = (unsigned char)(r < 0 ? 0 : r);
+    }
+}
+
+static void addPlane(unsigned char * plane, int value, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        plane[i] = (unsigned char)clamp(plane[i] + value);
+    }
+}
+
+static void scalePlane(unsigned char * plane, int value, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        plane[i] = (unsigned char)clamp(plane[i] * value);
+    }
+}
+
+static bool isIdentity(const unsigned char * table)
+{
+    for (int v = 0; v < 256; ++v) {
+        if (table[v] != v) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Maps count bytes of each plane through its table, in place. Planes that keep
+// their own values are skipped, and planes read by another plane's lookup are
+// saved first. count is at most PLANE_BLOCK_SIZE.
+static void lookupPlanes(Stage const & stage, unsigned char * planes[3], int count)
+{
+    unsigned char saved[3][PLANE_BLOCK_SIZE];
+    const unsigned char * sources[3];
+
+    for (int c = 0; c < 3; ++c) {
+        sources[c] = planes[c];
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        int source = stage.source[c];
+
+        if (source != c && sources[source] == planes[source]) {
+            memcpy(saved[source], planes[source], count);
+            sources[source] = saved[source];
+        }
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        const unsigned char * table = stage.table.data() + 256 * c;
+        const unsigned char * source = sources[stage.source[c]];
+
+        if (stage.source[c] == c && isIdentity(table)) {
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            planes[c][i] = table[source[i]];
+        }
+    }
+}
+
+// Interleaves count pixels of three planes into a block of pixels
+static void interleave(Pixel * pixels, const unsigned char * const planes[3], int count)
+{
+    for (int i = 0; i < count; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            pixels[i].data[c] = planes[c][i];
+        }
+    }
+}
+
+// Runs a stage that mixes the channels of every pixel over count pixels of the
+// planes, interleaving them and the planes of its input if any into blocks of
+// pixels and back. count is at most PLANE_BLOCK_SIZE.
+static void applyInterleaved(Stage const & stage, unsigned char * planes[3],
+                             const unsigned char * inputs[3], int count)
+{
+    Pixel pixels[PLANE_BLOCK_SIZE];
+    Pixel inputPixels[PLANE_BLOCK_SIZE];
+    const Pixel * input = nullptr;
+
+    // Returning on an empty block also shows the compiler that the blocks are
+    // filled before the stage reads them
+    if (count <= 0) {
+        return;
+    }
+
+    interleave(pixels, planes, count);
+
+    if (inputs[0]) {
+        interleave(inputPixels, inputs, count);
+        input = inputPixels;
+    }
+
+    applyStage(stage, pixels, pixels, input, nullptr, count);
+
+    for (int i = 0; i < count; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            planes[c][i] = pixels[i].data[c];
+        }
+    }
+}
+
+// Runs one per-pixel stage over count pixels of every plane, in place
+static void applyPlanarStage(Stage const & stage, PlanarImage & tracking,
+                             PlanarImage const & input, int offset, int count)
+{
+    unsigned char * planes[3];
+    const unsigned char * inputs[3] = { nullptr, nullptr, nullptr };
+
+    for (int c = 0; c < 3; ++c) {
+        planes[c] = tracking.planes[c].data() + offset;
+
+        if (!input.planes[c].empty()) {
+            inputs[c] = input.planes[c].data() + offset;
+        }
+    }
+
+    // Per channel arguments in plane order
+    int value[3] = {
+        stage.blue, stage.green, stage.red
+    };
+
+    switch (stage.method) {
+    case METHOD_MULTIPLY:
+        for (int c = 0; c < 3; ++c) {
+            blendPlane(BLEND_MULTIPLY, planes[c], planes[c], inputs[c], count);
+        }
+        break;
+    case METHOD_SCREEN:
+        for (int c = 0; c < 3; ++c) {
+            blendPlane(BLEND_SCREEN, planes[c], inputs[c], planes[c], count);
+        }
+        break;
+    case METHOD_OVERLAY:
+        for (int c = 0; c < 3; ++c) {
+            blendPlane(BLEND_OVERLAY, planes[c], planes[c], inputs[c], count);
+        }
+        break;
+    case METHOD_SUBTRACT:
+        for (int c = 0; c < 3; ++c) {
+            subtractPlane(planes[c], planes[c], inputs[c], count);
+        }
+        break;
+    case METHOD_ONLY:
+        // Copy the chosen plane over the other two
+        for (int c = 0; c < 3; ++c) {
+            if (value[c]) {
+                for (int other = 0; other < 3; ++other) {
+                    if (other != c) {
+                        memcpy(planes[other], planes[c], count);
+                    }
+                }
+                break;
+            }
+        }
+        break;
+    case METHOD_ADD:
+        for (int c = 0; c < 3; ++c) {
+            if (value[c] != 0) {
+                addPlane(planes[c], value[c], count);
+            }
+        }
+        break;
+    case METHOD_SCALE:
+        for (int c = 0; c < 3; ++c) {
+            if (value[c] != 1) {
+                scalePlane(planes[c], value[c], count);
+            }
+        }
+        break;
+    case METHOD_LOOKUP:
+        lookupPlanes(stage, planes, count);
+        break;
+    case METHOD_GRAYSCALE:
+    case METHOD_TO_SPACE:
+    case METHOD_FROM_SPACE:
+    case METHOD_ROUND_TRIP:
+    case METHOD_EXPRESSION:
+        applyInterleaved(stage, planes, inputs, count);
+        break;
+    case METHOD_COMBINE:
+    case METHOD_FLIP:
+    case METHOD_FLIP_VERTICAL:
+    case METHOD_MIRROR:
+    case METHOD_ROTATE90:
+    case METHOD_ROTATE270:
+    case METHOD_TRANSPOSE:
+    case METHOD_BLUR:
+    case METHOD_GAUSSIAN:
+    case METHOD_UNSHARP:
+    case METHOD_LUMA_SHARPEN:
+    case METHOD_RESIZE:
+    case METHOD_STATS:
+    case METHOD_HISTOGRAM:
+    case METHOD_AUTOLEVELS:
+    case METHOD_EQUALIZE:
+        break;
+    case METHOD_OVER:
+    case METHOD_OVER_PREMULTIPLIED:
+    case METHOD_PREMULTIPLY:
+    case METHOD_UNPREMULTIPLY:
+        // The planes have no alpha, and opaque pixels are left as they are
+        break;
+    }
+}
+
+static void flipPlanes(PlanarImage & image, ThreadPool & pool)
+{
+    int count = image.numPixels();
+
+    pool.parallelFor(count / 2, 65536, [&](int begin, int end) {
+        for (int c = 0; c < 3; ++c) {
+            unsigned char * plane = image.planes[c].data();
+            swap_ranges(plane + begin, plane + end, reverse_iterator<unsigned char*>(plane + (count - begin)));
+        }
+    });
+}
+
+// Runs a geometric stage other than flip over every plane
+static void moveInPlanes(Method method, PlanarImage & image, TGA const & header, ThreadPool & pool)
+{
+    int width = image.width;
+    int height = image.height;
+
+    if (method == METHOD_FLIP_VERTICAL) {
+        pool.parallelFor(height / 2, bandRows(width), [&](int begin, int end) {
+            for (int c = 0; c < 3; ++c) {
+                unsigned char * plane = image.planes[c].data();
+
+                for (int y = begin; y < end; ++y) {
+                    unsigned char * row = plane + (size_t)y * width;
+                    swap_ranges(row, row + width, plane + (size_t)(height - 1 - y) * width);
+                }
+            }
+        });
+        return;
+    }
+
+    if (method == METHOD_MIRROR) {
+        pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+            for (int c = 0; c < 3; ++c) {
+                unsigned char * plane = image.planes[c].data();
+
+                for (int y = begin; y < end; ++y) {
+                    reverse(plane + (size_t)y * width, plane + (size_t)(y + 1) * width);
+                }
+            }
+        });
+        return;
+    }
+
+    // Rotations and transposes write each plane into a new one
+    TransposeSteps steps = transposeSteps(method, width, height, header.imageDescriptor & 0x20);
+    int grain = (bandRows(height) + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE * TRANSPOSE_TILE;
+
+    for (int c = 0; c < 3; ++c) {
+        vector<unsigned char> plane = imageBuffers().acquire(image.planes[c].size());
+        unsigned char * output = plane.data();
+        const unsigned char * source = image.planes[c].data();
+
+        pool.parallelFor(width, grain, [&](int begin, int end) {
+            operationTranspose(output + (size_t)begin * height, height,
+                               source + steps.base + begin * steps.rowStep, steps.columnStep, steps.rowStep,
+                               height, end - begin);
+        });
+
+        image.planes[c].swap(plane);
+        imageBuffers().release(plane);
+    }
+
+    image.width = height;
+    image.height = width;
+}
+
+// Runs a blur or sharpening stage over the planes, in place
+static void filterPlanes(Stage const & stage, PlanarImage & image, ThreadPool & pool)
+{
+    // Luma sharpening reads all three planes at once
+    if (stage.method == METHOD_LUMA_SHARPEN) {
+        unsigned char * planes[3] = { image.planes[0].data(), image.planes[1].data(), image.planes[2].data() };
+
+        lumaSharpenPlanes(planes, image.width, image.height, stage.radius, stage.amount, pool);
+        return;
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        unsigned char * plane = image.planes[c].data();
+
+        if (stage.method == METHOD_BLUR) {
+            boxBlur(plane, plane, image.width, image.height, 1, stage.radius, pool);
+        }
+        else if (stage.method == METHOD_GAUSSIAN) {
+            gaussianBlur(plane, plane, image.width, image.height, 1, stage.radius, pool);
+        }
+        else {
+            unsharpMask(plane, plane, image.width, image.height, 1, stage.radius, stage.amount, pool);
+        }
+    }
+}
+
+// Resamples every plane into a new one
+static void resizePlanes(Stage const & stage, PlanarImage & image, ThreadPool & pool)
+{
+    int width = image.width;
+    int height = image.height;
+
+    stageSize(stage, width, height);
+
+    for (int c = 0; c < 3; ++c) {
+        vector<unsigned char> plane = imageBuffers().acquire((size_t)width * height);
+
+        resizeImage(plane.data(), width, height, image.planes[c].data(), image.width, image.height, 1,
+                    stage.filter, pool);
+
+        image.planes[c].swap(plane);
+        imageBuffers().release(plane);
+    }
+
+    image.width = width;
+    image.height = height;
+}
+
+// Counts every plane for a stage that works from the histogram, and maps the
+// planes through the curve of autolevels and equalize, in place
+static void histogramPlanes(Stage const & stage, PlanarImage & image, ThreadPool & pool)
+{
+    Histogram histogram;
+    histogram.channels = 3;
+    histogram.pixels = image.numPixels();
+
+    for (int c = 0; c < 3; ++c) {
+        Histogram plane = computeHistogram(image.planes[c].data(), histogram.pixels, 1, pool);
+        copy(plane.counts[0], plane.counts[0] + 256, histogram.counts[c]);
+    }
+
+    Stage lookup;
+
+    if (!histogramStage(stage, histogram, lookup)) {
+        return;
+    }
+
+    int width = image.width;
+
+    pool.parallelFor(image.height, bandRows(width), [&](int beginRow, int endRow) {
+        int end = endRow * width;
+
+        for (int offset = beginRow * width; offset < end; offset += PLANE_BLOCK_SIZE) {
+            unsigned char * planes[3];
+
+            for (int c = 0; c < 3; ++c) {
+                planes[c] = image.planes[c].data() + offset;
+            }
+
+            lookupPlanes(lookup, planes, min(PLANE_BLOCK_SIZE, end - offset));
+        }
+    });
+}
+
+TGA runPlanarPipeline(TGA image, vector<Stage> const & stages, ThreadPool & pool)
+{
+    // Packed BGRA pixels already fill the vector lanes
+    if (image.channels() == 4) {
+        return runPipeline(move(image), stages, pool);
+    }
+
+    PlanarImage tracking = toPlanar(image, pool);
+
+    // Only the planes a stage reads are converted; combine only needs the green
+    // plane of its first input and the blue plane of its second
+    vector<PlanarImage> inputs(stages.size());
+    vector<PlanarImage> inputs2(stages.size());
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        Method method = stages[i].method;
+
+        if (method == METHOD_COMBINE) {
+            inputs[i] = toPlanar(stages[i].input, pool, PLANE_GREEN);
+            inputs2[i] = toPlanar(stages[i].input2, pool, PLANE_BLUE);
+        }
+        else if (method == METHOD_MULTIPLY || method == METHOD_SCREEN ||
+                 method == METHOD_OVERLAY || method == METHOD_SUBTRACT ||
+                 (method == METHOD_EXPRESSION && !stages[i].inputName.empty())) {
+            inputs[i] = toPlanar(stages[i].input, pool);
+        }
+    }
+
+    // A vertical flip left at the end only turns the image over in its header
+    size_t end = stages.size();
+    bool flipOrigin = end > 0 && stages[end - 1].method == METHOD_FLIP_VERTICAL;
+
+    if (flipOrigin) {
+        end--;
+    }
+
+    size_t first = 0;
+
+    while (first < end) {
+
+        Method method = stages[first].method;
+
+        if (method == METHOD_FLIP) {
+            flipPlanes(tracking, pool);
+            first++;
+            continue;
+        }
+
+        if (isGeometric(method)) {
+            moveInPlanes(method, tracking, image, pool);
+            first++;
+            continue;
+        }
+
+        if (isNeighborhood(method)) {
+            filterPlanes(stages[first], tracking, pool);
+            first++;
+            continue;
+        }
+
+        if (method == METHOD_RESIZE) {
+            resizePlanes(stages[first], tracking, pool);
+            first++;
+            continue;
+        }
+
+        if (usesHistogram(method)) {
+            histogramPlanes(stages[first], tracking, pool);
+            first++;
+            continue;
+        }
+
+        if (method == METHOD_COMBINE) {
+            // Red stays, green and blue come from the inputs
+            swap(tracking.planes[1], inputs[first].planes[1]);
+            swap(tracking.planes[0], inputs2[first].planes[0]);
+            first++;
+            continue;
+        }
+
+        size_t last = first;
+        while (last < end && !isGeometric(stages[last].method) && !isNeighborhood(stages[last].method) &&
+               stages[last].method != METHOD_COMBINE && stages[last].method != METHOD_RESIZE &&
+               !usesHistogram(stages[last].method)) {
+            last++;
+        }
+
+        int width = tracking.width;
+
+        pool.parallelFor(tracking.height, bandRows(width), [&](int beginRow, int endRow) {
+            int end = endRow * width;
+
+            for (int offset = beginRow * width; offset < end; offset += PLANE_BLOCK_SIZE) {
+                int block = min(PLANE_BLOCK_SIZE, end - offset);
+
+                for (size_t i = first; i < last; ++i) {
+                    applyPlanarStage(stages[i], tracking, inputs[i], offset, block);
+                }
+            }
+        });
+
+        first = last;
+    }
+
+    // The pixels of the image are interleaved again in its own buffer if it has one
+    TGA output = fromPlanar(tracking, move(image), pool);
+
+    if (flipOrigin) {
+        output.imageDescriptor ^= 0x20;
+    }
+
+    releasePlanes(tracking);
+    for (size_t i = 0; i < stages.size(); ++i) {
+        releasePlanes(inputs[i]);
+        releasePlanes(inputs2[i]);
+    }
+
+    return output;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file planar.h
+ * Planar image layout, with one plane per channel instead of packed BGR pixels
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "tga.h"
+#include "pipeline.h"
+#include "threadpool.h"
+
+// Channels to convert, as bits of a mask in blue, green, red order
+const unsigned PLANE_BLUE = 1;
+const unsigned PLANE_GREEN = 2;
+const unsigned PLANE_RED = 4;
+const unsigned PLANE_ALL = 7;
+
+struct PlanarImage
+{
+    int width = 0;
+    int height = 0;
+
+    // One plane per channel, in blue, green, red order like the Pixel struct
+    std::vector<unsigned char> planes[3];
+
+    int numPixels() const { return width * height; }
+};
+
+/**
+ * Splits the packed pixels of an image into planes.
+ *
+ * @param tga The image to convert
+ * @param pool The threads to run on
+ * @param mask The channels to convert, the other planes are left empty
+ * @return The planes, taken from the buffer pool (see imageBuffers)
+ */
+PlanarImage toPlanar(TGA const & tga, ThreadPool & pool, unsigned mask = PLANE_ALL);
+
+/**
+ * Hands the planes back to the buffer pool (see imageBuffers), leaving them empty.
+ */
+void releasePlanes(PlanarImage & image);
+
+/**
+ * Interleaves the planes back into packed BGR pixels.
+ *
+ * @param image The planes to convert
+ * @param header An image with the header to give to the output; the pixels
+ *               are written over its own pixels if it has any
+ * @param pool The threads to run on
+ */
+TGA fromPlanar(PlanarImage const & image, TGA header, ThreadPool & pool);
+
+/**
+ * Applies the stages like runPipeline, on planes instead of packed pixels.
+ *
+ * The image and the inputs are converted to planes when the run starts and the
+ * result is converted back at the end. In between, operations on one channel
+ * only touch its plane (adding to or scaling red leaves the blue and green
+ * planes alone), combine swaps planes instead of copying pixels, flips,
+ * rotations and the other geometric methods move each plane on its own, the
+ * blurs and resize filter each plane on its own, and
+ * every other per-pixel stage is fused over bands of rows as in runPipeline.
+ *
+ * Images with alpha run through runPipeline instead, as packed BGRA pixels
+ * already fill whole vector lanes.
+ */
+TGA runPlanarPipeline(TGA image, std::vector<Stage> const & stages, ThreadPool & pool);
@@ -0,0 +1,358 @@
+#include "resize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "buffers.h"
+#include "pipeline.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define RESIZE_X86 1
+#endif
+
+using namespace std;
+
+// Filter weights are fixed point, with 1 << WEIGHT_BITS standing for 1
+const int WEIGHT_BITS = 14;
+
+// The input pixels every output pixel along one axis is made of
+struct Taps
+{
+    // Weights per output pixel, the largest count
+    int size = 0;
+
+    // The first input pixel and the number of them, per output pixel
+    vector<int> first;
+    vector<int> count;
+
+    // size weights per output pixel
+    vector<int> weights;
+};
+
+bool parseResizeFilter(const char * name, ResizeFilter & filter)
+{
+    if (!strcmp(name, "nearest")) {
+        filter = FILTER_NEAREST;
+    }
+    else if (!strcmp(name, "bilinear")) {
+        filter = FILTER_BILINEAR;
+    }
+    else if (!strcmp(name, "bicubic")) {
+        filter = FILTER_BICUBIC;
+    }
+    else if (!strcmp(name, "lanczos3")) {
+        filter = FILTER_LANCZOS3;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+// How far from its center the filter reaches, in input pixels before any widening
+static double filterSupport(ResizeFilter filter)
+{
+    switch (filter) {
+    case FILTER_BILINEAR:
+        return 1.0;
+    case FILTER_BICUBIC:
+        return 2.0;
+    case FILTER_LANCZOS3:
+        return 3.0;
+    case FILTER_NEAREST:
+        break;
+    }
+
+    return 0.5;
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0) {
+        return 1.0;
+    }
+
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filterWeight(ResizeFilter filter, double x)
+{
+    x = fabs(x);
+
+    switch (filter) {
+    case FILTER_BILINEAR:
+        return max(0.0, 1.0 - x);
+    case FILTER_BICUBIC:
+        // Keys' cubic with a = -0.5, as most tools use
+        if (x < 1.0) {
+            return (1.5 * x - 2.5) * x * x + 1.0;
+        }
+        if (x < 2.0) {
+            return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+        }
+        return 0.0;
+    case FILTER_LANCZOS3:
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    case FILTER_NEAREST:
+        break;
+    }
+
+    return x < 0.5 ? 1.0 : 0.0;
+}
+
+static Taps computeTaps(int inputSize, int outputSize, ResizeFilter filter)
+{
+    double scale = (double)inputSize / outputSize;
+
+    // Shrinking widens the filter, so that every input pixel is covered
+    double stretch = filter == FILTER_NEAREST ? 1.0 : max(scale, 1.0);
+    double support = filterSupport(filter) * stretch;
+
+    Taps taps;
+    taps.size = min(inputSize, 2 * (int)ceil(support) + 1);
+    taps.first.resize(outputSize);
+    taps.count.resize(outputSize);
+    taps.weights.assign((size_t)outputSize * taps.size, 0);
+
+    vector<double> weights(taps.size);
+    vector<int> order;
+
+    for (int i = 0; i < outputSize; ++i) {
+        // Pixel j of the input is centered on j + 0.5
+        double center = (i + 0.5) * scale;
+        int first = 0;
+        int count = 1;
+
+        if (filter == FILTER_NEAREST) {
+            first = min((int)center, inputSize - 1);
+            weights[0] = 1.0;
+        }
+        else {
+            int begin = (int)floor(center - support);
+            int end = (int)ceil(center + support);
+
+            first = max(begin, 0);
+            count = min(min(end, inputSize) - first, taps.size);
+
+            fill(weights.begin(), weights.end(), 0.0);
+
+            // Pixels past the edges repeat the edge pixels
+            for (int j = begin; j < end; ++j) {
+                int k = min(max(j, first), first + count - 1) - first;
+                weights[k] += filterWeight(filter, (j + 0.5 - center) / stretch);
+            }
+        }
+
+        double total = 0.0;
+        for (int k = 0; k < count; ++k) {
+            total += weights[k];
+        }
+
+        // Normalized and rounded down, then the units left over go one each
+        // to the weights that lost the most. When shrinking a lot every weight
+        // is below one unit, and they still add up to an even spread instead of
+        // one tap taking them all.
+        int * fixed = taps.weights.data() + (size_t)i * taps.size;
+        int sum = 0;
+
+        for (int k = 0; k < count; ++k) {
+            double exact = weights[k] / total * (1 << WEIGHT_BITS);
+
+            fixed[k] = (int)floor(exact);
+            weights[k] = exact - fixed[k];
+            sum += fixed[k];
+        }
+
+        int left = min(max((1 << WEIGHT_BITS) - sum, 0), count);
+
+        order.resize(count);
+        for (int k = 0; k < count; ++k) {
+            order[k] = k;
+        }
+
+        nth_element(order.begin(), order.begin() + left, order.end(), [&](int a, int b) {
+            return weights[a] > weights[b];
+        });
+
+        for (int k = 0; k < left; ++k) {
+            fixed[order[k]]++;
+        }
+
+        taps.first[i] = first;
+        taps.count[i] = count;
+    }
+
+    return taps;
+}
+
+static inline unsigned char fromFixed(int sum)
+{
+    sum = (sum + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+    return (unsigned char)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+}
+
+#ifdef RESIZE_X86
+
+// The channels of a pixel in the low bytes, without reading past it
+template <int channels>
+static inline int loadPixel(const unsigned char * pixel)
+{
+    if (channels == 4) {
+        int value;
+        memcpy(&value, pixel, 4);
+        return value;
+    }
+
+    int value = pixel[0];
+    for (int c = 1; c < channels; ++c) {
+        value |= pixel[c] << (8 * c);
+    }
+    return value;
+}
+
+// Resamples a row across as resizeRow does, with the channels of a pixel in
+// the lanes of one register and two taps at a time: their channels are
+// interleaved as 16-bit values and multiplied by the pair of weights, which
+// fit 16 bits, with madd. Rounds and clamps like fromFixed.
+template <int channels>
+static void resizeRowSSE2(unsigned char * output, const unsigned char * input, Taps const & taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+    int outputSize = (int)taps.first.size();
+
+    for (int x = 0; x < outputSize; ++x) {
+        const unsigned char * pixel = input + (size_t)taps.first[x] * channels;
+        const int * weights = taps.weights.data() + (size_t)x * taps.size;
+        int count = taps.count[x];
+        __m128i sums = zero;
+        int k = 0;
+
+        for (; k + 1 < count; k += 2) {
+            __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(loadPixel<channels>(pixel)), zero);
+            __m128i b = _mm_unpacklo_epi8(_mm_cvtsi32_si128(loadPixel<channels>(pixel + channels)), zero);
+            __m128i pair = _mm_set1_epi32((int)(((unsigned)weights[k + 1] << 16) | (weights[k] & 0xFFFF)));
+
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+            pixel += 2 * channels;
+        }
+
+        if (k < count) {
+            __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(loadPixel<channels>(pixel)), zero);
+
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), _mm_set1_epi32(weights[k] & 0xFFFF)));
+        }
+
+        __m128i result = _mm_srai_epi32(_mm_add_epi32(sums, half), WEIGHT_BITS);
+        result = _mm_packus_epi16(_mm_packs_epi32(result, zero), zero);
+
+        int bytes = _mm_cvtsi128_si32(result);
+        memcpy(output + (size_t)x * channels, &bytes, channels);
+    }
+}
+
+#endif
+
+// Resamples a row across, channels bytes per pixel
+static void resizeRow(unsigned char * output, const unsigned char * input, int channels, Taps const & taps)
+{
+    int outputSize = (int)taps.first.size();
+
+    for (int x = 0; x < outputSize; ++x) {
+        const unsigned char * pixel = input + (size_t)taps.first[x] * channels;
+        const int * weights = taps.weights.data() + (size_t)x * taps.size;
+        int count = taps.count[x];
+        int sums[4] = { 0, 0, 0, 0 };
+
+        for (int k = 0; k < count; ++k) {
+            for (int c = 0; c < channels; ++c) {
+                sums[c] += weights[k] * pixel[c];
+            }
+            pixel += channels;
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            output[x * channels + c] = fromFixed(sums[c]);
+        }
+    }
+}
+
+// Resamples the output rows [begin, end) down, a whole row of bytes at a time
+static void resizeRows(unsigned char * output, const unsigned char * input, size_t rowBytes,
+                       Taps const & taps, int begin, int end)
+{
+    vector<int> sums(rowBytes);
+    int * sum = sums.data();
+
+    for (int y = begin; y < end; ++y) {
+        const int * weights = taps.weights.data() + (size_t)y * taps.size;
+        const unsigned char * row = input + (size_t)taps.first[y] * rowBytes;
+
+        fill(sums.begin(), sums.end(), 0);
+
+        for (int k = 0; k < taps.count[y]; ++k) {
+            int weight = weights[k];
+
+            for (size_t i = 0; i < rowBytes; ++i) {
+                sum[i] += weight * row[i];
+            }
+            row += rowBytes;
+        }
+
+        unsigned char * result = output + (size_t)y * rowBytes;
+
+        for (size_t i = 0; i < rowBytes; ++i) {
+            result[i] = fromFixed(sum[i]);
+        }
+    }
+}
+
+void resizeImage(unsigned char * output, int outputWidth, int outputHeight,
+                 const unsigned char * input, int width, int height, int channels,
+                 ResizeFilter filter, ThreadPool & pool)
+{
+    Taps across = computeTaps(width, outputWidth, filter);
+    Taps down = computeTaps(height, outputHeight, filter);
+
+    size_t inputRowBytes = (size_t)width * channels;
+    size_t rowBytes = (size_t)outputWidth * channels;
+
+    // Every input row resampled across, then the rows resampled down
+    vector<unsigned char> scratch = imageBuffers().acquire(rowBytes * height);
+    unsigned char * rows = scratch.data();
+
+    pool.parallelFor(height, bandRows(width), [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            unsigned char * row = rows + y * rowBytes;
+            const unsigned char * inputRow = input + y * inputRowBytes;
+
+#ifdef RESIZE_X86
+            if (channels == 4) {
+                resizeRowSSE2<4>(row, inputRow, across);
+                continue;
+            }
+            if (channels == 3) {
+                resizeRowSSE2<3>(row, inputRow, across);
+                continue;
+            }
+            if (channels == 1) {
+                resizeRowSSE2<1>(row, inputRow, across);
+                continue;
+            }
+#endif
+
+            resizeRow(row, inputRow, channels, across);
+        }
+    });
+
+    pool.parallelFor(outputHeight, bandRows(outputWidth), [&](int begin, int end) {
+        resizeRows(output, rows, rowBytes, down, begin, end);
+    });
+
+    imageBuffers().release(scratch);
+}
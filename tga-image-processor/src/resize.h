@@ -0,0 +1,41 @@
+/**
+ * @file resize.h
+ * Resampling of images to another size with separable filters
+ */
+
+#pragma once
+
+#include "threadpool.h"
+
+enum ResizeFilter
+{
+    FILTER_NEAREST,
+    FILTER_BILINEAR,
+    FILTER_BICUBIC,
+    FILTER_LANCZOS3
+};
+
+/**
+ * @param name nearest, bilinear, bicubic or lanczos3
+ * @param filter Set to the filter of that name
+ * @return false if there is no such filter
+ */
+bool parseResizeFilter(const char * name, ResizeFilter & filter);
+
+/**
+ * Resamples a width x height image of interleaved bytes, channels of them per
+ * pixel, to outputWidth x outputHeight. Every channel is resampled on its own,
+ * alpha included, and pixels past the edges count as copies of the edge pixels.
+ *
+ * The filter weights of every output column and row are computed once, in
+ * fixed point, and widened by the scale factor when shrinking so that every
+ * input pixel contributes. A horizontal pass over each input row writes into a
+ * scratch buffer, and a vertical pass sums whole rows of it at a time, which
+ * the compiler vectorizes. Both passes are split across the thread pool by
+ * bands of rows.
+ *
+ * @param output outputWidth x outputHeight pixels, not overlapping the input
+ */
+void resizeImage(unsigned char * output, int outputWidth, int outputHeight,
+                 const unsigned char * input, int width, int height, int channels,
+                 ResizeFilter filter, ThreadPool & pool);
@@ -0,0 +1,485 @@
+#include "server.h"
+
+#include <iostream>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "buffers.h"
+#include "codec.h"
+#include "job.h"
+#include "mosaic.h"
+
+using namespace std;
+
+// Compiled jobs kept between requests, by working directory and arguments
+const size_t JOB_CACHE_SIZE = 64;
+
+// The most strings a request can have
+const size_t MAX_REQUEST_STRINGS = 65536;
+
+// How long a client has to send its whole request before it is dropped, so
+// that one that connects and stalls does not hold up the others
+const int REQUEST_TIMEOUT_MS = 5000;
+
+// The socket and the worker of the server, for its signal handler
+static char listeningPath[sizeof(((sockaddr_un*)nullptr)->sun_path)];
+static volatile pid_t workerPid = 0;
+
+static void stopServer(int)
+{
+    if (workerPid > 0) {
+        kill(workerPid, SIGTERM);
+    }
+
+    unlink(listeningPath);
+    _exit(0);
+}
+
+// Writes size bytes, resuming after partial writes
+static bool writeAll(int fd, const char * data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static int listenOn(string const & socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cout << "Error: Socket path too long: " << socketPath << endl;
+        exit(1);
+    }
+
+    strcpy(address.sun_path, socketPath.c_str());
+
+    // Anything but a socket is left alone
+    struct stat existing;
+
+    if (lstat(socketPath.c_str(), &existing) == 0 && !S_ISSOCK(existing.st_mode)) {
+        cout << "Error: Not a socket: " << socketPath << endl;
+        exit(1);
+    }
+
+    // A socket file that nobody answers on is left over from a server that
+    // stopped, and is replaced
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (probe >= 0 && connect(probe, (sockaddr*)&address, sizeof(address)) == 0) {
+        close(probe);
+        cout << "Error: A server already listens on " << socketPath << endl;
+        exit(1);
+    }
+
+    if (probe >= 0) {
+        close(probe);
+    }
+
+    unlink(socketPath.c_str());
+
+    // Created for the user only, with no moment where others could connect
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0177);
+    bool bound = fd >= 0 && bind(fd, (sockaddr*)&address, sizeof(address)) == 0;
+
+    umask(mask);
+
+    if (!bound || chmod(socketPath.c_str(), 0600) != 0 || listen(fd, 64) != 0) {
+        cout << "Error: Cannot listen on socket: " << socketPath << endl;
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Milliseconds on a clock that only moves forward
+static long long monotonicMilliseconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Reads a request: the number of strings on a line, then the strings, each
+// ending with a zero byte. Gives up on a request that is not complete within
+// REQUEST_TIMEOUT_MS.
+static bool readRequest(int fd, vector<string> & strings)
+{
+    string data;
+    char chunk[4096];
+    size_t expected = 0;
+    bool counted = false;
+    long long deadline = monotonicMilliseconds() + REQUEST_TIMEOUT_MS;
+
+    for (;;) {
+        if (!counted) {
+            size_t newline = data.find('\n');
+
+            if (newline != string::npos) {
+                expected = strtoul(data.c_str(), nullptr, 10);
+                data.erase(0, newline + 1);
+                counted = true;
+
+                if (expected == 0 || expected > MAX_REQUEST_STRINGS) {
+                    return false;
+                }
+            }
+        }
+
+        if (counted) {
+            size_t end;
+
+            while (strings.size() < expected && (end = data.find('\0')) != string::npos) {
+                strings.push_back(data.substr(0, end));
+                data.erase(0, end + 1);
+            }
+
+            if (strings.size() == expected) {
+                return true;
+            }
+        }
+
+        long long remaining = deadline - monotonicMilliseconds();
+        pollfd ready = { fd, POLLIN, 0 };
+
+        if (remaining <= 0) {
+            return false;
+        }
+
+        int polled = poll(&ready, 1, (int)remaining);
+
+        if (polled < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (polled <= 0) {
+            return false;
+        }
+
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            return false;
+        }
+
+        data.append(chunk, count);
+    }
+}
+
+// The path of a file named relative to the given directory
+static string absolutePath(string const & directory, string const & filename)
+{
+    return filename.empty() || filename[0] == '/' ? filename : directory + "/" + filename;
+}
+
+// Leaves the image in a new shared memory object as a TGA file, and returns
+// the status line naming it
+static string writeShared(TGA const & image, bool rle, unsigned sequence)
+{
+    const unsigned char * pixels = image.bytes();
+    size_t size = image.dataSize();
+    vector<unsigned char> packets;
+
+    if (rle) {
+        encodeRLE(pixels, image.channels(), image.width, image.height, packets);
+
+        pixels = packets.data();
+        size = packets.size();
+    }
+
+    unsigned char header[TGA_HEADER_SIZE];
+    encodeTGAHeader(image, header);
+    header[2] = rle ? TGA_RLE_TRUE_COLOR : TGA_TRUE_COLOR;
+
+    string name = "/project2-" + to_string(getpid()) + "-" + to_string(sequence);
+    size_t total = TGA_HEADER_SIZE + size;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    void * memory = MAP_FAILED;
+
+    if (fd >= 0 && ftruncate(fd, total) == 0) {
+        memory = mmap(nullptr, total, PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (memory == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        cerr << "Error: Cannot create shared memory for the output" << endl;
+        exit(1);
+    }
+
+    memcpy(memory, header, TGA_HEADER_SIZE);
+    memcpy((unsigned char*)memory + TGA_HEADER_SIZE, pixels, size);
+    munmap(memory, total);
+
+    return "shm " + name + " " + to_string(total);
+}
+
+// Runs one request and returns the status line for the client; exits on the
+// errors that exit on the command line
+static string runRequest(vector<string> const & request, ThreadPool & pool, ImageCache & cache,
+                         map<string, Job> & jobs, size_t cacheSize, unsigned sequence)
+{
+    string const & directory = request[0];
+
+    if (chdir(directory.c_str()) != 0) {
+        cout << "Error: Cannot change to directory: " << directory << endl;
+        exit(1);
+    }
+
+    bool planar = false;
+    bool rle = false;
+    size_t argIndex = 1;
+
+    while (argIndex < request.size() && request[argIndex].compare(0, 2, "--") == 0) {
+        if (request[argIndex] == "--planar") {
+            planar = true;
+        }
+        else if (request[argIndex] == "--rle") {
+            rle = true;
+        }
+        else {
+            cout << "Invalid option, the server only takes --planar and --rle." << endl;
+            exit(1);
+        }
+
+        argIndex++;
+    }
+
+    // Parsed and compiled once per directory and arguments; the images are
+    // looked up again for every request
+    string key = directory;
+
+    for (size_t i = argIndex; i < request.size(); ++i) {
+        key += '\0';
+        key += request[i];
+    }
+
+    auto found = jobs.find(key);
+
+    if (found == jobs.end()) {
+        vector<string> args(1, "project2.out");
+        args.insert(args.end(), request.begin() + argIndex, request.end());
+
+        vector<char*> argv;
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv.push_back(&args[i][0]);
+        }
+
+        if (argv.size() < 2) {
+            cout << "Invalid file name." << endl;
+            exit(1);
+        }
+
+        Job parsed = parseJob(1, (int)argv.size(), argv.data());
+
+        if (jobs.size() >= JOB_CACHE_SIZE) {
+            jobs.clear();
+        }
+
+        found = jobs.insert(make_pair(key, parsed)).first;
+    }
+    else {
+        // Printed as parseJob would have, so a cached job reads the same
+        if (found->second.output == "-") {
+            cout.rdbuf(cerr.rdbuf());
+        }
+
+        cout << found->second.messages;
+    }
+
+    Job job = found->second;
+
+    // The standard input is the one of the server, not of the client
+    bool readsStdin = job.firstImage == "-";
+
+    for (Stage const & stage : job.stages) {
+        readsStdin = readsStdin || stage.inputName == "-" || stage.input2Name == "-";
+    }
+
+    if (readsStdin) {
+        cout << "Invalid argument, the server cannot read images from stdin." << endl;
+        exit(1);
+    }
+
+    if (usesMosaics(job)) {
+        runMosaic(job, planar, rle, cacheSize, pool);
+        return "ok";
+    }
+
+    // Clients run in different directories, so the cache is by absolute path
+    ImageLoader load = [&](string const & filename, string const & errorMessage) {
+        return cache.load(absolutePath(directory, filename), errorMessage);
+    };
+
+    TGA image = loadJob(job, load);
+    TGA result = runJob(move(image), job, planar, pool);
+
+    for (Stage & stage : job.stages) {
+        imageBuffers().release(stage.input.imageData);
+        imageBuffers().release(stage.input2.imageData);
+    }
+
+    if (job.output == "-") {
+        return writeShared(result, rle, sequence);
+    }
+
+    cout << "... and saving output to " << job.output << "!" << endl;
+
+    writeTGA(result, job.output, rle);
+
+    // Kept for later jobs that read the output
+    cache.store(absolutePath(directory, job.output), move(result));
+
+    return "ok";
+}
+
+// Runs the requests of the connections accepted on the socket one after
+// another, with the messages of each job sent to its client
+static void runWorker(int listenFd, int threads, size_t cacheSize)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    // A client that goes away only fails the writes to its connection
+    signal(SIGPIPE, SIG_IGN);
+
+    ThreadPool pool(threads);
+    ImageCache cache(cacheSize);
+    map<string, Job> jobs;
+
+    int savedOut = dup(STDOUT_FILENO);
+    int savedErr = dup(STDERR_FILENO);
+    streambuf * coutBuffer = cout.rdbuf();
+    unsigned sequence = 0;
+
+    for (;;) {
+        int connection = accept(listenFd, nullptr, nullptr);
+
+        if (connection < 0) {
+            continue;
+        }
+
+        // Jobs run with the rights of the server, so only its user is served
+        ucred peer;
+        socklen_t peerSize = sizeof(peer);
+
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize) != 0 || peer.uid != getuid()) {
+            close(connection);
+            continue;
+        }
+
+        // A client that stops reading is dropped too, once a write waits as long
+        timeval timeout = { REQUEST_TIMEOUT_MS / 1000, REQUEST_TIMEOUT_MS % 1000 * 1000 };
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        vector<string> request;
+
+        if (readRequest(connection, request)) {
+            cout.flush();
+            fflush(stdout);
+            fflush(stderr);
+
+            dup2(connection, STDOUT_FILENO);
+            dup2(connection, STDERR_FILENO);
+
+            string status = runRequest(request, pool, cache, jobs, cacheSize, ++sequence);
+
+            // parseJob sends the messages to stderr when the output is stdout
+            cout.flush();
+            cout.rdbuf(coutBuffer);
+            cout.clear();
+            cerr.clear();
+            fflush(stdout);
+            fflush(stderr);
+
+            string trailer(1, '\0');
+            trailer += status + "\n";
+            writeAll(connection, trailer.data(), trailer.size());
+
+            dup2(savedOut, STDOUT_FILENO);
+            dup2(savedErr, STDERR_FILENO);
+        }
+
+        close(connection);
+    }
+}
+
+void runServer(string const & socketPath, int threads, size_t cacheSize)
+{
+    int listenFd = listenOn(socketPath);
+
+    strcpy(listeningPath, socketPath.c_str());
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+
+    cout << "... Listening on " << socketPath << endl;
+
+    for (;;) {
+        cout.flush();
+
+        pid_t worker = fork();
+
+        if (worker < 0) {
+            cout << "Error: Cannot start a worker process" << endl;
+            unlink(listeningPath);
+            exit(1);
+        }
+
+        if (worker == 0) {
+            runWorker(listenFd, threads, cacheSize);
+            _exit(0);
+        }
+
+        workerPid = worker;
+
+        int status = 0;
+        while (waitpid(worker, &status, 0) < 0 && errno == EINTR) {
+        }
+
+        workerPid = 0;
+
+        cout << "... Worker stopped, starting a new one" << endl;
+    }
+}
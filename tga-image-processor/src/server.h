@@ -0,0 +1,61 @@
+/**
+ * @file server.h
+ * A server that runs jobs sent over a Unix domain socket, with warm caches
+ *
+ * A request is the arguments of a command line, options included, as the
+ * client got them. It is sent as the number of strings on a line, then the
+ * working directory of the client and every argument, each ending with a zero
+ * byte. The server sends back the messages of the job as it runs, then a zero
+ * byte and a status line: "ok", or "shm NAME SIZE" when the output is "-" and
+ * the image was left in the POSIX shared memory object NAME, SIZE bytes of TGA
+ * file, for the client to copy out and unlink. A connection closed before the
+ * status line is a failed job.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+
+/**
+ * Where the client connects unless told otherwise: project2.sock in the
+ * runtime directory of the user ($XDG_RUNTIME_DIR), which only they can use,
+ * or /tmp/project2-UID.sock without one.
+ */
+inline std::string defaultSocketPath()
+{
+    const char * runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime && *runtime) {
+        return std::string(runtime) + "/project2.sock";
+    }
+
+    return "/tmp/project2-" + std::to_string(getuid()) + ".sock";
+}
+
+/**
+ * Listens on the socket and runs the jobs sent to it one after another until
+ * the process is stopped.
+ *
+ * The jobs run in a worker process that keeps its thread pool, the decoded
+ * images read and written by earlier jobs (while their files are unchanged)
+ * and the compiled stages of the last argument lists between requests. The
+ * options of a request can be --planar and --rle. As on the command line, a
+ * job that fails ends the worker after its error is sent to the client; the
+ * server then starts a new one, with empty caches.
+ *
+ * Only the user running the server can connect: the socket is made readable
+ * and writable by them alone, and connections from other users are closed
+ * without reading anything, since a job reads and writes files as the server.
+ *
+ * Prints an error and exits if the socket cannot be created, if another server
+ * already listens on it, or if something other than a socket is in its place.
+ *
+ * @param socketPath The path of the Unix domain socket
+ * @param threads The number of threads of the pool, 0 for one per core
+ * @param cacheSize The number of bytes of images to keep in memory
+ */
+void runServer(std::string const & socketPath, int threads, size_t cacheSize);
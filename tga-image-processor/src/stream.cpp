@@ -0,0 +1,251 @@
+#include "stream.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include "tga.h"
+
+using namespace std;
+
+// Pixels per block within a band, as in runPipeline
+const int STREAM_BLOCK_SIZE = 1024;
+
+static TGAReader * openInput(string const & filename, TGA const & first, string const & errorMessage)
+{
+    TGAReader * reader = new TGAReader();
+
+    if (!reader->open(filename)) {
+        cout << errorMessage << endl;
+        exit(1);
+    }
+
+    // Images are blended pixel by pixel, so they must all be the same size
+    if (reader->header().width != first.width || reader->header().height != first.height) {
+        cout << "Invalid argument, image dimensions do not match." << endl;
+        exit(1);
+    }
+
+    return reader;
+}
+
+// Reads a band of an image, converted to the number of channels of the chain.
+// The rows of an image stored the other way up from the first one are read one
+// at a time from the other end, so that rows are paired as they are shown.
+static bool readBand(TGAReader & reader, unsigned char * pixels, int channels,
+                     vector<unsigned char> & scratch, size_t first, size_t count, bool mirrored, bool upsideDown)
+{
+    if (upsideDown) {
+        int width = reader.header().width;
+        int height = reader.header().height;
+        int firstRow = (int)(first / width);
+
+        for (int row = 0; row < (int)(count / width); ++row) {
+            if (!readBand(reader, pixels + (size_t)row * width * channels, channels, scratch,
+                          (size_t)(height - 1 - firstRow - row) * width, width, mirrored, false)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    int readerChannels = reader.header().channels();
+
+    if (readerChannels == channels) {
+        return reader.read(pixels, first, count, mirrored);
+    }
+
+    scratch.resize(count * readerChannels);
+
+    if (!reader.read(scratch.data(), first, count, mirrored)) {
+        return false;
+    }
+
+    convertPixels(pixels, channels, scratch.data(), readerChannels, count);
+
+    return true;
+}
+
+// Runs the whole chain over a band, its rows across the pool and each one block by block
+template <typename P>
+static void runBand(vector<Stage> const & stages, unsigned char * trackingBytes,
+                    vector<vector<unsigned char>> const & bands, vector<vector<unsigned char>> const & bands2,
+                    int width, int rows, ThreadPool & pool)
+{
+    vector<StageKernel<P>> kernels = selectKernels<P>(stages);
+
+    pool.parallelFor(rows, max(1, bandRows(width) / 4), [&](int beginRow, int endRow) {
+        int end = endRow * width;
+
+        for (int offset = beginRow * width; offset < end; offset += STREAM_BLOCK_SIZE) {
+            int block = min(STREAM_BLOCK_SIZE, end - offset);
+            P * pixels = (P*)trackingBytes + offset;
+
+            for (size_t i = 0; i < stages.size(); ++i) {
+                const P * input = bands[i].empty() ? nullptr : (const P*)bands[i].data() + offset;
+                const P * input2 = bands2[i].empty() ? nullptr : (const P*)bands2[i].data() + offset;
+
+                kernels[i](stages[i], pixels, pixels, input, input2, block);
+            }
+        }
+    });
+}
+
+void runStreaming(string const & firstImage, vector<Stage> const & stages,
+                  string const & output, int rows, bool rle, ThreadPool & pool)
+{
+    TGAReader source;
+
+    if (!source.open(firstImage)) {
+        cout << "File does not exist." << endl;
+        exit(1);
+    }
+
+    // A vertical flip left at the end only turns the output over in its header
+    TGA header = source.header();
+    size_t end = stages.size();
+
+    if (end > 0 && stages[end - 1].method == METHOD_FLIP_VERTICAL) {
+        header.imageDescriptor ^= 0x20;
+        end--;
+    }
+
+    for (size_t i = 0; i < end; ++i) {
+        Method method = stages[i].method;
+
+        if ((isGeometric(method) && method != METHOD_FLIP) || isNeighborhood(method) || method == METHOD_RESIZE ||
+            usesHistogram(method)) {
+            cout << "Error: Only flip can be streamed, the other geometric methods, the blurs, resize and the histogram methods need whole images." << endl;
+            exit(1);
+        }
+    }
+
+    int width = header.width;
+    size_t count = header.numPixels();
+
+    // Inputs are converted to the channels of the first image as they are read
+    int channels = header.channels();
+
+    vector<unique_ptr<TGAReader>> inputs(stages.size());
+    vector<unique_ptr<TGAReader>> inputs2(stages.size());
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        if (!stages[i].inputName.empty()) {
+            inputs[i].reset(openInput(stages[i].inputName, header, "Invalid argument, file does not exist."));
+        }
+        if (!stages[i].input2Name.empty()) {
+            inputs2[i].reset(openInput(stages[i].input2Name, header, "Invalid argument, file does not exist."));
+        }
+    }
+
+    // Whether the pixels a stage works on are mirrored compared to the output,
+    // which is the case when an odd number of flips come after it
+    vector<bool> mirrored(stages.size());
+    bool flipped = false;
+
+    for (size_t i = stages.size(); i-- > 0; ) {
+        if (stages[i].method == METHOD_FLIP) {
+            flipped = !flipped;
+        }
+        mirrored[i] = flipped;
+    }
+
+    // Whether an input is stored the other way up from the first image
+    bool topFirst = (source.header().imageDescriptor & 0x20) != 0;
+    vector<bool> upsideDown(stages.size());
+    vector<bool> upsideDown2(stages.size());
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        upsideDown[i] = inputs[i] && ((inputs[i]->header().imageDescriptor & 0x20) != 0) != topFirst;
+        upsideDown2[i] = inputs2[i] && ((inputs2[i]->header().imageDescriptor & 0x20) != 0) != topFirst;
+    }
+
+    // Check this before anything is written
+    bool needsSeeking = flipped && !source.isSeekable();
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        if ((mirrored[i] || upsideDown[i]) && inputs[i] && !inputs[i]->isSeekable()) {
+            needsSeeking = true;
+        }
+        if ((mirrored[i] || upsideDown2[i]) && inputs2[i] && !inputs2[i]->isSeekable()) {
+            needsSeeking = true;
+        }
+    }
+
+    if (needsSeeking) {
+        cout << "Error: Flipping while streaming, or streaming images stored the other way up, needs seekable input files." << endl;
+        exit(1);
+    }
+
+    // One band for the image and one for every input, kept in output order
+    size_t bandPixels = min((size_t)rows * width, count);
+
+    vector<unsigned char> tracking(bandPixels * channels);
+    vector<vector<unsigned char>> bands(stages.size());
+    vector<vector<unsigned char>> bands2(stages.size());
+    vector<unsigned char> scratch;
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        if (inputs[i]) {
+            bands[i].resize(bandPixels * channels);
+        }
+        if (inputs2[i]) {
+            bands2[i].resize(bandPixels * channels);
+        }
+    }
+
+    TGAWriter writer;
+
+    if (!writer.open(output, header, rle)) {
+        cerr << "Error: Writing TGA File" << endl;
+        cerr << "Error: Cannot open TGA File: " << output << endl;
+        cerr << "Exiting the program" << endl;
+        exit(1);
+    }
+
+    for (size_t first = 0; first < count; first += bandPixels) {
+        size_t band = min(bandPixels, count - first);
+
+        bool ok = source.read(tracking.data(), first, band, flipped);
+
+        for (size_t i = 0; i < stages.size(); ++i) {
+            if (inputs[i]) {
+                ok = ok && readBand(*inputs[i], bands[i].data(), channels, scratch, first, band, mirrored[i], upsideDown[i]);
+            }
+            if (inputs2[i]) {
+                ok = ok && readBand(*inputs2[i], bands2[i].data(), channels, scratch, first, band, mirrored[i], upsideDown2[i]);
+            }
+        }
+
+        if (!ok) {
+            writer.discard();
+            cout << "Error: Cannot read TGA File." << endl;
+            exit(1);
+        }
+
+        int bandRowCount = (int)(band / width);
+
+        if (channels == 4) {
+            runBand<PixelBGRA>(stages, tracking.data(), bands, bands2, width, bandRowCount, pool);
+        }
+        else {
+            runBand<Pixel>(stages, tracking.data(), bands, bands2, width, bandRowCount, pool);
+        }
+
+        if (!writer.writePixels(tracking.data(), band)) {
+            writer.discard();
+            cerr << "Error: Writing TGA File" << endl;
+            cerr << "Error: Cannot write TGA File: " << output << endl;
+            cerr << "Exiting the program" << endl;
+            exit(1);
+        }
+    }
+
+    if (!writer.close()) {
+        cerr << "Error: Writing TGA File" << endl;
+        cerr << "Error: Cannot write TGA File: " << output << endl;
+        cerr << "Exiting the program" << endl;
+        exit(1);
+    }
+}
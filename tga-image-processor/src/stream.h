@@ -0,0 +1,40 @@
+/**
+ * @file stream.h
+ * Streaming execution of a method chain, a band of rows at a time
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+#include "threadpool.h"
+
+/**
+ * Applies the stages to the first image band by band: a few rows are read from
+ * the first image and from every input, run through the whole chain, and written
+ * out before the next band is read. Peak memory depends on the band size only.
+ *
+ * Flips do not need the whole image either: the bands before a flip are simply
+ * read from the end of their files, in reverse. This needs the inputs to be
+ * uncompressed regular files; streams such as stdin and compressed files can
+ * only be read front to back. A vertical flip at the end of the chain only
+ * flips the origin bit of the output header; the other geometric methods, the
+ * blurs and resize need whole images and cannot be streamed.
+ *
+ * The chain runs on the pixel format of the first image, and the inputs are
+ * converted to it band by band.
+ *
+ * The stage inputs are given by name and opened here. Prints an error and exits
+ * if an image cannot be read or the output cannot be written.
+ *
+ * @param firstImage The file name of the first image of the chain
+ * @param stages The methods to apply
+ * @param output The file name of the output
+ * @param rows The number of rows in a band
+ * @param rle Compress the output with run-length encoding
+ * @param pool The threads to run each band on
+ */
+void runStreaming(std::string const & firstImage, std::vector<Stage> const & stages,
+                  std::string const & output, int rows, bool rle, ThreadPool & pool);
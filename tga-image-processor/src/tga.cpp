@@ -0,0 +1,677 @@
+#include "tga.h"
+#include "buffers.h"
+#include "codec.h"
+
+#include <iostream>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile()
+    : bytes(nullptr), length(0), mapped(false), device(0), inode(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (mapped) {
+        munmap((void*)bytes, length);
+    }
+
+    imageBuffers().release(buffer);
+}
+
+bool MappedFile::open(string const & filename)
+{
+    // "-" reads the image piped in on stdin
+    bool fromStdin = (filename == "-");
+    int fd = fromStdin ? STDIN_FILENO : ::open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = open(fd);
+
+    if (!fromStdin) {
+        close(fd);
+    }
+
+    return ok;
+}
+
+bool MappedFile::open(int fd)
+{
+    struct stat info;
+
+    if (fd != STDIN_FILENO && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void * address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (address != MAP_FAILED) {
+            // The pixels are consumed front to back, let the kernel read ahead
+            madvise(address, info.st_size, MADV_SEQUENTIAL);
+
+            bytes = (const unsigned char*)address;
+            length = info.st_size;
+            mapped = true;
+            device = info.st_dev;
+            inode = info.st_ino;
+
+            return true;
+        }
+    }
+
+    // Not mappable, read the whole file in large chunks instead
+    const size_t chunk = 1 << 20;
+
+    for (;;) {
+        size_t used = buffer.size();
+        buffer.resize(used + chunk);
+
+        ssize_t count = read(fd, buffer.data() + used, chunk);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                buffer.resize(used);
+                continue;
+            }
+            return false;
+        }
+
+        buffer.resize(used + count);
+
+        if (count == 0) {
+            break;
+        }
+    }
+
+    bytes = buffer.data();
+    length = buffer.size();
+
+    return true;
+}
+
+void MappedFile::adopt(vector<unsigned char> & data)
+{
+    buffer.swap(data);
+    data.clear();
+
+    bytes = buffer.data();
+    length = buffer.size();
+}
+
+bool MappedFile::isFile(string const & filename) const
+{
+    struct stat info;
+
+    return mapped && stat(filename.c_str(), &info) == 0 &&
+           info.st_dev == (dev_t)device && info.st_ino == (ino_t)inode;
+}
+
+unsigned char * TGA::writableBytes()
+{
+    if (view) {
+        imageData = imageBuffers().acquire(dataSize());
+        memcpy(imageData.data(), view, dataSize());
+        view = nullptr;
+        mapping.reset();
+    }
+
+    return imageData.data();
+}
+
+unsigned char * TGA::resetBytes()
+{
+    view = nullptr;
+    mapping.reset();
+
+    if (imageData.size() != dataSize()) {
+        imageBuffers().release(imageData);
+        imageData = imageBuffers().acquire(dataSize());
+    }
+
+    return imageData.data();
+}
+
+void shareTGA(TGA & tga)
+{
+    if (tga.view) {
+        return;
+    }
+
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    file->adopt(tga.imageData);
+
+    tga.view = file->data();
+    tga.mapping = file;
+}
+
+void convertPixels(unsigned char * output, int outputChannels,
+                   const unsigned char * input, int inputChannels, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        output[0] = input[0];
+        output[1] = input[1];
+        output[2] = input[2];
+
+        // Pixels without alpha are opaque
+        if (outputChannels == 4) {
+            output[3] = inputChannels == 4 ? input[3] : 255;
+        }
+
+        output += outputChannels;
+        input += inputChannels;
+    }
+}
+
+void setChannels(TGA & tga, int channels)
+{
+    if (tga.channels() == channels) {
+        return;
+    }
+
+    vector<unsigned char> converted = imageBuffers().acquire((size_t)tga.numPixels() * channels);
+    convertPixels(converted.data(), channels, tga.bytes(), tga.channels(), tga.numPixels());
+
+    tga.bitsPerPixel = 8 * channels;
+    tga.imageDescriptor = (tga.imageDescriptor & ~0x0F) | (channels == 4 ? 8 : 0);
+    tga.imageData.swap(converted);
+    tga.view = nullptr;
+    tga.mapping.reset();
+
+    imageBuffers().release(converted);
+}
+
+void setOrigin(TGA & tga, bool topFirst)
+{
+    if (((tga.imageDescriptor & 0x20) != 0) == topFirst) {
+        return;
+    }
+
+    size_t rowBytes = (size_t)tga.width * tga.channels();
+    vector<unsigned char> flipped = imageBuffers().acquire(tga.dataSize());
+    const unsigned char * bytes = tga.bytes();
+
+    for (int row = 0; row < tga.height; ++row) {
+        memcpy(flipped.data() + row * rowBytes, bytes + (size_t)(tga.height - 1 - row) * rowBytes, rowBytes);
+    }
+
+    tga.imageDescriptor ^= 0x20;
+    tga.imageData.swap(flipped);
+    tga.view = nullptr;
+    tga.mapping.reset();
+
+    imageBuffers().release(flipped);
+}
+
+// TGA files are little-endian regardless of the machine
+static short readShort(const unsigned char * bytes)
+{
+    return (short)(bytes[0] | (bytes[1] << 8));
+}
+
+static void writeShort(unsigned char * bytes, short value)
+{
+    bytes[0] = (unsigned char)(value & 0xFF);
+    bytes[1] = (unsigned char)((value >> 8) & 0xFF);
+}
+
+// Fills in the header fields of tga and checks that the format is supported,
+// returns the offset of the first pixel in the file
+static size_t decodeTGAHeader(const unsigned char * header, TGA & tga, string const & filename)
+{
+    tga.idLength = header[0];
+    tga.colorMapType = header[1];
+    tga.dataTypeCode = header[2];
+    tga.colorMapOrigin = readShort(header + 3);
+    tga.colorMapLength = readShort(header + 5);
+    tga.colorMapDepth = header[7];
+    tga.xOrigin = readShort(header + 8);
+    tga.yOrigin = readShort(header + 10);
+    tga.width = readShort(header + 12);
+    tga.height = readShort(header + 14);
+    tga.bitsPerPixel = header[16];
+    tga.imageDescriptor = header[17];
+
+    int type = tga.dataTypeCode;
+    int bits = (unsigned char)tga.bitsPerPixel;
+    int mapDepth = (unsigned char)tga.colorMapDepth;
+
+    bool trueColor = (type == TGA_TRUE_COLOR || type == TGA_RLE_TRUE_COLOR) && (bits == 24 || bits == 32);
+    bool colorMapped = (type == TGA_COLOR_MAPPED || type == TGA_RLE_COLOR_MAPPED) &&
+                       (bits == 8 || bits == 16) && tga.colorMapType == 1 &&
+                       (mapDepth == 15 || mapDepth == 16 || mapDepth == 24 || mapDepth == 32);
+
+    if ((!trueColor && !colorMapped) || tga.width < 0 || tga.height < 0) {
+        cout << "Error: Unsupported TGA File: " << filename << endl;
+        cout << "Only 24 or 32-bit true-color and 8 or 16-bit color-mapped images are supported" << endl;
+        exit(1);
+    }
+
+    // The pixels follow the image ID and the (unused) color map
+    size_t offset = TGA_HEADER_SIZE + (unsigned char)tga.idLength;
+
+    if (tga.colorMapType != 0) {
+        offset += (size_t)(unsigned short)tga.colorMapLength * (((unsigned char)tga.colorMapDepth + 7) / 8);
+    }
+
+    return offset;
+}
+
+// Describes the pixels as they are once decoded: uncompressed 24-bit BGR or
+// 32-bit BGRA with 8 alpha bits
+static void normalizeHeader(TGA & tga, int channels)
+{
+    tga.idLength = 0;
+    tga.colorMapType = 0;
+    tga.dataTypeCode = TGA_TRUE_COLOR;
+    tga.colorMapOrigin = 0;
+    tga.colorMapLength = 0;
+    tga.colorMapDepth = 0;
+    tga.bitsPerPixel = 8 * channels;
+    tga.imageDescriptor = (tga.imageDescriptor & ~0x0F) | (channels == 4 ? 8 : 0);
+}
+
+// Whether the pixels of a file can be used as they are stored
+static bool isPlainPixels(TGA const & header)
+{
+    return header.dataTypeCode == TGA_TRUE_COLOR && decodedChannels(header) * 8 == (unsigned char)header.bitsPerPixel;
+}
+
+TGA readTGA(string const & filename,
+            string const & errorMessage)
+{
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+
+    // Make sure the file is opened successfully
+    if ( !file->open(filename) ) {
+        cout << errorMessage << endl;
+        exit(1);
+    }
+
+    if (file->size() < (size_t)TGA_HEADER_SIZE) {
+        cout << "Error: Invalid TGA File: " << filename << endl;
+        exit(1);
+    }
+
+    TGA tga;
+
+    // Read the header data
+    size_t offset = decodeTGAHeader(file->data(), tga, filename);
+
+    // Compressed and color-mapped pixels are decoded into a buffer of their own,
+    // and so are 32-bit pixels that lose their padding byte
+    if (!isPlainPixels(tga)) {
+        PixelDecoder decoder;
+
+        bool ok = decoder.open(tga, file->data() + TGA_HEADER_SIZE, file->size() - TGA_HEADER_SIZE);
+
+        normalizeHeader(tga, decoder.channels());
+
+        if (!ok || !decoder.decode(tga.resetBytes(), tga.numPixels())) {
+            cout << "Error: Invalid TGA File: " << filename << endl;
+            exit(1);
+        }
+
+        return tga;
+    }
+
+    if (file->size() < offset + tga.dataSize()) {
+        cout << "Error: Truncated TGA File: " << filename << endl;
+        exit(1);
+    }
+
+    // Pixels are arranged in BGR or BGRA format, exactly as the Pixel structs
+    tga.view = file->data() + offset;
+    tga.mapping = file;
+
+    return tga;
+}
+
+void encodeTGAHeader(const TGA & tga, unsigned char * header)
+{
+    // The image ID and color map are never written, so their fields are cleared
+    header[0] = 0;
+    header[1] = 0;
+    header[2] = tga.dataTypeCode;
+    writeShort(header + 3, 0);
+    writeShort(header + 5, 0);
+    header[7] = 0;
+    writeShort(header + 8, tga.xOrigin);
+    writeShort(header + 10, tga.yOrigin);
+    writeShort(header + 12, tga.width);
+    writeShort(header + 14, tga.height);
+    header[16] = tga.bitsPerPixel;
+    header[17] = tga.imageDescriptor;
+}
+
+// Writes every buffer completely, resuming after partial writes
+static bool writeAll(int fd, struct iovec * buffers, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, buffers, count);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        while (count > 0 && (size_t)written >= buffers->iov_len) {
+            written -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+
+        if (count > 0) {
+            buffers->iov_base = (char*)buffers->iov_base + written;
+            buffers->iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+void writeTGA(const TGA & tga, const string & filename, bool rle)
+{
+    const unsigned char * pixels = tga.bytes();
+    size_t size = tga.dataSize();
+    vector<unsigned char> copy;
+    vector<unsigned char> packets;
+
+    if (rle) {
+        encodeRLE(pixels, tga.channels(), tga.width, tga.height, packets);
+
+        pixels = packets.data();
+        size = packets.size();
+    }
+    else if (tga.view && tga.mapping->isFile(filename)) {
+        // Truncating the file the pixels are still mapped from would pull them
+        // out from under the writer, so take a copy first
+        copy.assign(tga.view, tga.view + size);
+        pixels = copy.data();
+    }
+
+    bool toStdout = (filename == "-");
+    int fd = toStdout ? STDOUT_FILENO : ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    // Make sure the file is opened successfully
+    if (fd < 0) {
+        cerr << "Error: Writing TGA File" << endl;
+        cerr << "Error: Cannot open TGA File: " << filename << endl;
+        cerr << "Exiting the program" << endl;
+        exit(1);
+    }
+
+    unsigned char bytes[TGA_HEADER_SIZE];
+    encodeTGAHeader(tga, bytes);
+    bytes[2] = rle ? TGA_RLE_TRUE_COLOR : TGA_TRUE_COLOR;
+
+    // The header and the pixels, arranged in BGR or BGRA format, go out in one call
+    struct iovec buffers[2];
+    buffers[0].iov_base = bytes;
+    buffers[0].iov_len = TGA_HEADER_SIZE;
+    buffers[1].iov_base = (void*)pixels;
+    buffers[1].iov_len = size;
+
+    bool ok = writeAll(fd, buffers, 2);
+
+    if (!toStdout && close(fd) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        cerr << "Error: Writing TGA File" << endl;
+        cerr << "Error: Cannot write TGA File: " << filename << endl;
+        cerr << "Exiting the program" << endl;
+        exit(1);
+    }
+}
+
+// Reads size bytes, resuming after partial reads; false on error or end of file
+static bool readAll(int fd, void * data, size_t size)
+{
+    char * bytes = (char*)data;
+
+    while (size > 0) {
+        ssize_t count = read(fd, bytes, size);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            return false;
+        }
+
+        bytes += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+TGAReader::TGAReader()
+    : fd(-1), seekable(false), dataOffset(0), position(0)
+{
+}
+
+TGAReader::~TGAReader()
+{
+    if (fd > STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+bool TGAReader::open(string const & filename)
+{
+    fd = (filename == "-") ? STDIN_FILENO : ::open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    seekable = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+
+    unsigned char header[TGA_HEADER_SIZE];
+
+    if (!readAll(fd, header, TGA_HEADER_SIZE)) {
+        cout << "Error: Invalid TGA File: " << filename << endl;
+        exit(1);
+    }
+
+    dataOffset = decodeTGAHeader(header, tga, filename);
+
+    // Compressed and color-mapped pixels are decoded front to back out of the
+    // mapped file; a stream is read in whole as the rest of the file
+    if (!isPlainPixels(tga)) {
+        mapping = make_shared<MappedFile>();
+        decoder = make_shared<PixelDecoder>();
+
+        bool ok = mapping->open(fd);
+
+        if (ok) {
+            size_t skip = seekable ? TGA_HEADER_SIZE : 0;
+            ok = decoder->open(tga, mapping->data() + skip, mapping->size() - skip);
+        }
+
+        if (!ok) {
+            cout << "Error: Invalid TGA File: " << filename << endl;
+            exit(1);
+        }
+
+        seekable = false;
+        normalizeHeader(tga, decoder->channels());
+
+        return true;
+    }
+
+    if (seekable && (size_t)info.st_size < dataOffset + tga.dataSize()) {
+        cout << "Error: Truncated TGA File: " << filename << endl;
+        exit(1);
+    }
+
+    // Skip the image ID and the color map of a stream
+    if (!seekable) {
+        vector<unsigned char> skipped(dataOffset - TGA_HEADER_SIZE);
+
+        if (!readAll(fd, skipped.data(), skipped.size())) {
+            cout << "Error: Truncated TGA File: " << filename << endl;
+            exit(1);
+        }
+    }
+
+    return true;
+}
+
+bool TGAReader::read(unsigned char * pixels, size_t first, size_t count, bool mirrored)
+{
+    // A mirrored range is the same number of pixels counted from the end
+    if (mirrored) {
+        first = (size_t)tga.numPixels() - first - count;
+    }
+
+    int channels = tga.channels();
+    size_t size = count * channels;
+    bool ok = true;
+
+    if (seekable) {
+        char * bytes = (char*)pixels;
+        off_t offset = dataOffset + first * channels;
+
+        while (ok && size > 0) {
+            ssize_t done = pread(fd, bytes, size, offset);
+
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+
+            ok = done > 0;
+
+            if (ok) {
+                bytes += done;
+                offset += done;
+                size -= done;
+            }
+        }
+    }
+    else {
+        // Streams and encoded pixels can only be read front to back
+        ok = first == position && (decoder ? decoder->decode(pixels, count) : readAll(fd, pixels, size));
+        position = first + count;
+    }
+
+    if (ok && mirrored && channels == 4) {
+        reverse((PixelBGRA*)pixels, (PixelBGRA*)pixels + count);
+    }
+    else if (ok && mirrored) {
+        reverse((Pixel*)pixels, (Pixel*)pixels + count);
+    }
+
+    return ok;
+}
+
+TGAWriter::TGAWriter()
+    : fd(-1), rle(false), width(0), channels(3)
+{
+}
+
+TGAWriter::~TGAWriter()
+{
+    discard();
+}
+
+void TGAWriter::discard()
+{
+    // Never finished, leave the previous file alone
+    if (fd > STDOUT_FILENO) {
+        ::close(fd);
+        unlink(temporary.c_str());
+    }
+
+    fd = -1;
+}
+
+bool TGAWriter::open(string const & filename, TGA const & header, bool rle)
+{
+    this->rle = rle;
+    width = header.width;
+    channels = header.channels();
+
+    if (filename == "-") {
+        fd = STDOUT_FILENO;
+    }
+    else {
+        // Written next to the file and renamed over it on close, so the output
+        // can also be one of the files being read
+        this->filename = filename;
+        temporary = filename + ".XXXXXX";
+        fd = mkstemp(&temporary[0]);
+
+        if (fd >= 0) {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+    }
+
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned char bytes[TGA_HEADER_SIZE];
+    encodeTGAHeader(header, bytes);
+    bytes[2] = rle ? TGA_RLE_TRUE_COLOR : TGA_TRUE_COLOR;
+
+    return write(bytes, TGA_HEADER_SIZE);
+}
+
+bool TGAWriter::write(const void * data, size_t size)
+{
+    struct iovec buffer;
+    buffer.iov_base = (void*)data;
+    buffer.iov_len = size;
+
+    return writeAll(fd, &buffer, 1);
+}
+
+bool TGAWriter::writePixels(const unsigned char * pixels, size_t count)
+{
+    if (!rle) {
+        return write(pixels, count * channels);
+    }
+
+    packets.clear();
+    encodeRLE(pixels, channels, width, width ? (int)(count / width) : 0, packets);
+
+    return write(packets.data(), packets.size());
+}
+
+bool TGAWriter::close()
+{
+    int closing = fd;
+    fd = -1;
+
+    if (closing == STDOUT_FILENO) {
+        return true;
+    }
+
+    if (::close(closing) != 0 || rename(temporary.c_str(), filename.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
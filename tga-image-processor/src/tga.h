@@ -0,0 +1,297 @@
+/**
+ * @file tga.h
+ * TGA image representation and file I/O
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Size in bytes of the fixed TGA header at the start of every file
+const int TGA_HEADER_SIZE = 18;
+
+struct Pixel
+{
+    // blue, green, red;
+    unsigned char data[3];
+};
+
+struct PixelBGRA
+{
+    // blue, green, red, alpha
+    unsigned char data[4];
+};
+
+/**
+ * Read-only view of a whole file. Regular files are memory mapped; anything that
+ * cannot be mapped (pipes, empty files) is read into memory in large chunks.
+ * The filename "-" reads from stdin.
+ */
+class MappedFile
+{
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(MappedFile const &) = delete;
+    MappedFile & operator=(MappedFile const &) = delete;
+
+    /**
+     * Opens and maps the given file.
+     *
+     * @param filename The file to map
+     * @return false if the file could not be opened or read
+     */
+    bool open(std::string const & filename);
+
+    /**
+     * Maps the file open on fd, or reads the rest of it if it cannot be mapped.
+     * The descriptor is left open.
+     */
+    bool open(int fd);
+
+    /**
+     * Takes over the given bytes instead of reading a file, leaving data empty.
+     */
+    void adopt(std::vector<unsigned char> & data);
+
+    const unsigned char * data() const { return bytes; }
+    size_t size() const { return length; }
+
+    /**
+     * @return true if this is a mapping of the file at the given path
+     */
+    bool isFile(std::string const & filename) const;
+
+  private:
+    const unsigned char * bytes;
+    size_t length;
+    bool mapped;
+    unsigned long long device;
+    unsigned long long inode;
+    std::vector<unsigned char> buffer;
+};
+
+struct TGA
+{
+    // Header
+    char idLength;
+    char colorMapType;
+    char dataTypeCode;
+    short colorMapOrigin;
+    short colorMapLength;
+    char colorMapDepth;
+    short xOrigin;
+    short yOrigin;
+    short width;
+    short height;
+    char bitsPerPixel;
+    char imageDescriptor;
+
+    // Pixels owned by this image, empty while the image is still a view of its file
+    std::vector<unsigned char> imageData;
+
+    // File the pixels are read from, and the first pixel inside of it
+    std::shared_ptr<MappedFile> mapping;
+    const unsigned char * view = nullptr;
+
+    // In size_t, as are the byte counts worked out from it
+    size_t numPixels() const { return (size_t)width * height; }
+
+    /**
+     * @return 4 for BGRA pixels (32 bits with alpha), 3 for BGR pixels
+     */
+    int channels() const { return (unsigned char)bitsPerPixel == 32 ? 4 : 3; }
+
+    /**
+     * @return The number of attribute (alpha) bits per pixel, from the image descriptor
+     */
+    int alphaBits() const { return imageDescriptor & 0x0F; }
+
+    size_t dataSize() const { return numPixels() * channels(); }
+
+    /**
+     * @return The pixel bytes of the image, either owned or still inside the mapped file
+     */
+    const unsigned char * bytes() const { return view ? view : imageData.data(); }
+
+    /**
+     * Copies the pixels out of the mapped file the first time a writable buffer
+     * is needed, and releases the mapping.
+     *
+     * @return The pixel bytes of the image, owned by this image
+     */
+    unsigned char * writableBytes();
+
+    /**
+     * Gives the image a buffer of its own without copying the mapped pixels,
+     * for operations that overwrite every pixel. The contents are unspecified.
+     *
+     * @return The pixel bytes of the image, owned by this image
+     */
+    unsigned char * resetBytes();
+
+    // The same, as BGR pixels; only valid when channels() is 3
+    const Pixel * pixels() const { return (const Pixel*)bytes(); }
+    Pixel * writablePixels() { return (Pixel*)writableBytes(); }
+    Pixel * resetPixels() { return (Pixel*)resetBytes(); }
+};
+
+/**
+ * Reads a TGA file. The header is validated once and uncompressed 24-bit and
+ * 32-bit pixels are left in the mapped file until the image is modified.
+ * RLE-compressed and color-mapped images are decoded into 24-bit or 32-bit
+ * pixels, and the header of the result describes them as uncompressed.
+ *
+ * 32-bit pixels only keep their fourth byte when the image descriptor gives
+ * them alpha bits; without any, the byte is padding and is dropped.
+ *
+ * Prints errorMessage and exits if the file cannot be opened.
+ */
+TGA readTGA(std::string const & filename,
+            std::string const & errorMessage = "Error: Cannot open TGA File");
+
+/**
+ * Moves the pixels the image owns into a read-only buffer that its copies share,
+ * the way copies of an image read from a file share the mapping. Copying the
+ * image is then cheap, and writing to a copy copies the pixels first.
+ */
+void shareTGA(TGA & tga);
+
+/**
+ * Converts the pixels of the image to the given number of channels, dropping
+ * the alpha channel or adding an opaque one. Does nothing if they match.
+ */
+void setChannels(TGA & tga, int channels);
+
+/**
+ * Reverses the order of the rows of the image if its origin bit does not put
+ * the first row where topFirst says, and sets the bit to match. Images paired
+ * pixel by pixel then line up as they are shown. Does nothing if they match.
+ */
+void setOrigin(TGA & tga, bool topFirst);
+
+/**
+ * Converts count pixels from one number of channels to another, as setChannels.
+ * The ranges must not overlap.
+ */
+void convertPixels(unsigned char * output, int outputChannels,
+                   const unsigned char * input, int inputChannels, size_t count);
+
+/**
+ * Encodes the 18-byte file header of the given image.
+ */
+void encodeTGAHeader(const TGA & tga, unsigned char * header);
+
+/**
+ * Writes the header and the pixels of the image with a single writev call.
+ * The filename "-" writes to stdout so the image can be piped into another process.
+ *
+ * Prints an error and exits if the file cannot be written.
+ *
+ * @param rle Compress the pixels with run-length encoding (image type 10)
+ */
+void writeTGA(const TGA & tga, const std::string & filename, bool rle = false);
+
+class PixelDecoder;
+
+/**
+ * Reads the pixels of a TGA file a range at a time, without holding the rest of
+ * the file in memory. Uncompressed regular files can be read in any order;
+ * streams such as stdin ("-") and compressed or color-mapped files only front
+ * to back.
+ */
+class TGAReader
+{
+  public:
+    TGAReader();
+    ~TGAReader();
+
+    TGAReader(TGAReader const &) = delete;
+    TGAReader & operator=(TGAReader const &) = delete;
+
+    /**
+     * Opens the file and reads its header. Prints an error and exits if the
+     * file is not a supported TGA file.
+     *
+     * @return false if the file cannot be opened
+     */
+    bool open(std::string const & filename);
+
+    /**
+     * @return The header of the file, without any pixels
+     */
+    TGA const & header() const { return tga; }
+
+    bool isSeekable() const { return seekable; }
+
+    /**
+     * Reads count pixels starting at pixel first, with header().channels()
+     * bytes per pixel.
+     *
+     * @param mirrored Read the range counted from the end of the image instead,
+     *                 in reverse order, as if the image had been flipped
+     * @return false if the pixels cannot be read
+     */
+    bool read(unsigned char * pixels, size_t first, size_t count, bool mirrored = false);
+
+  private:
+    int fd;
+    bool seekable;
+    size_t dataOffset;
+    size_t position;
+    TGA tga;
+
+    // Decodes compressed or color-mapped pixels out of the mapped file
+    std::shared_ptr<MappedFile> mapping;
+    std::shared_ptr<PixelDecoder> decoder;
+};
+
+/**
+ * Writes a TGA file a range of pixels at a time. The filename "-" writes to stdout.
+ * Files only replace the previous file once they have been closed successfully.
+ */
+class TGAWriter
+{
+  public:
+    TGAWriter();
+    ~TGAWriter();
+
+    TGAWriter(TGAWriter const &) = delete;
+    TGAWriter & operator=(TGAWriter const &) = delete;
+
+    /**
+     * Creates the file and writes the header of the given image.
+     *
+     * @param rle Compress the pixels with run-length encoding (image type 10)
+     * @return false if the file cannot be created or written
+     */
+    bool open(std::string const & filename, TGA const & header, bool rle = false);
+
+    bool write(const void * data, size_t size);
+
+    /**
+     * Writes whole rows of pixels, compressing them if the file is RLE.
+     */
+    bool writePixels(const unsigned char * pixels, size_t count);
+
+    bool close();
+
+    /**
+     * Stops writing and removes the unfinished file.
+     */
+    void discard();
+
+  private:
+    int fd;
+    std::string filename;
+    std::string temporary;
+
+    bool rle;
+    int width;
+    int channels;
+    std::vector<unsigned char> packets;
+};
@@ -0,0 +1,109 @@
+#include "threadpool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threads)
+    : jobTask(nullptr), jobCount(0), jobGrain(1), next(0), active(0), generation(0), stopping(false)
+{
+    if (threads <= 0) {
+        threads = thread::hardware_concurrency();
+    }
+
+    for (int i = 1; i < threads; ++i) {
+        workers.push_back(thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+}
+
+void ThreadPool::parallelFor(int count, int grain, function<void(int, int)> const & task)
+{
+    if (grain < 1) {
+        grain = 1;
+    }
+
+    // Not worth waking anybody up for a single chunk
+    if (workers.empty() || count <= grain) {
+        if (count > 0) {
+            task(0, count);
+        }
+        return;
+    }
+
+    lock_guard<std::mutex> job(jobMutex);
+
+    {
+        lock_guard<std::mutex> lock(stateMutex);
+
+        jobTask = &task;
+        jobCount = count;
+        jobGrain = grain;
+        next = 0;
+        active = workers.size();
+        generation++;
+    }
+
+    wake.notify_all();
+
+    runChunks();
+
+    unique_lock<std::mutex> lock(stateMutex);
+    done.wait(lock, [this] { return active == 0; });
+
+    jobTask = nullptr;
+}
+
+void ThreadPool::runChunks()
+{
+    // Chunks are handed out in order to whichever thread asks first
+    for (;;) {
+        int begin = next.fetch_add(jobGrain);
+
+        if (begin >= jobCount) {
+            break;
+        }
+
+        int end = begin + jobGrain < jobCount ? begin + jobGrain : jobCount;
+
+        (*jobTask)(begin, end);
+    }
+}
+
+void ThreadPool::work()
+{
+    unsigned seen = 0;
+
+    for (;;) {
+        {
+            unique_lock<std::mutex> lock(stateMutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+
+            if (stopping) {
+                return;
+            }
+
+            seen = generation;
+        }
+
+        runChunks();
+
+        {
+            lock_guard<std::mutex> lock(stateMutex);
+            active--;
+        }
+
+        done.notify_one();
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * @file threadpool.h
+ * Fixed set of worker threads for splitting image operations across cores, and
+ * a queue for passing work between threads
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class ThreadPool
+{
+  public:
+    /**
+     * @param threads The total number of threads to run on, including the
+     *                thread calling parallelFor; 0 uses every core
+     */
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool & operator=(ThreadPool const &) = delete;
+
+    int size() const { return (int)workers.size() + 1; }
+
+    /**
+     * Splits [0, count) into chunks of grain items and calls task(begin, end)
+     * on each of them, spread over all the threads. The calling thread takes
+     * chunks too, and the call returns once every chunk is done.
+     *
+     * Calls from different threads run one after another; a task must not
+     * call parallelFor itself.
+     */
+    void parallelFor(int count, int grain, std::function<void(int, int)> const & task);
+
+  private:
+    void work();
+    void runChunks();
+
+    std::vector<std::thread> workers;
+
+    // Serializes parallelFor calls
+    std::mutex jobMutex;
+
+    // Guards the current job and wakes the workers up for it
+    std::mutex stateMutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(int, int)> * jobTask;
+    int jobCount;
+    int jobGrain;
+    std::atomic<int> next;
+    int active;
+    unsigned generation;
+    bool stopping;
+};
+
+/**
+ * Queue of at most a fixed number of items, for handing work from one thread
+ * to another. push waits while the queue is full and pop while it is empty,
+ * so a fast producer cannot get more than capacity items ahead.
+ */
+template <typename T>
+class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity), closed(false)
+    {
+    }
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    /**
+     * Waits for the next item.
+     *
+     * @return false once the queue is closed and empty
+     */
+    bool pop(T & item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+
+        if (items.empty()) {
+            return false;
+        }
+
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+
+        return true;
+    }
+
+    /**
+     * Ends the queue after the items already in it.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+  private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};